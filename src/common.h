@@ -21,6 +21,14 @@
 // Raised for SHA-3
 #define MAX_ALGORITHM_CONTEXT_SIZE 384
 
+/* Compilers that can build the SHA-1 and SHA-256 kernels for the x86 SHA extensions,
+ * and the AVX2 and AVX-512 lane kernels in multibuffer.cpp
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define HAVE_SHA_NI
+#define HAVE_LANE_KERNELS
+#endif
+
 #ifdef _WIN32
 /* For some reason this doesn't work properly with mingw */
 #undef HAVE_EXTERN_PROGNAME
@@ -30,9 +30,11 @@
 #ifdef _WIN32
 #define TSTAT(path,buf) _wstat64(path,buf)
 #define TLSTAT(path,buf) _wstat64(path,buf) // no lstat on windows
+#define TFSTAT(fd,buf) _fstat64(fd,buf)
 #else
 #define TSTAT(path,buf) stat(path,buf)
 #define TLSTAT(path,buf) lstat(path,buf)
+#define TFSTAT(fd,buf) fstat(fd,buf)
 #endif
 
 // Returns TRUE if the directory is '.' or '..', otherwise FALSE
@@ -69,9 +71,38 @@ file_types file_metadata_t::decode_file_type(const struct __stat64 &sb)
     return stat_unknown;
 }
 
+void file_metadata_t::decode_stat(const struct __stat64 &sb,file_metadata_t *m)
+{
+  m->fileid.dev = sb.st_dev;
+  m->fileid.ino = sb.st_ino;		// not meaningful on windows; see stat()
+  m->have_fileid = true;
+  m->nlink      = sb.st_nlink;
+  m->size       = sb.st_size;
+  m->ctime      = sb.st_ctime;
+  m->mtime      = sb.st_mtime;
+  m->atime      = sb.st_atime;
+#ifdef HAVE_STRUCT_STAT_ST_BLKSIZE
+  m->blksize    = sb.st_blksize;
+#endif
+}
+
+/*
+ * The stat() function does not return file size for raw devices.
+ * If we have no file size, try to use the find_file_size function,
+ * which calls ioctl.
+ */
+static void find_device_size(const tstring &fn,file_metadata_t *m,class display &ocb)
+{
+  FILE *f = _tfopen(fn.c_str(),_TEXT("rb"));
+  if(f){
+    m->size = find_file_size(f,&ocb);
+    fclose(f); f = 0;
+  }
+}
+
 /**
  * stat a file and return the appropriate object
- * This would better be done on an open file handle
+ * This would better be done on an open file handle; see fstat() below.
  */
 int file_metadata_t::stat(const tstring &fn,
 			  file_metadata_t *m,
@@ -83,42 +114,65 @@ int file_metadata_t::stat(const tstring &fn,
     ocb.error_filename(fn,"%s",strerror(errno));
     return -1;
   }
-  m->fileid.dev = sb.st_dev;
+  decode_stat(sb,m);
 #ifdef _WIN32
+  /*
+   * The file index takes the place of the inode number. Opening the file
+   * without FILE_FLAG_OPEN_REPARSE_POINT gets the index of a junction's
+   * target, as stat() follows a symlink, so a junction back up the tree
+   * is seen as a cycle.
+   */
+  m->have_fileid = false;
   BY_HANDLE_FILE_INFORMATION fileinfo;
   HANDLE filehandle = CreateFile(fn.c_str(),
 				 0,   // desired access
 				 FILE_SHARE_READ,
 				 NULL,  
 				 OPEN_EXISTING,
-				 (FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_BACKUP_SEMANTICS),
+				 FILE_FLAG_BACKUP_SEMANTICS, // needed to open a directory
 				 NULL);
-  // RBF - Error check CreateFile
-  (void)GetFileInformationByHandle(filehandle, &fileinfo);
-  CloseHandle(filehandle);
-  m->fileid.ino = (((uint64_t)fileinfo.nFileIndexHigh)<<32) | (fileinfo.nFileIndexLow);
-#else
-  m->fileid.ino = sb.st_ino;
+  if (filehandle != INVALID_HANDLE_VALUE)
+  {
+    if (GetFileInformationByHandle(filehandle, &fileinfo))
+    {
+      m->fileid.ino = (((uint64_t)fileinfo.nFileIndexHigh)<<32) | (fileinfo.nFileIndexLow);
+      m->have_fileid = true;
+    }
+    CloseHandle(filehandle);
+  }
 #endif
-  m->nlink      = sb.st_nlink;
-  if(sb.st_size!=0){
-	m->size       = sb.st_size;
-  } else {
-	/*
-	 * The stat() function does not return file size for raw devices.
-	 * If we have no file size, try to use the find_file_size function,
-	 * which calls ioctl.
-	 */
-	FILE *f = _tfopen(fn.c_str(),_TEXT("rb"));
-	if(f){
-		m->size = find_file_size(f,&ocb);
-		fclose(f); f = 0;
-	}
+  if(sb.st_size==0 && !S_ISREG(sb.st_mode)){
+    find_device_size(fn,m,ocb);
   }
-  m->ctime      = sb.st_ctime;
-  m->mtime      = sb.st_mtime;
-  m->atime      = sb.st_atime;
+  return 0;
+}
 
+/**
+ * stat a file that we have open. The path is only used for messages
+ * and to find the size of raw devices.
+ */
+int file_metadata_t::fstat(int fd,const tstring &fn,
+			   file_metadata_t *m,
+			   class display &ocb)
+{
+  struct __stat64 sb;
+  if (::TFSTAT(fd,&sb))
+  {
+    ocb.error_filename(fn,"%s",strerror(errno));
+    return -1;
+  }
+  decode_stat(sb,m);
+#ifdef _WIN32
+  BY_HANDLE_FILE_INFORMATION fileinfo;
+  if(GetFileInformationByHandle((HANDLE)_get_osfhandle(fd), &fileinfo)){
+    m->fileid.ino = (((uint64_t)fileinfo.nFileIndexHigh)<<32) | (fileinfo.nFileIndexLow);
+  } else {
+    m->have_fileid = false;
+  }
+#endif
+  if(sb.st_size==0 && !S_ISREG(sb.st_mode)){
+    find_device_size(fn,m,ocb);
+  }
   return 0;
 }
 
@@ -160,6 +214,21 @@ file_types state::file_type(const tstring &fn,display *ocb,uint64_t *filesize,
     return file_metadata_t::decode_file_type(sb);
 }
 
+/* Like file_type() above, but give everything lstat returned, so that it
+ * can travel with the file to the thread that hashes it.
+ */
+file_types state::file_type(const tstring &fn,display *ocb,file_metadata_t *m)
+{
+    struct __stat64 sb;
+    memset(&sb,0,sizeof(sb));
+    if (TLSTAT(fn.c_str(),&sb))  {
+	if(ocb) ocb->error_filename(fn,"%s", strerror(errno));
+	return stat_unknown;
+    }
+    file_metadata_t::decode_stat(sb,m);
+    return file_metadata_t::decode_file_type(sb);
+}
+
 
 
 /****************************************************************
@@ -169,34 +238,108 @@ file_types state::file_type(const tstring &fn,display *ocb,uint64_t *filesize,
  ****************************************************************/
 
 
-void state::done_processing_dir(const tstring &fn_)
+/* Mix the device and inode numbers; inodes are often sequential */
+static inline size_t hash_fileid(const file_metadata_t::fileid_t &id)
+{
+    uint64_t h = id.ino ^ (id.dev * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t)h;
+}
+
+size_t dir_table_t::find(const file_metadata_t::fileid_t &id) const
+{
+    size_t mask = slots.size()-1;
+    size_t i = hash_fileid(id) & mask;
+    while(slots[i].used && !(slots[i].id==id)){
+	i = (i+1) & mask;		// linear probing
+    }
+    return i;
+}
+
+void dir_table_t::grow()
+{
+    std::vector<slot> old(slots.size()*2);
+    old.swap(slots);
+    for(std::vector<slot>::const_iterator it=old.begin();it!=old.end();it++){
+	if(it->used) slots[find(it->id)] = *it;
+    }
+}
+
+bool dir_table_t::insert(const file_metadata_t::fileid_t &id)
+{
+    M.lock();
+    size_t i = find(id);
+    bool added = !slots[i].used;
+    if(added){
+	slots[i].used = true;
+	slots[i].id   = id;
+	if(++count*2 > slots.size()) grow(); // keep the probes short
+    }
+    M.unlock();
+    return added;
+}
+
+/* Remove by shifting back the entries after it that would no longer be
+ * found, so that we never need tombstones.
+ */
+bool dir_table_t::erase(const file_metadata_t::fileid_t &id)
+{
+    M.lock();
+    size_t mask = slots.size()-1;
+    size_t i = find(id);
+    bool found = slots[i].used;
+    if(found){
+	slots[i].used = false;
+	count--;
+	for(size_t j=(i+1)&mask; slots[j].used; j=(j+1)&mask){
+	    size_t home = hash_fileid(slots[j].id) & mask;
+	    // move j into the hole at i unless its home lies in (i,j]
+	    if(((j-home)&mask) >= ((j-i)&mask)){
+		slots[i] = slots[j];
+		slots[j].used = false;
+		i = j;
+	    }
+	}
+    }
+    M.unlock();
+    return found;
+}
+
+bool dir_table_t::contains(const file_metadata_t::fileid_t &id) const
+{
+    M.lock();
+    bool found = slots[find(id)].used;
+    M.unlock();
+    return found;
+}
+
+
+void state::done_processing_dir(const tstring &fn,const file_metadata_t::fileid_t &id)
 {
-    tstring fn = global::get_realpath(fn_);
-    dir_table_t::iterator pos = dir_table.find(fn);
-    if(pos==dir_table.end()){
-	ocb.internal_error("%s: Directory '%s' not found in done_processing_dir", progname.c_str(), fn.c_str());
+    if(dir_table.erase(id)==false){
+	ocb.internal_error("%s: Directory '%s' not found in done_processing_dir", progname.c_str(),
+			   global::make_utf8(fn).c_str());
 	// will not be reached.
     }
-    dir_table.erase(pos);
 }
 
 
-void state::processing_dir(const tstring &fn_)
+void state::processing_dir(const tstring &fn,const file_metadata_t::fileid_t &id)
 {
-    tstring fn = global::get_realpath(fn_);
-    if (dir_table.find(fn)!=dir_table.end())
+    if (dir_table.insert(id)==false)
     {
-      ocb.internal_error("%s: Attempt to add existing %s in processing_dir", progname.c_str(), fn.c_str());
+      ocb.internal_error("%s: Attempt to add existing %s in processing_dir", progname.c_str(),
+			 global::make_utf8(fn).c_str());
       // will not be reached.
     }
-    dir_table.insert(fn);
 }
 
 
-bool state::have_processed_dir(const tstring &fn_)
+bool state::have_processed_dir(const file_metadata_t::fileid_t &id)
 {
-    tstring fn = global::get_realpath(fn_);
-    return dir_table.find(fn)!=dir_table.end();
+    return dir_table.contains(id);
 }
 
 /****************************************************************
@@ -506,7 +649,19 @@ void state::process_dir(const tstring &fn)
 
     if(opt_debug) std::cerr << "*** process_dir(" << global::make_utf8(fn) << ")\n";
 
-    if (have_processed_dir(fn)) {
+#ifdef HAVE_DIR_WALKER
+    if (walker) {
+	walker->add(fn);		// the walker threads take it from here
+	return;
+    }
+#endif
+
+    // stat follows symlinks, so a link back up the tree has its target's identity
+    file_metadata_t m;
+    if (file_metadata_t::stat(fn,&m,ocb)) {
+	return ;			// error already printed
+    }
+    if (m.have_fileid && have_processed_dir(m.fileid)) {
 	ocb.error_filename(fn,"symlink creates cycle");
 	return ;
     }
@@ -550,11 +705,12 @@ void state::process_dir(const tstring &fn)
     }
     _tclosedir(current_dir);		// done with this directory
 
-    processing_dir(fn);			// note that we are now processing a directory
+    /* If we couldn't identify it, it can't be part of a cycle we detect */
+    if (m.have_fileid) processing_dir(fn,m.fileid); // note that we are now processing a directory
     for(std::vector<tstring>::const_iterator it = dir_entries.begin();it!=dir_entries.end();it++){
 	dig_normal(*it);
     }
-    done_processing_dir(fn);		// note that we are done with this directory
+    if (m.have_fileid) done_processing_dir(fn,m.fileid); // note that we are done with this directory
     return ;
 }
 
@@ -696,8 +852,11 @@ bool state::should_hash_expert(const tstring &fn, file_types type)
 
 bool state::should_hash(const tstring &fn)
 {
-    file_types type = state::file_type(fn,&ocb,0,0,0,0);
-  
+    return should_hash(fn,state::file_type(fn,&ocb,0,0,0,0));
+}
+
+bool state::should_hash(const tstring &fn, file_types type)
+{
     if (mode_expert) 
       return should_hash_expert(fn,type);
 
@@ -735,10 +894,238 @@ void state::dig_normal(const tstring &fn_) {
 #endif
   if (opt_debug) 
     ocb.status("*** cleaned:%s",global::make_utf8(fn).c_str());
-  if (should_hash(fn))
-    ocb.hash_file(fn);
+  // lstat tells us what a regular file's hasher needs, so it doesn't stat again
+  file_metadata_t m;
+  file_types type = file_type(fn,&ocb,&m);
+  if (should_hash(fn,type))
+    ocb.hash_file(fn,type==stat_regular ? &m : 0);
+}
+
+
+#ifdef HAVE_DIR_WALKER
+/****************************************************************
+ *** The parallel directory walker (-J)
+ ****************************************************************/
+
+dir_walker::dir_walker(state *s_,unsigned int nthreads):
+    s(s_),M(),TOWALKER(),TOMAIN(),tasks(),threads(),pending(0),open_dirs(0),quit(false),current()
+{
+    if(pthread_cond_init(&TOWALKER,NULL)) s->ocb.fatal_error("dir_walker: pthread_cond_init failed");
+    if(pthread_cond_init(&TOMAIN,NULL))   s->ocb.fatal_error("dir_walker: pthread_cond_init failed");
+    if(pthread_key_create(&current,NULL)) s->ocb.fatal_error("dir_walker: pthread_key_create failed");
+    for(unsigned int i=0;i<nthreads;i++){
+	pthread_t thread;
+	if(pthread_create(&thread,NULL,dir_walker::start_walker,(void *)this)){
+	    s->ocb.fatal_error("dir_walker: pthread_create failed");
+	}
+	threads.push_back(thread);
+    }
+}
+
+dir_walker::~dir_walker()
+{
+    M.lock();
+    quit = true;
+    pthread_cond_broadcast(&TOWALKER);
+    M.unlock();
+    for(size_t i=0;i<threads.size();i++){
+	pthread_join(threads[i],0);
+    }
+    pthread_cond_destroy(&TOWALKER);
+    pthread_cond_destroy(&TOMAIN);
+    pthread_key_delete(current);
+}
+
+void *dir_walker::start_walker(void *arg)
+{
+    ((dir_walker *)arg)->run();
+    return 0;
+}
+
+/*
+ * Queue a directory. If we are called by a walker thread,
+ * it is an entry of the directory that thread is reading.
+ */
+void dir_walker::add(const tstring &path)
+{
+    dir_node *parent = (dir_node *)pthread_getspecific(current);
+    tstring name = path;
+    if(parent){
+	size_t delim = path.rfind(DIR_SEPARATOR);
+	if(delim!=tstring::npos) name = path.substr(delim+1);
+    }
+    M.lock();
+    if(parent) parent->refs++;
+    tasks.push_back(new dir_task(path,name,parent));
+    pending++;
+    pthread_cond_signal(&TOWALKER);
+    M.unlock();
+}
+
+void dir_walker::wait()
+{
+    M.lock();
+    while(pending>0){
+	pthread_cond_wait(&TOMAIN,&M.mutex);
+    }
+    M.unlock();
+}
+
+/* Drop a reference to a directory; the last one closes it and drops its parent */
+void dir_walker::release(dir_node *n)
+{
+    M.lock();
+    while(n && --n->refs==0){
+	dir_node *parent = n->parent;
+	if(n->fd>=0){
+	    close(n->fd);
+	    open_dirs--;
+	}
+	delete n;
+	n = parent;
+    }
+    M.unlock();
 }
 
+void dir_walker::run()
+{
+    M.lock();
+    while(true){
+	while(tasks.empty() && quit==false){
+	    pthread_cond_wait(&TOWALKER,&M.mutex);
+	}
+	if(tasks.empty()) break;	// quitting
+	dir_task *t = tasks.back();
+	tasks.pop_back();
+	M.unlock();
+
+	walk(t);
+	delete t;
+
+	M.lock();
+	if(--pending==0) pthread_cond_broadcast(&TOMAIN);
+    }
+    M.unlock();
+}
+
+/*
+ * Read one directory and process its entries, like process_dir().
+ * The directory is open the whole time, so entries are looked up
+ * relative to it with fstatat() when readdir() doesn't tell us their type.
+ */
+void dir_walker::walk(dir_task *t)
+{
+    if(opt_debug) std::cerr << "*** dir_walker::walk(" << global::make_utf8(t->path) << ")\n";
+
+    int fd = -1;
+    if(t->parent && t->parent->fd>=0){
+	fd = openat(t->parent->fd,t->name.c_str(),O_RDONLY|O_DIRECTORY);
+    } else {
+	fd = open(t->path.c_str(),O_RDONLY|O_DIRECTORY);
+    }
+    if(fd<0){
+	s->ocb.error_filename(t->path,"%s", strerror(errno));
+	release(t->parent);
+	return;
+    }
+
+    struct __stat64 sb;
+    if(fstat(fd,&sb)){
+	s->ocb.error_filename(t->path,"%s", strerror(errno));
+	close(fd);
+	release(t->parent);
+	return;
+    }
+
+    /* A directory that is also one of its own parents is a symlink cycle */
+    file_metadata_t::fileid_t id(sb.st_dev,sb.st_ino);
+    for(dir_node *n=t->parent;n;n=n->parent){
+	if(n->id==id){
+	    s->ocb.error_filename(t->path,"symlink creates cycle");
+	    close(fd);
+	    release(t->parent);
+	    return;
+	}
+    }
+
+    /* Read all of the entries, then process them (as process_dir does) */
+    std::vector<std::pair<tstring,unsigned char> > entries;
+    int dfd = dup(fd);
+    DIR *dir = dfd>=0 ? fdopendir(dfd) : 0;
+    if(dir==0){
+	s->ocb.error_filename(t->path,"%s", strerror(errno));
+	if(dfd>=0) close(dfd);
+	close(fd);
+	release(t->parent);
+	return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+	if (is_special_dir(entry->d_name)) continue;
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+	entries.push_back(std::make_pair(tstring(entry->d_name),(unsigned char)entry->d_type));
+#else
+	entries.push_back(std::make_pair(tstring(entry->d_name),(unsigned char)0));
+#endif
+    }
+    closedir(dir);
+
+    /* Keep the descriptor for our subdirectories, unless too many are open */
+    M.lock();
+    bool keep = open_dirs < MAX_OPEN_DIRS;
+    if(keep) open_dirs++;
+    M.unlock();
+    dir_node *node = new dir_node(t->parent,id,keep ? fd : -1);
+
+    pthread_setspecific(current,node);	// so that process_dir() can find us
+    for(size_t i=0;i<entries.size();i++){
+	const tstring &name = entries[i].first;
+	tstring path = t->path;
+	if (0 == path.size() || path[path.size()-1]!=DIR_SEPARATOR){
+	    path.push_back(DIR_SEPARATOR);
+	}
+	path.append(name);
+	s->clean_name_posix(path);	// as dig_normal() does
+
+	file_types type = stat_unknown;
+	file_metadata_t m;
+	bool have_type = true;
+	bool have_metadata = false;
+	switch(entries[i].second){
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+	case DT_REG:  type = stat_regular;   break;
+	case DT_DIR:  type = stat_directory; break;
+	case DT_LNK:  type = stat_symlink;   break;
+	case DT_BLK:  type = stat_block;     break;
+	case DT_CHR:  type = stat_character; break;
+	case DT_FIFO: type = stat_pipe;      break;
+#ifdef DT_SOCK
+	case DT_SOCK: type = stat_socket;    break;
+#endif
+#endif
+	default: have_type = false;	// DT_UNKNOWN; we have to ask
+	}
+	if(have_type==false){
+	    struct __stat64 esb;
+	    if(fstatat(fd,name.c_str(),&esb,AT_SYMLINK_NOFOLLOW)){
+		s->ocb.error_filename(path,"%s", strerror(errno));
+		continue;
+	    }
+	    type = file_metadata_t::decode_file_type(esb);
+	    file_metadata_t::decode_stat(esb,&m);
+	    have_metadata = (type==stat_regular);
+	}
+	if(s->should_hash(path,type)){
+	    s->ocb.hash_file(path,have_metadata ? &m : 0); // only to choose how to schedule it
+	}
+    }
+    pthread_setspecific(current,0);
+
+    if(!keep) close(fd);
+    release(node);			// our reference; our subdirectories have their own
+}
+#endif
+
 
 #ifdef _WIN32
 /**
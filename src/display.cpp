@@ -33,8 +33,222 @@ void display::set_outfilename(std::string outfilename)
     out = &myoutstream;
 }
 
+display::output_buffer *display::my_output_buffer()
+{
+    output_buffer *b = (output_buffer *)pthread_getspecific(output_key);
+    if(b==0){
+	b = new output_buffer();
+	b->buf.reserve(OUTPUT_BUFFER_SIZE+MAX_STRING_LENGTH);
+	pthread_setspecific(output_key,b);
+	lock();
+	output_buffers.push_back(b);
+	unlock();
+    }
+    return b;
+}
+
+void display::flush_output_buffer(output_buffer *b)
+{
+    b->M.lock();
+    if(b->buf.size()>0){
+	if(dfxml){			// it's fileobjects
+	    dfxml->write_fragment(b->buf);
+	    dfxml->flush();
+	} else {
+	    out->write(b->buf.data(),b->buf.size());
+	    out->flush();
+	}
+	b->buf.clear();
+    }
+    b->last_flush = time(0);
+    b->M.unlock();
+}
+
+/**
+ * The flusher thread. Every OUTPUT_FLUSH_SECONDS, it writes the buffers
+ * that have been waiting that long, until buffering is turned off.
+ */
+void *display::flusher_main(void *arg)
+{
+    ((display *)arg)->flush_due_output();
+    return 0;
+}
+
+void display::flush_due_output()
+{
+    lock();
+    while(buffer_output){
+	struct timeval now;
+	gettimeofday(&now,0);
+	struct timespec until;
+	until.tv_sec  = now.tv_sec + OUTPUT_FLUSH_SECONDS;
+	until.tv_nsec = now.tv_usec * 1000;
+	pthread_cond_timedwait(&flusher_cond,&M.mutex,&until);
+	if(buffer_output==false) break;
+	time_t due = time(0) - OUTPUT_FLUSH_SECONDS;
+	for(std::vector<output_buffer *>::const_iterator it=output_buffers.begin();it!=output_buffers.end();it++){
+	    if((*it)->last_flush <= due) flush_output_buffer(*it);
+	}
+	if(ordered_out.last_flush <= due) flush_output_buffer(&ordered_out);
+    }
+    unlock();
+}
+
+void display::set_buffered_output(bool on)
+{
+    bool stop_flusher = false;
+    lock();
+    if(on==false){
+	for(std::vector<output_buffer *>::const_iterator it=output_buffers.begin();it!=output_buffers.end();it++){
+	    flush_output_buffer(*it);
+	}
+	/* Only a fatal error leaves files out of order here; write what we have */
+	for(std::map<uint64_t,std::string>::iterator it=ordered_pending.begin();it!=ordered_pending.end();it++){
+	    ordered_out.buf += it->second;
+	}
+	for(std::map<uint64_t,std::string>::iterator it=ordered_after.begin();it!=ordered_after.end();it++){
+	    ordered_out.buf += it->second;
+	}
+	ordered_pending.clear();
+	ordered_after.clear();
+	flush_output_buffer(&ordered_out);
+    }
+    buffer_output = on;
+    if(on && flusher_running==false){
+	if(pthread_create(&flusher,NULL,flusher_main,this)==0) flusher_running = true;
+    }
+    if(on==false && flusher_running){
+	pthread_cond_signal(&flusher_cond);
+	flusher_running = false;
+	stop_flusher = true;
+    }
+    unlock();
+    if(stop_flusher) pthread_join(flusher,NULL);
+}
+
+/**
+ * -O: append the lines of file next_ordered, and of any files after it
+ * that have already finished, to ordered_out.
+ */
+void display::write_ordered(std::string &text)
+{
+    uint64_t next = next_ordered;
+    ordered_out.buf += text;
+    while(true){
+	std::map<uint64_t,std::string>::iterator it = ordered_after.find(next);
+	if(it!=ordered_after.end()){
+	    ordered_out.buf += it->second;
+	    ordered_after.erase(it);
+	}
+	next++;
+	it = ordered_pending.begin();
+	if(it==ordered_pending.end() || it->first!=next) break;
+	ordered_out.buf += it->second;
+	ordered_pending.erase(it);
+    }
+    __atomic_store_n(&next_ordered,next,__ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&ordered_cond);
+    flush_ordered();
+}
+
+void display::flush_ordered()
+{
+    if(buffer_output==false
+       || ordered_out.buf.size() >= OUTPUT_BUFFER_SIZE
+       || time(0) >= ordered_out.last_flush + OUTPUT_FLUSH_SECONDS){
+	flush_output_buffer(&ordered_out);
+    }
+}
+
+void display::begin_file_output(const file_data_hasher_t *fdht)
+{
+    my_output_buffer()->file_number = fdht->file_number;
+}
+
+void display::end_file_output()
+{
+    output_buffer *b = my_output_buffer();
+    uint64_t n = b->file_number;
+    std::string text;
+    text.swap(b->file_lines);
+    b->file_number = 0;
+    lock();
+    if(n==next_ordered){
+	write_ordered(text);
+    } else {
+	ordered_pending[n].swap(text);
+    }
+    unlock();
+}
+
+/**
+ * -O: called before a file is numbered. Waits while the window of files
+ * that have been numbered but not written is full.
+ */
+void display::wait_for_ordered_window()
+{
+    if(file_data_hasher_t::files_numbered()+1 < __atomic_load_n(&next_ordered,__ATOMIC_SEQ_CST)+ORDERED_WINDOW){
+	return;
+    }
+    flush_file_batch();			// the window may be waiting on a small file
+    lock();
+    while(file_data_hasher_t::files_numbered()+1 >= next_ordered+ORDERED_WINDOW){
+	pthread_cond_wait(&ordered_cond,&M.mutex);
+    }
+    unlock();
+}
+
+/**
+ * Collect output (lines of text, or DFXML fileobjects) in this thread's
+ * buffer for the file being hashed (-O) or for writing in a batch.
+ * Returns false if it should be written now.
+ */
+bool display::collect_output(const std::string &text)
+{
+#ifdef HAVE_PTHREAD
+    if(opt_ordered && tp){
+	output_buffer *b = (output_buffer *)pthread_getspecific(output_key);
+	if(b && b->file_number){	// the output of a file being hashed
+	    b->file_lines += text;
+	    return true;
+	}
+	/* Otherwise it's from finding the files, such as a directory
+	 * we can't read. It goes after the last file numbered.
+	 */
+	lock();
+	uint64_t last = file_data_hasher_t::files_numbered();
+	if(last < next_ordered){
+	    ordered_out.buf += text;
+	    flush_ordered();
+	} else {
+	    ordered_after[last] += text;
+	}
+	unlock();
+	return true;
+    }
+#endif
+    if(buffer_output==false) return false;
+    output_buffer *b = my_output_buffer();
+    b->M.lock();
+    b->buf += text;
+    bool flush = b->buf.size() >= OUTPUT_BUFFER_SIZE
+	|| time(0) >= b->last_flush + OUTPUT_FLUSH_SECONDS;
+    b->M.unlock();
+    if(flush){
+	lock();
+	flush_output_buffer(b);
+	unlock();
+    }
+    return true;
+}
+
 void display::writeln(std::ostream *os,const std::string &str)
 {
+    if(os==out && dfxml==0 && (opt_ordered || buffer_output)){
+	std::string line(str);
+	line += opt_zero ? '\000' : '\n';
+	if(collect_output(line)) return;
+    }
     lock();
     (*os) << str;
     if (opt_zero){
@@ -129,6 +343,7 @@ void display::fatal_error(const char *fmt,...)
 	(*out) << progname << ": " << strerror(errno);
 	exit(EXIT_FAILURE);
     }
+    set_buffered_output(false);		// don't lose what was hashed before this
     writeln(&std::cerr,progname + ": " + ret);
     free(ret);
     va_end(ap);
@@ -145,6 +360,7 @@ void display::internal_error(const char *fmt,...)
 	(*out) << progname << ": " << strerror(errno);
 	exit(EXIT_FAILURE);
     }
+    set_buffered_output(false);
     writeln(&std::cerr,ret);
     writeln(&std::cerr,progname+": Internal error. Contact developer!");
     va_end(ap);
@@ -206,12 +422,12 @@ void display::error_filename(const std::string &fn,const char *fmt, ...)
 	exit(EXIT_FAILURE);
     }
     if(dfxml){
-	lock();
-	dfxml->push("fileobject");
-	dfxml->xmlout("filename",fn);
-	dfxml->xmlout("error",ret);
-	dfxml->pop();
-	unlock();
+	XML::fragment x(dfxml->depth());
+	x.push("fileobject");
+	x.xmlout("filename",fn);
+	x.xmlout("error",ret);
+	x.pop();
+	write_dfxml(x.str());
     } else {
 	writeln(&std::cerr,fmt_filename(fn) + ": " + ret);
     }
@@ -332,7 +548,7 @@ void display::display_banner_if_needed()
     unlock();
 }
 
-void file_data_hasher_t::dfxml_write_hashes(std::string hex_hashes[],int indent)
+void file_data_hasher_t::dfxml_write_hashes(const hash_digests &d,int indent)
 {
     for(int i=0;i<NUM_ALGORITHMS;i++){
 	if(hashes[i].inuse){
@@ -340,7 +556,7 @@ void file_data_hasher_t::dfxml_write_hashes(std::string hex_hashes[],int indent)
 		this->dfxml_hash << ' ';
 	    }
 	    this->dfxml_hash << "<hashdigest type='" << makeupper(hashes[i].name) << "'>"
-			     << hex_hashes[i] <<"</hashdigest>\n";
+			     << d.hex(i) <<"</hashdigest>\n";
 	}
     }
 }
@@ -355,7 +571,7 @@ void file_data_hasher_t::compute_dfxml(bool known_hash,const hash_context_obj *h
 	indent=2;
     }
     
-    this->dfxml_write_hashes(this->hash_hex,indent);
+    this->dfxml_write_hashes(this->digests,indent);
     if(known_hash){
 	this->dfxml_hash << "<matched>1</matched>";
     }
@@ -373,21 +589,19 @@ uint64_t display::compute_unused(bool show_display, std::string annotation)
     uint64_t count=0;
 
     /* This is the only place we iterate through known.
-     * We make a list of all the filenames so we can get out of the lock fast.
+     * It is frozen, so we don't need the lock to read it.
      */
 
     std::vector<std::string> filelist;
 
-    lock();
-    for(hashlist::const_iterator i = known.begin(); i != known.end(); i++){
-	if((*i)->matched_file_number==0){
+    for(size_t i = 0; i < known.size(); i++){
+	if(!known.is_matched(i)){
 	    count++;
 	    if (show_display || opt_verbose >= MORE_VERBOSE) {
-		filelist.push_back((*i)->file_name);
+		filelist.push_back(known.record(i)->file_name);
 	    }
 	}
     }
-    unlock();
     for(std::vector<std::string>::const_iterator i = filelist.begin(); i!= filelist.end(); i++){
 	std::string line = *i + annotation;
 	writeln(out,line);
@@ -455,12 +669,10 @@ std::string display::fmt_size(const file_data_t *fdt) const
 void display::md5deep_display_match_result(file_data_hasher_t *fdht,
 					   const hash_context_obj *hc)
 {  
-    lock();
     const file_data_t *fs = known.find_hash(opt_md5deep_mode_algorithm,
-					    fdht->hash_hex[opt_md5deep_mode_algorithm],
+					    fdht->digests.get(opt_md5deep_mode_algorithm),
 					    fdht->file_name,
 					    fdht->file_number);
-    unlock();
 
     int known_hash = fs ? 1 : 0;
     if ((known_hash && opt_mode_match) || (!known_hash && opt_mode_match_neg)) {
@@ -473,7 +685,7 @@ void display::md5deep_display_match_result(file_data_hasher_t *fdht,
 
 	line << fmt_size(fdht);
 	if (opt_display_hash) {
-	    line << fdht->hash_hex[opt_md5deep_mode_algorithm];
+	    line << fdht->digests.hex(opt_md5deep_mode_algorithm);
 	    if (opt_csv) {
 		line << ",";
 	    } else if (opt_asterisk) {
@@ -510,11 +722,9 @@ void display::display_match_result(file_data_hasher_t *fdht,const hash_context_o
     file_data_t *matched_fdt = NULL;
     int should_display = (primary_match_neg == primary_function);
     
-    lock();				// protects the search and the printing
-    hashlist::searchstatus_t m = known.search(fdht,
+    hashlist::searchstatus_t m = known.search(fdht,	// known is frozen; no lock
 					      &matched_fdt,
 					      opt_case_sensitive);
-    unlock();
 
     std::stringstream line1;
 
@@ -570,35 +780,33 @@ void display::display_match_result(file_data_hasher_t *fdht,const hash_context_o
 int display::audit_update(file_data_hasher_t *fdht)
 {
     file_data_t *matched_fdht=0;
-    lock();				// protects the search and the printing
-    hashlist::searchstatus_t m = known.search(fdht,
+    hashlist::searchstatus_t m = known.search(fdht,	// known is frozen; no lock
 					      &matched_fdht,
 					      opt_case_sensitive);
-    unlock();
     std::string line;
     switch(m){
     case hashlist::status_match:
     case hashlist::searchstatus_ok:
-	this->match.exact++;
+	__sync_fetch_and_add(&this->match.exact,1); // several threads audit at once
 	if (opt_verbose >= INSANELY_VERBOSE) {
 	    line = fmt_filename(fdht) + ": Ok";
 	}
 	break;
     case hashlist::status_no_match:
-	this->match.unknown++;
+	__sync_fetch_and_add(&this->match.unknown,1);
 	if (opt_verbose >= MORE_VERBOSE) {
 	    line = fmt_filename(fdht) + ": No match";
 	}
 	break;
     case hashlist::status_file_name_mismatch:
-	this->match.moved++;
+	__sync_fetch_and_add(&this->match.moved,1);
 	if (opt_verbose >= MORE_VERBOSE) {
 	    line = fmt_filename(fdht) + ": Moved from " + fmt_filename(matched_fdht);
 	}
 	break;
     case hashlist::status_partial_match:
     case hashlist::status_file_size_mismatch:
-	this->match.partial++;
+	__sync_fetch_and_add(&this->match.partial,1);
 	// We only record the hash collision if it wasn't anything else.
 	// At the same time, however, a collision is such a significant
 	// event that we print it no matter what. 
@@ -618,9 +826,7 @@ int display::audit_update(file_data_hasher_t *fdht)
 void display::finalize_matching()
 {
     /* Could the total matched */
-    lock();
     uint64_t total_matched = known.total_matched();
-    unlock();
 
     if (total_matched != known_size())
     {
@@ -644,6 +850,28 @@ void display::finalize_matching()
 }
 
 
+/*
+ * In verbose mode, say how well the filters in front of the known
+ * hashes did. A false positive is a digest the filter let through
+ * that the hashmap didn't have after all.
+ */
+void display::report_known_filters()
+{
+    for (int alg = 0; alg < NUM_ALGORITHMS; alg++)
+    {
+      const hashlist::known_filter *f = known.filter(alg);
+      if (f == 0)
+	continue;
+      uint64_t negatives = f->rejected + f->false_positives;
+      error("%s filter: %"PRIu64" bytes for %"PRIu64" known hashes; %"PRIu64" lookups, "
+	    "%"PRIu64" rejected, %"PRIu64" false positives (%.3f%%)",
+	    hashes[alg].name.c_str(), (uint64_t)f->bytes(), f->keys, f->lookups,
+	    f->rejected, f->false_positives,
+	    negatives ? 100.0 * f->false_positives / negatives : 0.0);
+    }
+}
+
+
 mutex_t    display::portable_gmtime_mutex;
 
 struct tm  *display::portable_gmtime(struct tm *my_time,const timestamp_t *t)
@@ -697,7 +925,7 @@ void  display::md5deep_display_hash(file_data_hasher_t *fdht,const hash_context_
     if (mode_triage) {
 	line << fdht->triage_info << "\t";
     }
-    line << fmt_size(fdht) << fdht->hash_hex[opt_md5deep_mode_algorithm];
+    line << fmt_size(fdht) << fdht->digests.hex(opt_md5deep_mode_algorithm);
 
     if (mode_quiet){
 	line << "  ";
@@ -772,7 +1000,7 @@ void display::display_hash_simple(file_data_hasher_t *fdht,
     {
       if (hashes[i].inuse)
       {
-	line << fdht->hash_hex[i] << ",";
+	line << fdht->digests.hex(i) << ",";
       }
     }
     line << fmt_filename(fdht);
@@ -831,16 +1059,35 @@ void display::dfxml_startup(int argc,char **argv)
 	dfxml->xmlout("dc:type","Hash List","",false);
 	dfxml->pop();
 	dfxml->add_DFXML_creator(PACKAGE_NAME,PACKAGE_VERSION,XML::make_command_line(argc,argv));
+
+	/* fileobjects are rendered by the threads that hash the files */
+	const char *fileobject_tags[] = {"fileobject","filename","filesize","mtime","ctime","atime","error",0};
+	for(const char **tag = fileobject_tags; *tag; tag++){
+	    dfxml->declare_tag(*tag);
+	}
 	unlock();
     }
 }
 
-void display::dfxml_timeout(const std::string &tag,const timestamp_t &val)
+void display::dfxml_timeout(XML::fragment &x,const std::string &tag,const timestamp_t &val)
 {
     char buf[256];
     struct tm tm;
     strftime(buf,sizeof(buf),"%Y-%m-%dT%H:%M:%SZ",portable_gmtime(&tm,&val));
-    dfxml->xmlout(tag,buf);
+    x.xmlout(tag,buf);
+}
+
+/**
+ * Write a fileobject rendered by a worker. Only the copy into a buffer,
+ * or the write itself, needs the lock.
+ */
+void display::write_dfxml(const std::string &xml)
+{
+    if(collect_output(xml)) return;
+    lock();
+    dfxml->write_fragment(xml);
+    dfxml->flush();
+    unlock();
 }
 
 void display::dfxml_write(file_data_hasher_t *fdht)
@@ -852,16 +1099,16 @@ void display::dfxml_write(file_data_hasher_t *fdht)
 	    ss << "workerid='" << fdht->workerid << "'";
 	    attrs = ss.str();
 	}
-	lock();
-	dfxml->push("fileobject",attrs);
-	dfxml->xmlout("filename",fdht->file_name);
-	dfxml->xmlout("filesize",(int64_t)fdht->stat_bytes);
-	if(fdht->mtime) dfxml_timeout("mtime",fdht->mtime);
-	if(fdht->ctime) dfxml_timeout("ctime",fdht->ctime);
-	if(fdht->atime) dfxml_timeout("atime",fdht->atime);
-	dfxml->writexml(fdht->dfxml_hash.str());
-	dfxml->pop();
-	unlock();
+	XML::fragment x(dfxml->depth()); // nothing else is written while files are hashed
+	x.push("fileobject",attrs);
+	x.xmlout("filename",fdht->file_name);
+	x.xmlout("filesize",(int64_t)fdht->stat_bytes);
+	if(fdht->mtime) dfxml_timeout(x,"mtime",fdht->mtime);
+	if(fdht->ctime) dfxml_timeout(x,"ctime",fdht->ctime);
+	if(fdht->atime) dfxml_timeout(x,"atime",fdht->atime);
+	x.writexml(fdht->dfxml_hash.str());
+	x.pop();
+	write_dfxml(x.str());
     }
 }
 
@@ -94,39 +94,6 @@ typedef struct _ENCASE_HASH_HEADER {
  *** Support Functions
  ****************************************************************/
 
-// Find the index of the next comma in the string str starting at index start.
-// quotes cause commas to be ingored until you are out of the quote.
-// If there is no next comma, returns -1. 
-static int find_next_comma(char *str, unsigned int start)
-{
-    assert(str);
-
-    size_t size = strlen(str);
-    unsigned int pos = start; 
-    int in_quote = FALSE;
-  
-    while (pos < size)  {
-	switch (str[pos]) {
-	case '"':
-	    in_quote = !in_quote;
-	    break;
-	case ',':
-	    if (in_quote) break;
-
-	    // Although it's potentially unwise to cast an unsigned int back
-	    // to an int, problems will only occur when the value is beyond 
-	    // the range of int. Because we're working with the index of a 
-	    // string that is probably less than 32,000 characters, we should
-	    // be okay. 
-	    return (int)pos;
-	}
-	++pos;
-    }
-    return -1;
-}
-
- 
-
 // Shift the contents of a string so that the values after 'new_start'
 // will now begin at location 'start' 
 void shift_string(char *fn, size_t start, size_t new_start)
@@ -145,41 +112,62 @@ void shift_string(char *fn, size_t start, size_t new_start)
     fn[start] = 0;
 }
 
-// Returns the string after the nth comma in the string str. If that
-// string is quoted, the quotes are removed. If there is no valid 
-// string to be found, returns TRUE. Otherwise, returns FALSE 
-static int find_comma_separated_string(char *str, unsigned int n)
+/* A field of a line of a rigid file. It points into the line. */
+struct rigid_field_t {
+    const char	*start;
+    size_t	len;
+};
+
+// Finds two fields of a line of a rigid (comma separated) file in one
+// pass, without copying. Commas inside quotes don't separate fields, and
+// the quotes around a field are removed. Columns start with #1.
+// Returns FALSE unless the line has both columns.
+static int find_rigid_fields(const char *line, size_t len,
+			     unsigned int column_a, rigid_field_t *a,
+			     unsigned int column_b, rigid_field_t *b)
 {
-    if (NULL == str) return TRUE;
-
-    int start = 0, end;
-    unsigned int count = 0; 
-    while (count < n)  {
-	if ((start = find_next_comma(str,start)) == -1) return TRUE;
-	++count;
-	// Advance the pointer past the current comma
-	++start;
-    }
+    unsigned int column = 1;
+    size_t start = 0;
+    int in_quote = FALSE;
+    int found = 0;
 
-    // It's okay if there is no next comma, it just means that this is
-    // the last comma separated value in the string 
-    if ((end = find_next_comma(str,start)) == -1)
-	end = strlen(str);
-
-    // Strip off the quotation marks, if necessary. We don't have to worry
-    // about uneven quotation marks (i.e quotes at the start but not the end
-    // as they are handled by the the find_next_comma function.
-    if (str[start] == '"')
-	++start;
-    if (str[end - 1] == '"')
-	end--;
-
-    str[end] = 0;
-    shift_string(str,0,start);
-  
+    for (size_t pos = 0 ; pos <= len ; pos++) {
+	if (pos < len) {
+	    if (line[pos] == '"') {
+		in_quote = !in_quote;
+		continue;
+	    }
+	    if (line[pos] != ',' || in_quote) continue;
+	}
+
+	// [start,pos) is a field
+	if (column == column_a || column == column_b) {
+	    // We don't have to worry about uneven quotation marks (i.e quotes
+	    // at the start but not the end); they just don't end the field.
+	    size_t field_start = start, field_end = pos;
+	    if (field_start < field_end && line[field_start] == '"')
+		++field_start;
+	    if (field_end > start && line[field_end - 1] == '"')
+		field_end--;
+	    rigid_field_t f;
+	    f.start = line + field_start;
+	    f.len   = field_end > field_start ? field_end - field_start : 0;
+	    if (column == column_a) { *a = f; found |= 1; }
+	    if (column == column_b) { *b = f; found |= 2; }
+	    if (found == 3) return TRUE;
+	}
+	++column;
+	start = pos + 1;
+    }
     return FALSE;
 }
 
+// A rigid hash field is good if it starts with a whole hash in hex
+static int rigid_hash_ok(const rigid_field_t &hash)
+{
+    return hash.len >= HASH_STRING_LENGTH && hex_valid(hash.start,HASH_STRING_LENGTH);
+}
+
 
 
 
@@ -196,6 +184,11 @@ int state::find_plain_hash(char *buf, char *known_fn)
     
     if ((strlen(buf) < HASH_STRING_LENGTH) || (buf[HASH_STRING_LENGTH] != ' '))
 	return FALSE;
+
+    /* We have to include a validity check here so that we don't
+       mistake SHA-1 hashes for MD5 hashes, among other things */
+    if (!hex_valid(buf,HASH_STRING_LENGTH))
+	return FALSE;
     
     if (known_fn != NULL) {
 	strncpy(known_fn,buf,PATH_MAX);
@@ -209,10 +202,7 @@ int state::find_plain_hash(char *buf, char *known_fn)
     }
     
     buf[HASH_STRING_LENGTH] = 0;
-
-    /* We have to include a validity check here so that we don't
-       mistake SHA-1 hashes for MD5 hashes, among other things */
-    return algorithm_t::valid_hash(opt_md5deep_mode_algorithm,buf);
+    return TRUE;
 }  
 
 /**
@@ -279,7 +269,7 @@ int state::find_bsd_hash(char *buf, char *fn)
 	equal++;
     }
     *dest = 0;				// terminate
-    return algorithm_t::valid_hex(buf);
+    return hex_valid(buf,dest-buf);
 }
   
 
@@ -298,20 +288,50 @@ int state::find_bsd_hash(char *buf, char *fn)
 
 int state::find_rigid_hash(char *buf,  char *fn, unsigned int fn_location, unsigned int hash_location)
 {
-    char *temp = strdup(buf);
-    if (temp == NULL)
-	return FALSE;
-    if (find_comma_separated_string(temp,fn_location-1))  {
-	free(temp);
+    rigid_field_t name, hash;
+    if (!find_rigid_fields(buf,strlen(buf),fn_location,&name,hash_location,&hash))
 	return FALSE;
-    }
-    strncpy(fn, temp, strlen(fn));
-    free(temp);
-    if (find_comma_separated_string(buf,hash_location-1)){
+
+    size_t len = std::min(name.len,(size_t)PATH_MAX);
+    memcpy(fn,name.start,len);
+    fn[len] = 0;
+    memmove(buf,hash.start,hash.len);
+    buf[hash.len] = 0;
+
+    return rigid_hash_ok(hash);
+}
+
+
+/**
+ * The columns of the filename and of our hash in the rigid file types.
+ * Returns FALSE if the file type isn't rigid or doesn't have our hash.
+ */
+int state::rigid_columns(int fileType, unsigned int *fn_column, unsigned int *hash_column) const
+{
+    hashid_t alg = opt_md5deep_mode_algorithm;
+    switch(fileType) {
+    case TYPE_HASHKEEPER:		// only md5
+	*fn_column = 3; *hash_column = 5;
+	return alg == alg_md5;
+    case TYPE_NSRL_15:
+	*fn_column = 2;
+	if (alg == alg_md5)  { *hash_column = 7; return TRUE; }
+	if (alg == alg_sha1) { *hash_column = 1; return TRUE; }
+	return FALSE;			// NSRL_15 only hash md5 and sha1
+    case TYPE_NSRL_20:
+	*fn_column = 4;
+	if (alg == alg_md5)  { *hash_column = 2; return TRUE; }
+	if (alg == alg_sha1) { *hash_column = 1; return TRUE; }
 	return FALSE;
+    case TYPE_ILOOK3:
+    case TYPE_ILOOK4:
+	*fn_column = 3;
+	if (alg == alg_md5)    { *hash_column = 1; return TRUE; }
+	if (alg == alg_sha1)   { *hash_column = 2; return TRUE; }
+	if (alg == alg_sha256) { *hash_column = 6; return TRUE; }
+	return FALSE;			// ilook3 and ilook4 only have md5, sha1 and sha256
     }
-
-    return algorithm_t::valid_hash(opt_md5deep_mode_algorithm,buf);
+    return FALSE;
 }
 
 #ifdef WORDS_BIGENDIAN
@@ -426,29 +446,14 @@ int state::identify_hash_file_type(FILE *f,uint32_t *expected_hashes)
  */
 int state::find_hash_in_line(char *buf, int fileType, char *fn) 
 {
+    unsigned int fn_column, hash_column;
+    if (rigid_columns(fileType,&fn_column,&hash_column))
+	return find_rigid_hash(buf,fn,fn_column,hash_column);
+
     switch(fileType) {
     case TYPE_PLAIN:	    return find_plain_hash(buf,fn);
     case TYPE_BSD:	    return find_bsd_hash(buf,fn);
-    case TYPE_HASHKEEPER:   return find_rigid_hash(buf,fn,3,h_hashkeeper);
-    case TYPE_NSRL_15:
-	if(opt_md5deep_mode_algorithm == alg_md5) return find_rigid_hash(buf,fn,2,7);
-	if(opt_md5deep_mode_algorithm == alg_sha1) return find_rigid_hash(buf,fn,2,1);
-	return FALSE;			// NSRL_15 only hash md5 and sha1
-    case TYPE_NSRL_20:
-	if(opt_md5deep_mode_algorithm == alg_md5) return find_rigid_hash(buf,fn,4,2);
-	if(opt_md5deep_mode_algorithm == alg_sha1) return find_rigid_hash(buf,fn,4,1);
-	return FALSE;
     case TYPE_ILOOK:        return find_ilook_hash(buf,fn);
-    case TYPE_ILOOK3:
-	if(opt_md5deep_mode_algorithm == alg_md5)    return find_rigid_hash(buf,fn,3,1);
-	if(opt_md5deep_mode_algorithm == alg_sha1)   return find_rigid_hash(buf,fn,3,2);
-	if(opt_md5deep_mode_algorithm == alg_sha256) return find_rigid_hash(buf,fn,3,6);
-	return FALSE;			// ilook3 only has md5, sha1 and sha256
-    case TYPE_ILOOK4:	    
-	if(opt_md5deep_mode_algorithm == alg_md5)    return find_rigid_hash(buf,fn,3,1);
-	if(opt_md5deep_mode_algorithm == alg_sha1)   return find_rigid_hash(buf,fn,3,2);
-	if(opt_md5deep_mode_algorithm == alg_sha256) return find_rigid_hash(buf,fn,3,6);
-	return FALSE;			// ilook4 only has md5, sha1 and sha256
     case TYPE_MD5DEEP_SIZE: return find_md5deep_size_hash(buf,fn);
     }
     return FALSE;
@@ -462,8 +467,9 @@ int state::find_hash_in_line(char *buf, int fileType, char *fn)
  */
 void state::md5deep_add_hash(char *h, char *fn)
 {
+    ocb.load_queued_files();		// keep the known hashes in the order they were given
     class file_data_t *fdt = new file_data_t();
-    fdt->hash_hex[opt_md5deep_mode_algorithm] = h; 
+    fdt->digests.set_hex(opt_md5deep_mode_algorithm,h); // an invalid hash will never match
     fdt->file_name = fn;
     ocb.add_fdt(fdt);
 }
@@ -485,75 +491,159 @@ int file_type_without_header(int file_type)
 
 
 #define ENCASE_START_HASHES 0x480
+#define ENCASE_RECORD_SIZE  18
+#define ENCASE_BLOCK_RECORDS 65536
 #define hash_length md5deep_mode_hash_length
 
+/**
+ * Each hash entry is 18 bytes: 16 bytes for the MD5 and two \0
+ * characters at the end. The entries are read a block at a time and
+ * their digests are packed into a known index of their own, so even
+ * sets with tens of millions of them load quickly.
+ */
 int state::parse_encase_file(const char *fn, FILE *handle,uint32_t expected_hashes)
 {
-    unsigned char buffer[64];
-    char result[1024];			// must be at least s->hash_length*2
+    std::vector<uint8_t> digests;
+    std::vector<unsigned char> buffer(ENCASE_BLOCK_RECORDS * ENCASE_RECORD_SIZE);
     uint32_t count = 0;
-  
-    // Each hash entry is 18 bytes. 16 bytes for the hash and 
-    // two \0 characters at the end. We reserve 19 characters 
-    // as fread will append an extra \0 to the string 
+    size_t digest_size = hash_digests::size(alg_md5);
 
     if (fseeko(handle,ENCASE_START_HASHES,SEEK_SET))  {
 	ocb.error("%s: Unable to seek to start of hashes", fn);
 	return status_t::STATUS_USER_ERROR;
     }
-        
-    while (!feof(handle)){		// 
-	if (18 != fread(buffer,sizeof(unsigned char),18,handle)) {
-	    if (feof(handle))
-		continue;
-        
+
+    // Don't trust the header with more than the file can hold
+    struct stat sb;
+    if (fstat(fileno(handle),&sb)==0 && sb.st_size > ENCASE_START_HASHES) {
+	uint64_t in_file = (sb.st_size - ENCASE_START_HASHES) / ENCASE_RECORD_SIZE;
+	digests.reserve((size_t)std::min((uint64_t)expected_hashes,in_file) * digest_size);
+    }
+
+    while (!feof(handle)){
+	size_t len = fread(&buffer[0],ENCASE_RECORD_SIZE,ENCASE_BLOCK_RECORDS,handle);
+	for (size_t i = 0; i < len; i++) {
+	    const unsigned char *record = &buffer[i * ENCASE_RECORD_SIZE];
+	    digests.insert(digests.end(),record,record + digest_size);
+	}
+	count += len;
+	if (len < ENCASE_BLOCK_RECORDS && ferror(handle)) {
 	    // Users expect the line numbers to start at one, not zero.
 	    if ((!ocb.opt_silent) || (mode_warn_only)) {
 		ocb.error("%s: No hash found in line %"PRIu32, fn, count + 1);
 		ocb.error("%s: %s", fn, strerror(errno));
-		return status_t::STATUS_USER_ERROR;
 	    }
+	    return status_t::STATUS_USER_ERROR;
 	}
-	++count;        
-                
-	snprintf(result,sizeof(result),
-		 "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
-		 buffer[0],
-		 buffer[1],                      
-		 buffer[2],
-		 buffer[3],
-		 buffer[4],                      
-		 buffer[5],
-		 buffer[6],
-		 buffer[7],                              
-		 buffer[8],                              
-		 buffer[9],
-		 buffer[10],                     
-		 buffer[11],                             
-		 buffer[12],                     
-		 buffer[13],     
-		 buffer[14],                     
-		 buffer[15]);
-
-	class file_data_t *fdt = new file_data_t();
-	fdt->hash_hex[opt_md5deep_mode_algorithm] = result; 
-	fdt->file_name = fn;
-	ocb.add_fdt(fdt);
     }
 
     if (expected_hashes != count){
 	ocb.error("%s: Expecting %"PRIu32" hashes, found %"PRIu32"\n", 
 			fn, expected_hashes, count);
     }
+    // EnCase only has MD5s; others never match
+    if (opt_md5deep_mode_algorithm==alg_md5){
+	ocb.queue_digests(fn,alg_md5,digests);
+    }
     return status_t::status_ok;
 }
 
 
 
+/**
+ * The lines of an md5deep-style match file. They are read as fgets() into
+ * a MAX_STRING_LENGTH buffer would, so a longer line is several lines.
+ */
+class md5deep_file : public hashlist::known_file {
+private:
+    md5deep_file(const md5deep_file &);
+    md5deep_file &operator=(const md5deep_file &);
+public:
+    md5deep_file(state *s_,const std::string &fn_,FILE *handle_,uint64_t header_lines_,int ftype_):
+	known_file(fn_,handle_,header_lines_),s(s_),ftype(ftype_){}
+    state	*s;
+    int		ftype;
+    virtual void parse(hashlist::known_chunk &c) const;
+    virtual void bad_line(display *ocb,uint64_t line_number,int) const {
+	if ((!ocb->opt_silent) || (s->mode_warn_only)) {
+	    std::cerr << progname << ": " << fn << ": No hash found in line " << line_number << std::endl;
+	}
+    }
+};
+
+void md5deep_file::parse(hashlist::known_chunk &c) const
+{
+    char buf[MAX_STRING_LENGTH + 1];
+    unsigned int fn_column = 0, hash_column = 0;
+    bool rigid = s->rigid_columns(ftype,&fn_column,&hash_column);
+    const char *p = c.begin;
+    while (p < c.end) {
+	size_t len = std::min((size_t)(c.end-p),(size_t)MAX_STRING_LENGTH-1);
+	const char *newline = (const char *)memchr(p,'\n',len);
+	if (newline) len = newline+1-p;
+
+	if (rigid) {
+	    // The fields are found in the file itself; the line ends at
+	    // the first \n, \r or NUL, as it would as a C string.
+	    size_t line_len = 0;
+	    while (line_len < len && p[line_len]!='\n' && p[line_len]!='\r' && p[line_len]!=0)
+		line_len++;
+	    c.lines++;
+	    rigid_field_t name, hash;
+	    if (!find_rigid_fields(p,line_len,fn_column,&name,hash_column,&hash) ||
+		!rigid_hash_ok(hash)) {
+		c.add_bad_line(0);
+	    } else {
+		file_data_t *fdt = c.new_record();
+		if (fdt == 0) {
+		    c.out_of_memory = true;
+		    return;
+		}
+		fdt->digests.set_hex(opt_md5deep_mode_algorithm,hash.start,hash.len);
+		fdt->file_name.assign(name.start,std::min(name.len,(size_t)PATH_MAX));
+		c.records.push_back(fdt);
+	    }
+	    p += len;
+	    continue;
+	}
+
+	memcpy(buf,p,len);
+	buf[len] = 0;
+	p += len;
+
+	char *cc;
+	char known_fn[PATH_MAX+1];		     // set to be the filename from the buffer
+	if((cc=strchr(buf,'\n'))!=0) *cc = 0;	     // remove \n at end of line
+	if((cc=strchr(buf,'\r'))!=0) *cc = 0;	     // remove \r at end of line
+	c.lines++;
+	memset(known_fn,0,PATH_MAX);
+
+	/* This looks odd. The function find_hash_in_line modifies 'buf' so that it
+	 * begins with the hash, and copies the filename to known_fn.
+	 */
+	if (!s->find_hash_in_line(buf,ftype,known_fn)) {
+	    c.add_bad_line(0);
+	} else {
+	    // Invalid hashes are caught above
+	    file_data_t *fdt = c.new_record();
+	    if (fdt == 0) {
+		c.out_of_memory = true;
+		return;
+	    }
+	    fdt->digests.set_hex(opt_md5deep_mode_algorithm,buf); // the hex hash
+	    fdt->file_name = known_fn;		    // the filename
+	    c.records.push_back(fdt);
+	}
+    }
+}
+
+
 /**
  * Load an md5deep-style match file.
  * Previously this returned FALSE if failure and TRUE if success.
  * The return value was always ignored, so now we don't return anything.
+ * The file's type is found now; its hashes are loaded with the other
+ * match files once we have all the options.
  */
 void state::md5deep_load_match_file(const char *fn) 
 {
@@ -566,6 +656,11 @@ void state::md5deep_load_match_file(const char *fn)
 	return;
     }
 
+    if (hashlist::known_index::is_index(f)) {
+	ocb.queue_index_file(fn,f,opt_md5deep_mode_algorithm);
+	return;
+    }
+
     int ftype = identify_hash_file_type(f,&expected_hashes);
     if (ftype == TYPE_UNKNOWN)  {
 	ocb.error("%s: Unable to find any hashes in file, skipped.", fn);
@@ -589,34 +684,7 @@ void state::md5deep_load_match_file(const char *fn)
     else {
 	++line_number;
     }
-  
-    char buf[MAX_STRING_LENGTH + 1];
-    while (fgets(buf,MAX_STRING_LENGTH,f)) {
-	char *cc;
-	char known_fn[PATH_MAX+1];		     // set to be the filename from the buffer
-	if((cc=strchr(buf,'\n'))!=0) *cc = 0;	     // remove \n at end of line
-	if((cc=strchr(buf,'\r'))!=0) *cc = 0;	     // remove \r at end of line
-	++line_number;
-	memset(known_fn,0,PATH_MAX);
-
-	/* This looks odd. The function find_hash_in_line modifies 'buf' so that it
-	 * begins with the hash, and copies the filename to known_fn.
-	 */
-	if (!find_hash_in_line(buf,ftype,known_fn)) {
-	    if ((!ocb.opt_silent) || (mode_warn_only)) {
-		std::cerr << progname << ": " << fn << ": No hash found in line " << line_number << std::endl;
-	    }
-	} else {
-	    // Invalid hashes are caught above
-	    file_data_t *fdt = new file_data_t();
-	    fdt->hash_hex[opt_md5deep_mode_algorithm] = buf; // the hex hash
-	    fdt->file_name = known_fn;		    // the filename
-	    ocb.add_fdt(fdt);
-	}
-    }
-    fclose(f);
-    f = 0;
+    ocb.queue_known_file(new md5deep_file(this,fn,f,line_number,ftype));
 }
 
 
-
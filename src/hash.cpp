@@ -42,17 +42,6 @@ static int file_fatal_error()
     return FALSE;
 }
 
-static std::string make_stars(size_t count)
-{
-    std::string ret;
-    for (size_t i = 0 ; i < count ; i++)
-    {
-      ret.push_back('*');
-    }
-    return ret;
-}
-
-
 static inline uint64_t min(uint64_t a,uint64_t b){
     if(a<b) return a;
     return b;
@@ -62,15 +51,68 @@ static inline uint64_t max(uint64_t a,uint64_t b){
     return b;
 }
 
-/*
- * Compute the hash on fdht and store the results in the display ocb.
- * returns true if successful, flase if failure.
- * Doesn't need to seek because the caller handles it. 
+/****************************************************************
+ *** Read buffers
+ ****************************************************************/
+
+pthread_key_t  io_buffer::key;
+pthread_once_t io_buffer::key_once = PTHREAD_ONCE_INIT;
+
+void io_buffer::make_key()
+{
+    pthread_key_create(&key,io_buffer::release);
+}
+
+/* Called when a thread exits */
+void io_buffer::release(void *ib)
+{
+    delete (io_buffer *)ib;
+}
+
+io_buffer::~io_buffer()
+{
+    for(int i=0;i<BUFFERS;i++){
+	if(buf[i]) free_aligned(buf[i]);
+    }
+}
+
+unsigned char *io_buffer::get(size_t size,which_t which)
+{
+    pthread_once(&key_once,io_buffer::make_key);
+    io_buffer *ib = (io_buffer *)pthread_getspecific(key);
+    if(ib==0){
+	ib = new io_buffer();
+	pthread_setspecific(key,ib);
+    }
+    if(ib->size[which] < size){
+	if(ib->buf[which]) free_aligned(ib->buf[which]);
+	ib->buf[which]  = (unsigned char *)malloc_aligned(size);
+	ib->size[which] = ib->buf[which] ? size : 0;
+    }
+    return ib->buf[which];
+}
+
+
+/**
+ * Pick how much to read at a time.
+ * If the user asked for a block size, use it. Otherwise use the
+ * smallest multiple of the file system's preferred I/O size that
+ * is at least the default.
  */
+size_t file_data_hasher_t::choose_block_size(uint64_t requested,uint64_t blksize)
+{
+    if(requested>0) return requested;	// range checked on the command line
+    if(blksize==0) return MD5DEEP_DEFAULT_BLOCK_SIZE;
+    uint64_t bs = blksize;
+    while(bs < MD5DEEP_DEFAULT_BLOCK_SIZE) bs *= 2;
+    return min(bs,MD5DEEP_MAX_BLOCK_SIZE);
+}
 
 
 /**
  * compute_hash is where the data gets read and hashed.
+ * Returns true if successful, false if failure.
+ * Doesn't need to seek because the caller handles it. 
  */
 
 bool file_data_hasher_t::compute_hash(uint64_t request_start,uint64_t request_len,
@@ -84,27 +126,28 @@ bool file_data_hasher_t::compute_hash(uint64_t request_start,uint64_t request_le
 
     /*
      * We may need to read multiple times; don't read more than
-     * file_data_hasher_t::MD5DEEP_IDEAL_BLOCK_SIZE
-     * at a time.
+     * block_size at a time. Memory-mapped files are hashed in place;
+     * everything else is read into this thread's buffer, or into the
+     * next free buffer of the pipeline if we have one.
      */
+    unsigned char *buffer_ = 0;
+    if(this->base==0 && this->pipeline==0){
+	buffer_ = io_buffer::get(this->block_size);
+	if(buffer_==0){
+	    ocb->fatal_error("Out of memory allocating a %u byte read buffer",(unsigned int)this->block_size);
+	}
+    }
 
     hc1->read_offset = request_start;
     hc1->read_len    = 0;		// so far
 
     while (request_len>0){
-	// Clear the buffer in case we hit an error and need to pad the hash 
-	// The use of MD5DEEP_IDEAL_BLOCK_SIZE means that we loop even for memory-mapped
-	// files. That's okay, becuase our super-fast SHA1 implementation
-	// actually corrupts its input buffer, forcing a copy...
-
-	unsigned char buffer_[file_data_hasher_t::MD5DEEP_IDEAL_BLOCK_SIZE];
-	const unsigned char *buffer = buffer_;
-	uint64_t toread = min(request_len,file_data_hasher_t::MD5DEEP_IDEAL_BLOCK_SIZE); // and shrink
-
-	if(this->base==0){		// not mmap, so clear buffer
-	    memset(buffer_,0,sizeof(buffer_));
+	if(this->pipeline){
+	    unsigned char *pbuf = this->pipeline->get_buffer();
+	    if(this->base==0) buffer_ = pbuf;
 	}
-
+	const unsigned char *buffer = buffer_;
+	uint64_t toread = min(request_len,this->block_size); // and shrink
 	ssize_t current_read_bytes = 0;	// read the data into buffer
 
 	if(this->handle){
@@ -113,8 +156,11 @@ bool file_data_hasher_t::compute_hash(uint64_t request_start,uint64_t request_le
 	    assert(this->fd!=0);
 	    if(this->base){
 		buffer = this->base + request_start;
-		current_read_bytes = min(toread,this->bounds - request_start); // can't read more than this
-		if(hc1->read_offset+current_read_bytes==this->bounds){
+		current_read_bytes = 0;
+		if(request_start < this->bounds){
+		    current_read_bytes = min(toread,this->bounds - request_start); // can't read more than this
+		}
+		if(request_start+current_read_bytes==this->bounds){
 		    this->eof = true;	// we hit the end
 		}
 	    } else {
@@ -129,6 +175,7 @@ bool file_data_hasher_t::compute_hash(uint64_t request_start,uint64_t request_le
 	   
 	    if (file_fatal_error()){
 		this->ocb->set_return_code(status_t::status_EXIT_FAILURE);
+		if(this->pipeline) this->pipeline->wait();
 		return false;		// error
 	    }
 	    if(this->handle) clearerr(this->handle);
@@ -145,8 +192,12 @@ bool file_data_hasher_t::compute_hash(uint64_t request_start,uint64_t request_le
 	if(current_read_bytes>0){
 	    this->file_bytes   += current_read_bytes;
 	    hc1->read_len     += current_read_bytes;
-	    hc1->multihash_update(buffer,current_read_bytes); // hash in the non-error
-	    if(hc2) hc2->multihash_update(buffer,current_read_bytes); // hash in the non-error
+	    if(this->pipeline){
+		this->pipeline->submit(buffer,current_read_bytes,hc1,hc2);
+	    } else {
+		hc1->multihash_update(buffer,current_read_bytes); // hash in the non-error
+		if(hc2) hc2->multihash_update(buffer,current_read_bytes); // hash in the non-error
+	    }
 	}
       
 	// If we are printing estimates, update the time
@@ -160,7 +211,7 @@ bool file_data_hasher_t::compute_hash(uint64_t request_start,uint64_t request_le
 
 	}
 	// If we are at the end of the file, break
-	if((current_read_bytes==0) || (this->handle && feof(this->handle))){
+	if((current_read_bytes==0) || this->eof || (this->handle && feof(this->handle))){
 	    this->eof = true;
 	    break;
 	}
@@ -169,11 +220,75 @@ bool file_data_hasher_t::compute_hash(uint64_t request_start,uint64_t request_le
 	request_start += toread;
 	request_len   -= toread;
     }
+    if (this->pipeline) this->pipeline->wait(); // the caller is about to finalize
     if (ocb->opt_estimate) ocb->clear_realtime_stats();
     if (this->file_bytes == this->stat_bytes) this->eof = true; // end of the file
     return true;			// done hashing!
 }
 
+
+/**
+ * hash_piece hashes one piece of a file that is being hashed by several
+ * threads at once. It doesn't move the file pointer or change this object,
+ * reading with pread() into the calling thread's buffer, or from the
+ * mapped file.
+ */
+bool file_data_hasher_t::hash_piece(uint64_t request_start,uint64_t request_len,
+				    hash_context_obj *hc1) const
+{
+    hc1->read_offset = request_start;
+    hc1->read_len    = 0;		// so far
+
+    unsigned char *buffer_ = 0;
+    if(this->base==0){
+	buffer_ = io_buffer::get(this->block_size);
+	if(buffer_==0){
+	    ocb->fatal_error("Out of memory allocating a %u byte read buffer",(unsigned int)this->block_size);
+	}
+    }
+    int rfd = this->handle ? fileno(this->handle) : this->fd;
+
+    while (request_len>0){
+	const unsigned char *buffer = buffer_;
+	uint64_t toread = min(request_len,this->block_size);
+	ssize_t current_read_bytes = 0;
+
+	if(this->base){
+	    buffer = this->base + request_start;
+	    if(request_start < this->bounds){
+		current_read_bytes = min(toread,this->bounds - request_start);
+	    }
+	} else {
+#ifdef HAVE_PREAD
+	    current_read_bytes = pread(rfd,buffer_,toread,request_start);
+#else
+	    current_read_bytes = -1;	// never called; see hash()
+	    errno = EBADF;
+#endif
+	}
+
+	if (current_read_bytes<0){
+	    ocb->error_filename(this->file_name,"error at offset %"PRIu64": %s",
+				request_start, strerror(errno));
+	    if (file_fatal_error()){
+		this->ocb->set_return_code(status_t::status_EXIT_FAILURE);
+		return false;		// error
+	    }
+	    current_read_bytes = 0;	// skip this block and go on to the next
+	} else if (current_read_bytes==0){
+	    break;			// end of the file
+	}
+
+	if(current_read_bytes>0){
+	    hc1->read_len += current_read_bytes;
+	    hc1->multihash_update(buffer,current_read_bytes);
+	}
+	request_start += toread;
+	request_len   -= toread;
+    }
+    return true;
+}
+
 /**
  *
  * THIS IS IT!!!!
@@ -197,131 +312,157 @@ bool file_data_hasher_t::compute_hash(uint64_t request_start,uint64_t request_le
 #endif
 mutex_t file_data_hasher_t::fdh_lock;
 
-void file_data_hasher_t::hash()
+/**
+ * Open the file using the I/O mode requested by the user, then get
+ * the bytes and ctime. We fstat what we opened rather than look up the
+ * path again; the file may have changed since the directory traversal
+ * saw it.
+ */
+bool file_data_hasher_t::open_file()
 {
     file_data_hasher_t *fdht = this;
 
-    /*
-     * If the handle is set, we are probably hashing stdin.
-     * If not, figure out file size and full file name for the handle
-     */
-    if(fdht->handle==0){		
-	/* Open the file and print an error if we can't */
-	// stat the file to get the bytes and ctime
-	//state::file_type(fdht->file_name_to_hash,ocb,&fdht->stat_bytes,
-	//&fdht->ctime,&fdht->mtime,&fdht->atime);
-	file_metadata_t m;
-	file_metadata_t::stat(fdht->file_name_to_hash,&m,*ocb);
-	fdht->stat_bytes = m.size;
-	fdht->ctime      = m.ctime;
-	fdht->mtime      = m.mtime;
-	fdht->atime      = m.atime;
-
-	if(ocb->opt_verbose>=MORE_VERBOSE){
-	    errno = 0;			// no error
-	}
-	fdht->file_name	= global::make_utf8(fdht->file_name_to_hash);
-	fdht->file_bytes = 0;		// actual number of bytes we have read
-
-	if (ocb->mode_barename)  {
-	    /* Convert fdht->file_name to its basename */
-
-	    /* The basename function kept misbehaving on OS X, so Jesse rewrote it.
-	     * This approach isn't perfect, nor is it designed to be. Because
-	     * we're guarenteed to be working with a file here, there's no way
-	     * that str will end with a DIR_SEPARATOR (e.g. /foo/bar/). This function
-	     * will not work properly for a string that ends in a DIR_SEPARATOR
-	     */
-	    size_t delim = fdht->file_name.rfind(DIR_SEPARATOR);
-	    if(delim!=std::string::npos){
-		fdht->file_name = fdht->file_name.substr(delim+1);
-	    }
+    if(ocb->opt_verbose>=MORE_VERBOSE){
+	errno = 0;			// no error
+    }
+    fdht->file_name	= global::make_utf8(fdht->file_name_to_hash);
+    fdht->file_bytes = 0;		// actual number of bytes we have read
+
+    if (ocb->mode_barename)  {
+	/* Convert fdht->file_name to its basename */
+
+	/* The basename function kept misbehaving on OS X, so Jesse rewrote it.
+	 * This approach isn't perfect, nor is it designed to be. Because
+	 * we're guarenteed to be working with a file here, there's no way
+	 * that str will end with a DIR_SEPARATOR (e.g. /foo/bar/). This function
+	 * will not work properly for a string that ends in a DIR_SEPARATOR
+	 */
+	size_t delim = fdht->file_name.rfind(DIR_SEPARATOR);
+	if(delim!=std::string::npos){
+	    fdht->file_name = fdht->file_name.substr(delim+1);
 	}
+    }
 
-	switch(ocb->opt_iomode){
-	case iomode::buffered:
-	    assert(fdht->handle==0);
+    switch(ocb->opt_iomode){
+    case iomode::buffered:
+	assert(fdht->handle==0);
 
-	    /* Corrects bug 3476412 on MacOS 10.6 
-	     * in which the 'too many files' error was generated when two threads
-	     * tried to run fopen() simultaneously. This bug was apparently fixed
-	     * in MacOS 10.7. There is only minimal overhead with the lock, however,
-	     * and there is a chance that other platforms may have a similar bug,
-	     * so we always do it, just to be safe.
-	     * Simson L. Garfinkel, Jan 21, 2012
-	     */
-	    fdh_lock.lock();
-	    fdht->handle = _tfopen(file_name_to_hash.c_str(),_TEXT("rb"));
-	    fdh_lock.unlock();
+	/* Corrects bug 3476412 on MacOS 10.6 
+	 * in which the 'too many files' error was generated when two threads
+	 * tried to run fopen() simultaneously. This bug was apparently fixed
+	 * in MacOS 10.7. There is only minimal overhead with the lock, however,
+	 * and there is a chance that other platforms may have a similar bug,
+	 * so we always do it, just to be safe.
+	 * Simson L. Garfinkel, Jan 21, 2012
+	 */
+	fdh_lock.lock();
+	fdht->handle = _tfopen(file_name_to_hash.c_str(),_TEXT("rb"));
+	fdh_lock.unlock();
+
+	if(fdht->handle==0){
+	    ocb->error_filename(fdht->file_name_to_hash,"%s", strerror(errno));
+	    return false;
+	}
+	break;
+    case iomode::unbuffered:
+    case iomode::mmapped:
+	assert(fdht->fd==-1);
+	fdht->fd    = _topen(file_name_to_hash.c_str(),O_BINARY|O_RDONLY,0);
+	if(fdht->fd<0){
+	    ocb->error_filename(fdht->file_name_to_hash,"%s", strerror(errno));
+	    return false;
+	}
+	break;
+    default:
+	ocb->fatal_error("hash.cpp: iomode setting invalid (%d)",ocb->opt_iomode);
+    }
+
+    int mfd = fdht->handle ? fileno(fdht->handle) : fdht->fd;
+    if(file_metadata_t::fstat(mfd,fdht->file_name_to_hash,&fdht->metadata,*ocb)){
+	return false;
+    }
+    fdht->stat_bytes = fdht->metadata.size;
+    fdht->ctime      = fdht->metadata.ctime;
+    fdht->mtime      = fdht->metadata.mtime;
+    fdht->atime      = fdht->metadata.atime;
+    fdht->block_size = choose_block_size(ocb->opt_blocksize,fdht->metadata.blksize);
 
-	    if(fdht->handle==0){
-		ocb->error_filename(fdht->file_name_to_hash,"%s", strerror(errno));
-		return;
-	    }
-	    break;
-	case iomode::unbuffered:
-	    assert(fdht->fd==-1);
-	    fdht->fd    = _topen(file_name_to_hash.c_str(),O_BINARY|O_RDONLY,0);
-	    if(fdht->fd<0){
-		ocb->error_filename(fdht->file_name_to_hash,"%s", strerror(errno));
-		return;
-	    }
-	    break;
-	case iomode::mmapped:
-	    fdht->fd    = _topen(file_name_to_hash.c_str(),O_BINARY|O_RDONLY,0);
-	    if(fdht->fd<0){
-		ocb->error_filename(fdht->file_name_to_hash,"%s", strerror(errno));
-		return;
-	    }
 #ifdef HAVE_MMAP
-	    fdht->base = (uint8_t *)mmap(0,fdht->stat_bytes,PROT_READ,
+    if(ocb->opt_iomode==iomode::mmapped){
+	fdht->base = (uint8_t *)mmap(0,fdht->stat_bytes,PROT_READ,
 #if HAVE_DECL_MAP_FILE
-		MAP_FILE|
+	    MAP_FILE|
 #endif
-		MAP_SHARED,fd,0);
-	    if(fdht->base != (void *) -1){
-		/* mmap is successful, so set the bounds.
-		 * if it is not successful, we default to reading the fd
-		 */
-		fdht->bounds = fdht->stat_bytes;
-	    }
-#endif
-	    break;
-	default:
-	    ocb->fatal_error("hash.cpp: iomode setting invalid (%d)",ocb->opt_iomode);
+	    MAP_SHARED,fd,0);
+	if(fdht->base != (void *) -1){
+	    /* mmap is successful, so set the bounds.
+	     * if it is not successful, we default to reading the fd
+	     */
+	    fdht->bounds = fdht->stat_bytes;
+	} else {
+	    fdht->base = 0;
 	}
+    }
+#endif
+    return true;
+}
+
+
+/**
+ * Open the file, then see if it is above the size threshold set by the
+ * user. If it is, it is skipped, and the hash may be shown as stars.
+ * Returns true if the file should be hashed.
+ */
+bool file_data_hasher_t::open_to_hash()
+{
+    file_data_hasher_t *fdht = this;
+
+    /* Open the file and print an error if we can't */
+    if(fdht->open_file()==false){
+	return false;
+    }
+
+    // If this file is above the size threshold set by the user, skip it
+    // and set the hash to be stars
+    if ((ocb->mode_size) and (fdht->stat_bytes > ocb->size_threshold)) 
+    {
+      if (ocb->mode_size_all) 
+      {
+	fdht->digests.skip();	// displayed as stars
 
-	// If this file is above the size threshold set by the user, skip it
-	// and set the hash to be stars
-	if ((ocb->mode_size) and (fdht->stat_bytes > ocb->size_threshold)) 
+	if (md5deep_mode)
 	{
-	  if (ocb->mode_size_all) 
-	  {
-	    for (int i = 0 ; i < NUM_ALGORITHMS ; ++i) 
-	    {
-	      if (hashes[i].inuse)
-	      {
-		fdht->hash_hex[i] = make_stars(hashes[i].bit_length/4);
-	      }
-	    }
+	  fdht->ocb->md5deep_display_hash(fdht,0); // no hash
+	} 
+	else 
+	{
+	  // RBF - This line causes a CRASH. The function display_hash
+	  // RBF - accesses fields in the second argument, which is supposed
+	  // RBF - to be a pointer, without checking whether the pointer
+	  // RBF - is valid or not.
+	  // RBF - Replicate with ./hashdeep -I 1 *
+	  fdht->ocb->display_hash(fdht,0);
+	}
+      }
 
-	    if (md5deep_mode)
-	    {
-	      fdht->ocb->md5deep_display_hash(fdht,0); // no hash
-	    } 
-	    else 
-	    {
-	      // RBF - This line causes a CRASH. The function display_hash
-	      // RBF - accesses fields in the second argument, which is supposed
-	      // RBF - to be a pointer, without checking whether the pointer
-	      // RBF - is valid or not.
-	      // RBF - Replicate with ./hashdeep -I 1 *
-	      fdht->ocb->display_hash(fdht,0);
-	    }
-	  }
+      // close will happend when the fdht is killed
+      return false;
+    }
+    return true;
+}
+
+
+void file_data_hasher_t::hash()
+{
+    file_data_hasher_t *fdht = this;
 
-	  // close will happend when the fdht is killed
-	  return ;
+    /*
+     * If the handle is set, we are probably hashing stdin.
+     * If not, figure out file size and full file name for the handle
+     */
+    if(fdht->handle==0){		
+	if(fdht->open_to_hash()==false){
+	    return;
 	}
     }
 
@@ -346,11 +487,11 @@ void file_data_hasher_t::hash()
 	hash_context_obj hc_triage;
 	hc_triage.multihash_initialize();
 	bool success = fdht->compute_hash(0,512,&hc_triage,0);
-	hc_triage.multihash_finalize(this->hash_hex);			// finalize and save the results
+	hc_triage.multihash_finalize(this->digests);			// finalize and save the results
 
 	if(success){
 	    std::stringstream ss;
-	    ss << fdht->stat_bytes << "\t" << fdht->hash_hex[opt_md5deep_mode_algorithm];
+	    ss << fdht->stat_bytes << "\t" << fdht->digests.hex(opt_md5deep_mode_algorithm);
 	    fdht->triage_info = ss.str();
 	}
 
@@ -373,11 +514,39 @@ void file_data_hasher_t::hash()
     uint64_t request_start = 0;
     hash_context_obj *hc_file= 0;	// if we are doing picewise hashing, this stores the file context
 
-    if(fdht->ocb->piecewise_size>0){
+    if(fdht->ocb->piecewise_size>0 && ocb->dfxml_enabled()){
 	hc_file = new hash_context_obj();
 	hc_file->multihash_initialize();
     }
 
+#if defined(HAVE_PTHREAD) && defined(HAVE_PREAD)
+    /*
+     * The pieces of a large file can be hashed by several workers at once.
+     * Pieces smaller than a read block aren't worth spreading around.
+     * DFXML also needs the hash of the whole file, which has to be fed
+     * every piece in order, so then one thread reads the file once.
+     */
+    if(hc_file==0 && ocb->tp && ocb->tp->num_workers()>1 && fdht->workerid>=0 && fdht->is_stdin()==false
+       && ocb->piecewise_size>=MD5DEEP_MIN_BLOCK_SIZE
+       && fdht->stat_bytes>ocb->piecewise_size
+       && algorithm_t::algorithms_in_use_count()>0){
+	piecewise_job job(fdht,ocb->piecewise_size,2*ocb->tp->num_workers());
+	job.recruit(ocb->tp);
+	job.sequence(ocb->tp);
+	fdht->eof = true;
+    }
+#endif
+
+    /* Large files can be hashed with a thread for each algorithm */
+    if(fdht->eof==false && ocb->opt_pipeline_size>0 && fdht->stat_bytes>=ocb->opt_pipeline_size
+       && algorithm_t::algorithms_in_use_count()>1){
+	fdht->pipeline = new hash_pipeline();
+	if(fdht->pipeline->start(fdht->block_size)==false){
+	    delete fdht->pipeline;	// just hash it the normal way
+	    fdht->pipeline = 0;
+	}
+    }
+
     while (fdht->eof==false)  {
 	
 	uint64_t request_len = fdht->stat_bytes; // by default, hash the file
@@ -392,7 +561,7 @@ void file_data_hasher_t::hash()
 	hash_context_obj hc_piece;
 	hc_piece.multihash_initialize();
 	bool r = fdht->compute_hash(request_start,request_len,&hc_piece,hc_file);
-	hc_piece.multihash_finalize(this->hash_hex);			// finalize and save the results
+	hc_piece.multihash_finalize(this->digests);			// finalize and save the results
 
 	if (r==false) {
 	    break;
@@ -407,25 +576,7 @@ void file_data_hasher_t::hash()
 	 */
 
 	if (hc_piece.read_len > 0 || fdht->stat_bytes==0 || fdht->is_stdin()) {
-	    if(md5deep_mode){
-		/**
-		 * Under not matched mode, we only display those known hashes that
-		 *  didn't match any input files. Thus, we don't display anything now.
-		 * The lookup is to mark those known hashes that we do encounter.
-		 * searching for the hash will cause matched_file_number to be set
-		 */
-		if (ocb->mode_not_matched){
-		    ocb->find_hash(opt_md5deep_mode_algorithm,
-				   fdht->hash_hex[opt_md5deep_mode_algorithm],
-				   fdht->file_name,
-				   fdht->file_number);
-		}
-		else {
-		    ocb->md5deep_display_hash(this,&hc_piece);
-		}
-	    } else {
-		ocb->display_hash(fdht,&hc_piece);
-	    }
+	    fdht->display_piece(&hc_piece);
 	}
     }
 
@@ -435,28 +586,328 @@ void file_data_hasher_t::hash()
      * We want both the hash of the file and of the context.
      */
     if(hc_file){
-	std::string file_hashes[NUM_ALGORITHMS];
-	hc_file->multihash_finalize(file_hashes);
-	this->dfxml_write_hashes(file_hashes,0);
+	hash_digests file_digests;
+	hc_file->multihash_finalize(file_digests);
+	this->dfxml_write_hashes(file_digests,0);
     }
 
     ocb->dfxml_write(this);
     if(hc_file) delete hc_file;
+    if(fdht->pipeline){
+	delete fdht->pipeline;
+	fdht->pipeline = 0;
+    }
+}
+
+
+/**
+ * Display the hash of the piece (or the whole file) just hashed,
+ * which is in digests.
+ */
+void file_data_hasher_t::display_piece(const hash_context_obj *hc)
+{
+    if(md5deep_mode){
+	/**
+	 * Under not matched mode, we only display those known hashes that
+	 *  didn't match any input files. Thus, we don't display anything now.
+	 * The lookup is to mark those known hashes that we do encounter.
+	 * searching for the hash will mark the known hash as matched
+	 */
+	if (ocb->mode_not_matched){
+	    ocb->find_hash(opt_md5deep_mode_algorithm,
+			   this->digests.get(opt_md5deep_mode_algorithm),
+			   this->file_name,
+			   this->file_number);
+	}
+	else {
+	    ocb->md5deep_display_hash(this,hc);
+	}
+    } else {
+	ocb->display_hash(this,hc);
+    }
 }
 
 
 #ifdef HAVE_PTHREAD
-/* Here is where we tie-in to the threadpool system.
+/****************************************************************
+ *** Piecewise hashing with several workers
+ ****************************************************************/
+
+piecewise_job::piecewise_job(file_data_hasher_t *fdht_,uint64_t piece_size_,unsigned int window_size):
+    M(),TOSEQUENCER(),TOHELPER(),fdht(fdht_),piece_size(piece_size_),
+    npieces((fdht_->stat_bytes+piece_size_-1)/piece_size_),
+    next_piece(0),emitted(0),helpers(0),quit(false),window(window_size)
+{
+    if(pthread_cond_init(&TOSEQUENCER,NULL)) fdht->ocb->fatal_error("piecewise_job: pthread_cond_init failed");
+    if(pthread_cond_init(&TOHELPER,NULL))    fdht->ocb->fatal_error("piecewise_job: pthread_cond_init failed");
+}
+
+piecewise_job::~piecewise_job()
+{
+    pthread_cond_destroy(&TOSEQUENCER);
+    pthread_cond_destroy(&TOHELPER);
+}
+
+/**
+ * Put a helper task on the sequencer's deque for each idle worker to steal,
+ * up to the number of unclaimed pieces beyond the one the sequencer will hash next.
  */
-void worker::do_work(file_data_hasher_t *fdht)
+void piecewise_job::recruit(threadpool *tp)
 {
-    fdht->set_workerid(workerid);
-    fdht->hash();
-    delete fdht;
+    unsigned int idle = tp->idle_workers();
+    M.lock();
+    while(idle>0 && quit==false && next_piece+helpers+1 < npieces){
+	helpers++;			// before the helper can run and leave
+	if(tp->schedule_local(fdht->workerid,this)==false){
+	    helpers--;
+	    break;
+	}
+	idle--;
+    }
+    M.unlock();
+}
+
+/**
+ * A helper hashes the next unclaimed piece until there are none left.
+ * It waits if the piece would be too far ahead of the sequencer.
+ */
+void piecewise_job::help()
+{
+    M.lock();
+    while(true){
+	while(quit==false && next_piece<npieces && next_piece>=emitted+window.size()){
+	    pthread_cond_wait(&TOHELPER,&M.mutex);
+	}
+	if(quit || next_piece>=npieces) break;
+	uint64_t p = next_piece++;
+	piece &s = window[p % window.size()]; // ours until we set done
+	M.unlock();
+
+	hash_context_obj hc;
+	hc.multihash_initialize();
+	bool ok = fdht->hash_piece(p*piece_size,piece_size,&hc);
+	hc.multihash_finalize(s.digests);
+
+	M.lock();
+	s.ok       = ok;
+	s.read_len = hc.read_len;
+	s.done     = true;
+	pthread_cond_signal(&TOSEQUENCER);
+    }
+    helpers--;
+    pthread_cond_signal(&TOSEQUENCER);
+    M.unlock();
+}
+
+/**
+ * The sequencer displays the pieces in order. If the next piece hasn't
+ * been claimed, it hashes it itself; that way it never waits for a helper
+ * that hasn't started.
+ */
+void piecewise_job::sequence(threadpool *tp)
+{
+    M.lock();
+    while(emitted<npieces){
+	uint64_t p = emitted;
+	piece &s = window[p % window.size()];
+	hash_context_obj hc_piece;
+	bool ok = true;
+	bool mine = (next_piece==p);
+	if(mine){
+	    next_piece++;
+	    M.unlock();
+	    hc_piece.multihash_initialize();
+	    ok = fdht->hash_piece(p*piece_size,piece_size,&hc_piece);
+	    hc_piece.multihash_finalize(fdht->digests);
+	    M.lock();
+	} else {
+	    while(s.done==false){
+		pthread_cond_wait(&TOSEQUENCER,&M.mutex);
+	    }
+	    ok = s.ok;
+	    hc_piece.read_offset = p*piece_size;
+	    hc_piece.read_len    = s.read_len;
+	    fdht->digests = s.digests;
+	    s.done = false;
+	}
+	emitted++;
+	pthread_cond_broadcast(&TOHELPER); // the window moved
+	M.unlock();
+
+	if(ok==false){
+	    M.lock();
+	    break;			// error already printed
+	}
+	fdht->file_bytes += hc_piece.read_len;
+	if(hc_piece.read_len>0){
+	    fdht->display_piece(&hc_piece);
+	}
+	if (fdht->ocb->opt_estimate)    {
+	    time_t current_time = time(0);
+	    if (fdht->last_time != current_time) {
+		fdht->last_time = current_time;
+		fdht->ocb->display_realtime_stats(fdht,&hc_piece,current_time - fdht->start_time);
+	    }
+	}
+	recruit(tp);			// workers may have become free
+	M.lock();
+    }
+
+    /* Stop the helpers and wait for them to leave; they use this object.
+     * Helper tasks that nobody stole are still on our deque, so run them;
+     * they leave right away.
+     */
+    quit = true;
+    pthread_cond_broadcast(&TOHELPER);
+    M.unlock();
+    tp->run_local(fdht->workerid);
+    M.lock();
+    while(helpers>0){
+	pthread_cond_wait(&TOSEQUENCER,&M.mutex);
+    }
+    M.unlock();
+    if (fdht->ocb->opt_estimate) fdht->ocb->clear_realtime_stats();
 }
 #endif
 
 
+/****************************************************************
+ *** Batches of small files
+ ****************************************************************/
+
+/**
+ * Read all of a small file that was just opened into buf, for a
+ * file_batch. Returns how much was read, or -1 if the file is now too
+ * large for a batch or there was an error, which hash() will report
+ * when the file is hashed the usual way.
+ */
+ssize_t file_data_hasher_t::read_small(unsigned char *buf)
+{
+    if(this->stat_bytes > file_batch::MAX_FILE_SIZE) return -1;
+    size_t want = this->stat_bytes;
+    size_t got  = 0;
+    if(this->base){
+	got = min(want,this->bounds);
+	memcpy(buf,this->base,got);
+    }
+    while(this->base==0 && got<want){
+	ssize_t n = 0;
+	if(this->handle){
+	    n = fread(buf+got,1,want-got,this->handle);
+	    if(ferror(this->handle)) return -1;
+	} else {
+	    n = read(this->fd,buf+got,want-got);
+	    if(n<0) return -1;
+	}
+	if(n==0) break;
+	got += n;
+    }
+    this->file_bytes = got;
+    this->eof = true;
+    return got;
+}
+
+
+/**
+ * Open and read each file in the batch, then hash them all: an algorithm
+ * with a lane kernel hashes several files at once, and the others one
+ * after another. The files are closed as soon as they are read, so a
+ * batch holds no more than one open at a time.
+ */
+void file_batch::hash(int workerid)
+{
+    if(files.empty()) return;
+    display *ocb = files[0]->ocb;
+    bool ordered = ocb->opt_ordered && workerid>=0;
+    size_t room  = MAX_FILES*(MAX_FILE_SIZE+64);
+    unsigned char *buf = io_buffer::get(room,io_buffer::BATCH);
+    if(buf==0){
+	ocb->fatal_error("Out of memory allocating a %u byte batch buffer",(unsigned int)room);
+    }
+
+    std::vector<const unsigned char *> data;
+    std::vector<size_t>		len;
+    std::vector<hash_digests *>	dest;
+    std::vector<bool>		was_read(files.size(),false);
+    size_t used = 0;
+    for(size_t i=0;i<files.size();i++){
+	file_data_hasher_t *f = files[i];
+	f->set_workerid(workerid);
+	if(ordered) ocb->begin_file_output(f);
+	if(f->open_to_hash()==false){	// an error, or skipped by -i/-I
+	    if(ordered) ocb->end_file_output();
+	    delete f;
+	    files[i] = 0;
+	    continue;
+	}
+	ssize_t n = f->read_small(buf+used);
+	f->close_file();
+	if(n<0) continue;		// hashed the usual way below
+	was_read[i] = true;
+	f->digests.clear();
+	data.push_back(buf+used);
+	len.push_back(n);
+	dest.push_back(&f->digests);
+	used += (n+63) & ~63;
+    }
+
+    for(int alg=0;alg<NUM_ALGORITHMS && data.size()>0;alg++){
+	if(hashes[alg].inuse==false) continue;
+	if(hashes[alg].lanes){
+	    hashes[alg].lanes->digest((hashid_t)alg,data.size(),&data[0],&len[0],&dest[0]);
+	    continue;
+	}
+	for(size_t i=0;i<data.size();i++){
+	    uint64_t ctx[MAX_ALGORITHM_CONTEXT_SIZE/sizeof(uint64_t)];
+	    uint8_t residue[MAX_ALGORITHM_RESIDUE_SIZE];
+	    hashes[alg].f_init(ctx);
+	    hashes[alg].f_update(ctx,data[i],len[i]);
+	    hashes[alg].f_finalize(ctx,residue);
+	    dest[i]->set(alg,residue);
+	}
+    }
+
+    for(size_t i=0;i<files.size();i++){
+	file_data_hasher_t *f = files[i];
+	if(f==0) continue;
+	if(ordered) ocb->begin_file_output(f);
+	if(was_read[i]){
+	    hash_context_obj hc;
+	    hc.read_offset = 0;
+	    hc.read_len    = f->file_bytes;
+	    if(hc.read_len>0 || f->stat_bytes==0){
+		f->display_piece(&hc);
+	    }
+	    ocb->dfxml_write(f);
+	} else {
+	    f->hash();			// it opens the file again
+	}
+	if(ordered) ocb->end_file_output();
+	delete f;
+    }
+    files.clear();
+}
+
+
+void file_batch::run(worker *w)
+{
+    this->hash(w->workerid);
+    delete this;
+}
+
+
+/* Here is where we tie-in to the threadpool system.
+ */
+void file_data_hasher_t::run(worker *w)
+{
+    this->set_workerid(w->workerid);
+    if(ocb->opt_ordered) ocb->begin_file_output(this);
+    this->hash();
+    if(ocb->opt_ordered) ocb->end_file_output();
+    delete this;
+}
+
+
 /**
  * Primary entry point for a file being hashed.
  * Given a file name:
@@ -467,11 +918,34 @@ void worker::do_work(file_data_hasher_t *fdht)
  * 2 - hash the fdht
  * 3 - record it in stdout using display.
  */
-void display::hash_file(const tstring &fn)
+void display::hash_file(const tstring &fn,const file_metadata_t *m)
 {
+    bool small = batching(m);
+    if(!small) pass_file_batch();
+#ifdef HAVE_PTHREAD
+    if(tp && opt_ordered){
+	wait_for_ordered_window();	// before the file gets its number
+    }
+#endif
     file_data_hasher_t *fdht = new file_data_hasher_t(this);
     fdht->file_name_to_hash = fn;
 
+    /* Small files wait for others to be hashed with */
+    if(small){
+	file_batch *full = 0;
+	batch_lock.lock();
+	if(batch==0) batch = new file_batch();
+	batch->files.push_back(fdht);
+	batch->bytes += m ? m->size : file_batch::MAX_FILE_SIZE;
+	if(batch->full()){
+	    full  = batch;
+	    batch = 0;
+	}
+	batch_lock.unlock();
+	if(full) hash_batch(full);
+	return;
+    }
+
     /**
      * If we are using a thread pool, hash in another thread
      * with do_work 
@@ -488,6 +962,63 @@ void display::hash_file(const tstring &fn)
 }
 
 
+/**
+ * Files go in a batch if an algorithm we are using has a lane kernel
+ * and the file is small, or we don't know how large it is yet. Modes
+ * that do more than hash each whole file once don't use batches.
+ */
+bool display::batching(const file_metadata_t *m) const
+{
+    if(algorithm_t::lanes_in_use()==false) return false;
+    if(piecewise_size>0 || mode_triage || opt_estimate) return false;
+    return m==0 || m->size <= file_batch::MAX_FILE_SIZE;
+}
+
+/**
+ * Count a file that is scheduled on its own while a batch is being
+ * filled, and schedule the batch once MAX_PASSED of them have gone by.
+ * Without threads the files are written as they are hashed, so the
+ * batch goes first to keep them in the order they were found.
+ */
+void display::pass_file_batch()
+{
+    if(algorithm_t::lanes_in_use()==false) return; // there are no batches
+    bool in_order = true;
+#ifdef HAVE_PTHREAD
+    in_order = (tp==0);
+#endif
+    file_batch *b = 0;
+    batch_lock.lock();
+    if(batch && (in_order || ++batch->passed>=file_batch::MAX_PASSED)){
+	b     = batch;
+	batch = 0;
+    }
+    batch_lock.unlock();
+    if(b) hash_batch(b);
+}
+
+void display::hash_batch(file_batch *b)
+{
+#ifdef HAVE_PTHREAD
+    if(tp){
+	tp->schedule_work(b);
+	return;
+    }
+#endif
+    b->hash(-1);
+    delete b;
+}
+
+void display::flush_file_batch()
+{
+    batch_lock.lock();
+    file_batch *b = batch;
+    batch = 0;
+    batch_lock.unlock();
+    if(b) hash_batch(b);
+}
+
+
 /* Hashing stdin can only be done with buffered I/O.
  * Note that it is only hashed in the main thread.
  * No reason to hash stdin in other threads, since we
@@ -510,6 +1041,333 @@ void display::hash_stdin()
 #else
     fdht->stat_bytes = 0x7fffffffffffffffLL;
 #endif
+    fdht->block_size = file_data_hasher_t::choose_block_size(opt_blocksize,0);
     fdht->hash();
     delete fdht;
 }
+
+
+/**
+ * Benchmark mode (-T blocksize).
+ * Hash a file once with each power-of-two block size we allow
+ * and report the throughput, so that the user can pick a good -R value
+ * for their storage. Where we can, the file is dropped from the page cache
+ * before each pass so that we measure the device and not memory.
+ */
+void display::benchmark_block_sizes(const tstring &fn)
+{
+    for(size_t bs=file_data_hasher_t::MD5DEEP_MIN_BLOCK_SIZE;
+	bs<=file_data_hasher_t::MD5DEEP_MAX_BLOCK_SIZE;bs*=2){
+	file_data_hasher_t fdht(this);
+	fdht.file_name_to_hash = fn;
+	if(fdht.open_file()==false) return; // error already printed
+	fdht.block_size = bs;
+
+	if(bs==file_data_hasher_t::MD5DEEP_MIN_BLOCK_SIZE){
+	    status("%s: %"PRIu64" bytes",fdht.file_name.c_str(),fdht.stat_bytes);
+	}
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_DONTNEED)
+	int cfd = fdht.handle ? fileno(fdht.handle) : fdht.fd;
+	if(cfd>=0) posix_fadvise(cfd,0,0,POSIX_FADV_DONTNEED);
+#endif
+
+	struct timeval t0,t1;
+	gettimeofday(&t0,0);
+	hash_context_obj hc;
+	hc.multihash_initialize();
+	bool r = fdht.compute_hash(0,fdht.stat_bytes,&hc,0);
+	hc.multihash_finalize(fdht.digests);
+	gettimeofday(&t1,0);
+	if(r==false) return;
+
+	double seconds = (t1.tv_sec-t0.tv_sec) + (t1.tv_usec-t0.tv_usec)/1000000.0;
+	double mbps = seconds>0 ? (fdht.file_bytes/(double)ONE_MEGABYTE)/seconds : 0;
+	if(bs>=ONE_MEGABYTE){
+	    status("%6um %10.1f MB/s",(unsigned int)(bs/ONE_MEGABYTE),mbps);
+	} else {
+	    status("%6uk %10.1f MB/s",(unsigned int)(bs/1024),mbps);
+	}
+    }
+}
+
+
+/* Hash len bytes of data with kernel k, in pieces of at most 'piece' bytes */
+static void kernel_digest(const algorithm_t::kernel_t &k,const unsigned char *data,size_t len,
+			  size_t piece,unsigned char *digest)
+{
+    uint64_t ctx[MAX_ALGORITHM_CONTEXT_SIZE/sizeof(uint64_t)];
+    k.f_init(ctx);
+    while(len>0){
+	size_t n = std::min(len,piece);
+	k.f_update(ctx,data,n);
+	data += n;
+	len  -= n;
+    }
+    k.f_finalize(ctx,digest);
+}
+
+/*
+ * Does kernel k agree with the portable kernel p? We try every length up
+ * to several blocks, so that every way the padding can fall is covered,
+ * and some long ones, with one of them fed in pieces of odd sizes.
+ */
+static bool kernels_agree(const algorithm_t::kernel_t &p,const algorithm_t::kernel_t &k,
+			  size_t digest_size,const std::vector<unsigned char> &data)
+{
+    unsigned char a[MAX_ALGORITHM_RESIDUE_SIZE], b[MAX_ALGORITHM_RESIDUE_SIZE];
+    static const size_t long_lengths[] = {1000, 4095, 4096, 65537, 1<<20};
+    static const size_t pieces[] = {1, 3, 63, 64, 65, 1000};
+    for(size_t len=0;len<=520;len++){
+	kernel_digest(p,&data[0],len,len+1,a);
+	kernel_digest(k,&data[0],len,pieces[len%6],b);
+	if(memcmp(a,b,digest_size)) return false;
+    }
+    for(size_t i=0;i<sizeof(long_lengths)/sizeof(long_lengths[0]);i++){
+	size_t len = std::min(long_lengths[i],data.size());
+	kernel_digest(p,&data[0],len,len,a);
+	kernel_digest(k,&data[0],len,len,b);
+	if(memcmp(a,b,digest_size)) return false;
+	kernel_digest(k,&data[0],len,pieces[i],b);
+	if(memcmp(a,b,digest_size)) return false;
+    }
+    return true;
+}
+
+/*
+ * Does lane kernel k agree with the portable kernel p? The same lengths
+ * as above, in batches that don't divide evenly into the lanes, so that
+ * lanes sit idle while others finish.
+ */
+static bool lanes_agree(const algorithm_t::kernel_t &p,const algorithm_t::lane_kernel_t &k,
+			hashid_t alg,const std::vector<unsigned char> &data)
+{
+    static const size_t long_lengths[] = {1000, 4095, 4096, 65537, 1<<20};
+    std::vector<size_t> lengths;
+    for(size_t len=0;len<=520;len++) lengths.push_back(len);
+    for(size_t i=0;i<sizeof(long_lengths)/sizeof(long_lengths[0]);i++){
+	lengths.push_back(std::min(long_lengths[i],data.size()));
+    }
+
+    size_t batch = 3*k.lanes+1;
+    for(size_t first=0;first<lengths.size();first+=batch){
+	size_t count = std::min(batch,lengths.size()-first);
+	std::vector<const unsigned char *> ptrs(count);
+	std::vector<hash_digests> digests(count);
+	std::vector<hash_digests *> dest(count);
+	for(size_t i=0;i<count;i++){
+	    ptrs[i] = &data[0] + (first+i)%7; // not all aligned
+	    if(lengths[first+i] > data.size()-7) lengths[first+i] = data.size()-7;
+	    dest[i] = &digests[i];
+	}
+	k.digest(alg,count,&ptrs[0],&lengths[first],&dest[0]);
+	for(size_t i=0;i<count;i++){
+	    unsigned char a[MAX_ALGORITHM_RESIDUE_SIZE];
+	    kernel_digest(p,ptrs[i],lengths[first+i],lengths[first+i]+1,a);
+	    if(!digests[i].has(alg) || memcmp(a,digests[i].get(alg),hash_digests::size(alg))) return false;
+	}
+    }
+    return true;
+}
+
+/**
+ * Benchmark mode (-T kernels).
+ * Every implementation of every algorithm that this processor can run
+ * is checked against the portable one and timed. A kernel that gets a
+ * different answer is an error; -H can be used to avoid it.
+ */
+void display::benchmark_kernels()
+{
+    uint32_t features = cpu_features();
+    status("processor features: %s",features ? cpu_feature_names(features).c_str() : "none");
+
+    std::vector<unsigned char> data(ONE_MEGABYTE);
+    uint32_t x = 2463534242U;		// xorshift, so every run hashes the same data
+    for(size_t i=0;i<data.size();i++){
+	x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+	data[i] = (unsigned char)x;
+    }
+
+    for(int alg=0;alg<NUM_ALGORITHMS;alg++){
+	const algorithm_t &a = hashes[alg];
+	if(a.kernels.empty()) continue;
+	for(std::vector<algorithm_t::kernel_t>::const_iterator it=a.kernels.begin();it!=a.kernels.end();it++){
+	    if(!it->runs_here()){
+		status("%-10s %-10s needs %s",a.name.c_str(),it->name.c_str(),
+		       cpu_feature_names(it->needs).c_str());
+		continue;
+	    }
+	    if(it!=a.kernels.begin() && !kernels_agree(a.kernels.front(),*it,a.bit_length/8,data)){
+		error("%s: the %s implementation disagrees with the portable one",
+		      a.name.c_str(),it->name.c_str());
+		set_return_code(status_t::status_EXIT_FAILURE);
+		continue;
+	    }
+
+	    unsigned char digest[MAX_ALGORITHM_RESIDUE_SIZE];
+	    uint64_t ctx[MAX_ALGORITHM_CONTEXT_SIZE/sizeof(uint64_t)];
+	    const int passes = 32;
+	    struct timeval t0,t1;
+	    gettimeofday(&t0,0);
+	    it->f_init(ctx);
+	    for(int i=0;i<passes;i++) it->f_update(ctx,&data[0],data.size());
+	    it->f_finalize(ctx,digest);
+	    gettimeofday(&t1,0);
+	    double seconds = (t1.tv_sec-t0.tv_sec) + (t1.tv_usec-t0.tv_usec)/1000000.0;
+	    double mbps = seconds>0 ? passes/seconds : 0;
+	    status("%-10s %-10s %10.1f MB/s%s",a.name.c_str(),it->name.c_str(),mbps,
+		   a.kernel==it->name ? "  (in use)" : "");
+	}
+
+	/* The lane kernels are timed the way they are used, on small files */
+	for(std::vector<algorithm_t::lane_kernel_t>::const_iterator it=a.lane_kernels.begin();
+	    it!=a.lane_kernels.end();it++){
+	    if(!it->runs_here()){
+		status("%-10s %-10s needs %s",a.name.c_str(),it->name.c_str(),
+		       cpu_feature_names(it->needs).c_str());
+		continue;
+	    }
+	    if(!lanes_agree(a.kernels.front(),*it,(hashid_t)alg,data)){
+		error("%s: the %s implementation disagrees with the portable one",
+		      a.name.c_str(),it->name.c_str());
+		set_return_code(status_t::status_EXIT_FAILURE);
+		continue;
+	    }
+
+	    const size_t small = 4096;
+	    const size_t count = data.size()/small;
+	    std::vector<const unsigned char *> ptrs(count);
+	    std::vector<size_t> lengths(count,small);
+	    std::vector<hash_digests> digests(count);
+	    std::vector<hash_digests *> dest(count);
+	    for(size_t i=0;i<count;i++){
+		ptrs[i] = &data[i*small];
+		dest[i] = &digests[i];
+	    }
+	    const int passes = 32;
+	    struct timeval t0,t1;
+	    gettimeofday(&t0,0);
+	    for(int i=0;i<passes;i++) it->digest((hashid_t)alg,count,&ptrs[0],&lengths[0],&dest[0]);
+	    gettimeofday(&t1,0);
+	    double seconds = (t1.tv_sec-t0.tv_sec) + (t1.tv_usec-t0.tv_usec)/1000000.0;
+	    double mbps = seconds>0 ? passes/seconds : 0;
+	    status("%-10s %-10s %10.1f MB/s  %u lanes%s",a.name.c_str(),it->name.c_str(),mbps,
+		   it->lanes,a.lanes==&*it ? "  (in use)" : "");
+	}
+    }
+}
+
+
+/* One way of reading and writing hex; see -T hex */
+struct hex_impl_t {
+    const char	*name;
+    void	(*encode)(const uint8_t *bin,size_t len,char *hex);
+    bool	(*decode)(const char *hex,size_t len,uint8_t *bin);
+    bool	(*valid)(const char *hex,size_t len);
+};
+
+/* The portable one first, and the one that hex_encode() and the rest use last */
+static const hex_impl_t hex_impls[] = {
+    {"portable",hex_encode_portable,hex_decode_portable,hex_valid_portable},
+#ifdef __SSE2__
+    {"sse2",hex_encode,hex_decode,hex_valid},
+#endif
+};
+
+/*
+ * Does h agree with the portable p? Every length up to the longest digest
+ * is tried, so that each way the 16 byte steps and the table can share
+ * one is covered, in both cases, and with every character that borders
+ * on the hex ones put in each place.
+ */
+static bool hex_agrees(const hex_impl_t &p,const hex_impl_t &h,const std::vector<uint8_t> &bin)
+{
+    static const char bad_chars[] = {'/',':','@','G','`','g',0,(char)0x80,(char)0xb0,(char)0xe6};
+    char a[2*MAX_ALGORITHM_RESIDUE_SIZE], b[2*MAX_ALGORITHM_RESIDUE_SIZE];
+    uint8_t x[MAX_ALGORITHM_RESIDUE_SIZE], y[MAX_ALGORITHM_RESIDUE_SIZE];
+    size_t longest = 0;
+    for(int alg=0;alg<NUM_ALGORITHMS;alg++) longest = std::max(longest,hash_digests::size(alg));
+    for(size_t len=0;len<=longest;len++){
+	p.encode(&bin[0],len,a);
+	h.encode(&bin[0],len,b);
+	if(memcmp(a,b,len*2)) return false;
+	for(size_t i=0;i<len*2;i+=3) a[i] = toupper(a[i]);
+	if(p.decode(a,len*2,x)!=true || h.decode(a,len*2,y)!=true || memcmp(x,y,len)) return false;
+	if(p.valid(a,len*2)!=true || h.valid(a,len*2)!=true) return false;
+	if(len>0 && (p.decode(a,len*2-1,x) || h.decode(a,len*2-1,y))) return false; // odd
+	for(size_t i=0;i<len*2;i++){
+	    char c = a[i];
+	    for(size_t j=0;j<sizeof(bad_chars);j++){
+		a[i] = bad_chars[j];
+		if(h.decode(a,len*2,y) || h.valid(a,len*2)) return false;
+	    }
+	    a[i] = c;
+	}
+    }
+    return true;
+}
+
+/**
+ * Benchmark mode (-T hex).
+ * Hex is written for every hash and read for every known hash, one digest
+ * at a time, so each way of doing it is checked against the portable one
+ * and timed on that many SHA-256 digests. No files are read.
+ */
+void display::benchmark_hex()
+{
+    const size_t count = 65536;
+    const size_t size  = 32;
+    const int passes = 32;
+    std::vector<uint8_t> bin(count*size), back(count*size);
+    std::vector<char> hex(count*size*2);
+    uint32_t x = 2463534242U;		// xorshift, as -T kernels
+    for(size_t i=0;i<bin.size();i++){
+	x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+	bin[i] = (uint8_t)x;
+    }
+
+    size_t impls = sizeof(hex_impls)/sizeof(hex_impls[0]);
+    for(size_t k=0;k<impls;k++){
+	const hex_impl_t &h = hex_impls[k];
+	if(k>0 && !hex_agrees(hex_impls[0],h,bin)){
+	    error("hex: the %s implementation disagrees with the portable one",h.name);
+	    set_return_code(status_t::status_EXIT_FAILURE);
+	    continue;
+	}
+	const char *in_use = k==impls-1 ? "  (in use)" : "";
+	struct timeval t0,t1;
+	double seconds;
+	uint64_t good = 0;
+
+	gettimeofday(&t0,0);
+	for(int i=0;i<passes;i++){
+	    for(size_t d=0;d<count;d++) h.encode(&bin[d*size],size,&hex[d*size*2]);
+	}
+	gettimeofday(&t1,0);
+	seconds = (t1.tv_sec-t0.tv_sec) + (t1.tv_usec-t0.tv_usec)/1000000.0;
+	status("%-10s %-10s %10.1f MB/s%s","encode",h.name,
+	       seconds>0 ? passes*(bin.size()/(double)ONE_MEGABYTE)/seconds : 0,in_use);
+
+	gettimeofday(&t0,0);
+	for(int i=0;i<passes;i++){
+	    for(size_t d=0;d<count;d++) good += h.decode(&hex[d*size*2],size*2,&back[d*size]);
+	}
+	gettimeofday(&t1,0);
+	seconds = (t1.tv_sec-t0.tv_sec) + (t1.tv_usec-t0.tv_usec)/1000000.0;
+	status("%-10s %-10s %10.1f MB/s%s","decode",h.name,
+	       seconds>0 ? passes*(bin.size()/(double)ONE_MEGABYTE)/seconds : 0,in_use);
+
+	gettimeofday(&t0,0);
+	for(int i=0;i<passes;i++){
+	    for(size_t d=0;d<count;d++) good += h.valid(&hex[d*size*2],size*2);
+	}
+	gettimeofday(&t1,0);
+	seconds = (t1.tv_sec-t0.tv_sec) + (t1.tv_usec-t0.tv_usec)/1000000.0;
+	status("%-10s %-10s %10.1f MB/s%s","check",h.name,
+	       seconds>0 ? passes*(bin.size()/(double)ONE_MEGABYTE)/seconds : 0,in_use);
+
+	if(good!=2*(uint64_t)passes*count || back!=bin){
+	    error("hex: the %s implementation didn't read back what it wrote",h.name);
+	    set_return_code(status_t::status_EXIT_FAILURE);
+	}
+    }
+}
@@ -2,7 +2,7 @@
 
 /** hashlist.cpp
  * Implements a list of hashes for local database, searching, etc.
- * Currently done with a map; could be done with an unordered set.
+ * Each algorithm has an open addressing index of the binary digests.
  * Contains the logic for performing the audit.
  * Formerly this code was in audit.cpp and match.cpp.
  */
@@ -11,80 +11,284 @@
 #include <new>
 #include <iostream>
 
+/****************************************************************
+ *** hashmap: the index of each algorithm's digests
+ ****************************************************************/
+
+/* The tag is the digest's first bytes. Every digest is at least 16 bytes.
+ * Real digests are uniformly distributed, but a known file can hold
+ * made-up ones that count up, so their bits are mixed before they pick a
+ * slot; otherwise they would all land together and every probe would be long.
+ */
+static inline uint32_t digest_tag(const uint8_t *digest)
+{
+    uint32_t tag;
+    memcpy(&tag,digest,sizeof(tag));
+    return tag;
+}
+
+static inline uint64_t digest_mix(const uint8_t *digest)
+{
+    uint64_t h;
+    memcpy(&h,digest+4,sizeof(h));
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline size_t digest_home(const uint8_t *digest,size_t mask)
+{
+    return (size_t)digest_mix(digest) & mask;
+}
+
+size_t hashlist::hashmap::find_slot(const records_t &records,int alg,const uint8_t *digest) const
+{
+    size_t   mask = slots.size()-1;
+    size_t   i    = digest_home(digest,mask);
+    uint32_t tag  = digest_tag(digest);
+    while (slots[i].entry)
+    {
+      if (slots[i].tag==tag &&
+	  memcmp(records[entries[slots[i].entry-1].record]->digests.get(alg),digest,hash_digests::size(alg))==0)
+	break;
+      i = (i+1) & mask;			// linear probing
+    }
+    return i;
+}
+
+void hashlist::hashmap::grow(const records_t &records,int alg)
+{
+    std::vector<slot> old(slots.size() ? slots.size()*2 : 1024);
+    old.swap(slots);
+    size_t mask = slots.size()-1;
+    for (std::vector<slot>::const_iterator it = old.begin(); it!=old.end(); it++)
+    {
+      if (it->entry==0) continue;
+      // the digests are all different, so we only need an empty slot
+      size_t i = digest_home(records[entries[it->entry-1].record]->digests.get(alg),mask);
+      while (slots[i].entry) i = (i+1) & mask;
+      slots[i] = *it;
+    }
+}
+
 /// Add a fi to the hash list.
 ///
-/// Be sure that the hash is all lower case, because that's what we
-/// use internally.
-void hashlist::hashmap::add_file(file_data_t *fi,int alg_num)
+/// The key is the binary digest, so the case of the hex it was
+/// loaded from doesn't matter.
+void hashlist::hashmap::add_file(const records_t &records,uint32_t record,int alg)
 {
-    if (fi->hash_hex[alg_num].size())
+    const file_data_t *fi = records[record];
+    if (fi->digests.has(alg)==false)
+      return;
+    if ((used+1)*10 > slots.size()*7)	// keep it at most 70% full
+      grow(records,alg);
+
+    const uint8_t *digest = fi->digests.get(alg);
+    entry e;
+    e.record = record;
+    e.next = 0;
+    e.last = 0;
+    entries.push_back(e);
+    uint32_t n = (uint32_t)entries.size();
+
+    slot &s = slots[find_slot(records,alg,digest)];
+    if (s.entry==0)
     {
-      std::string hexhash = fi->hash_hex[alg_num];
-      for (std::string::iterator it = hexhash.begin();it!=hexhash.end();it++)
-      {
-	if (isupper(*it))
-	  *it = tolower(*it);
-      }
-      insert(std::pair<std::string,file_data_t *>(hexhash,fi));
+      s.tag   = digest_tag(digest);
+      s.entry = n;
+      entries[n-1].last = n;
+      used++;
+      return;
     }
+    // Another file with a digest we already have; add it to the end of the chain
+    entry &first = entries[s.entry-1];
+    entries[first.last-1].next = n;
+    first.last = n;
+}
+
+hashlist::hashmap::cursor hashlist::hashmap::find(const records_t &records,int alg,const uint8_t *digest) const
+{
+    if (slots.empty())
+      return cursor(this,0);
+    return cursor(this,slots[find_slot(records,alg,digest)].entry);
 }
 
 
 /**
  * Adds a file_data_t pointer to the hashlist.
  * Does not copy the object.
- * Object will be modified if there is a match.
  */
 void hashlist::add_fdt(file_data_t *fi)
 {
+    assert(!frozen);
+    uint32_t record = (uint32_t)size();
     push_back(fi);			// retain our copy
+    if (record%64==0)
+      matched_bits.push_back(0);
     for(int i=0;i<NUM_ALGORITHMS;i++){	// and add for each algorithm
-	hashmaps[i].add_file(fi,i); // and point to the back
+	hashmaps[i].add_file(*this,record,i);
     };
 }
 
+/**
+ * Notes that a record was matched. Several threads may be searching,
+ * so the bit is set atomically; most records are matched just once,
+ * so we only write when it isn't set already.
+ */
+void hashlist::mark_matched(size_t record)
+{
+    uint64_t bit = (uint64_t)1 << (record%64);
+    uint64_t *word = &matched_bits[record/64];
+    if ((__atomic_load_n(word,__ATOMIC_RELAXED) & bit)==0)
+      __atomic_fetch_or(word,bit,__ATOMIC_RELAXED);
+}
+
+/****************************************************************
+ *** known_filter: a split block Bloom filter in front of the lookups
+ ****************************************************************/
+
+/* One odd multiplier for each word of a block picks the bit in that word */
+static const uint32_t filter_salt[8] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+hashlist::known_filter::known_filter(uint64_t keys_,bool counting_):
+    storage(),blocks(0),block_count(0),keys(keys_),counting(counting_),
+    lookups(0),rejected(0),false_positives(0)
+{
+    block_count = std::max((uint64_t)1,keys*BITS_PER_KEY/256);
+    storage.resize(block_count*8 + 16,0);	// room to align the blocks to 64 bytes
+    uintptr_t p = (uintptr_t)&storage[0];
+    blocks = (uint32_t *)((p + 63) & ~(uintptr_t)63);
+}
+
+/* The block and the key come from the digest's bits, mixed as the hashmap's are */
+const uint32_t *hashlist::known_filter::block(const uint8_t *digest,uint32_t *key) const
+{
+    uint64_t h = digest_mix(digest);
+    *key = (uint32_t)h;
+    return blocks + 8*(((h>>32) * block_count) >> 32);
+}
+
+void hashlist::known_filter::add(const uint8_t *digest)
+{
+    uint32_t key;
+    uint32_t *b = (uint32_t *)block(digest,&key);
+    for (int i=0; i<8; i++)
+      b[i] |= (uint32_t)1 << ((key*filter_salt[i]) >> 27);
+}
+
+bool hashlist::known_filter::may_contain(const uint8_t *digest) const
+{
+    uint32_t key;
+    const uint32_t *b = block(digest,&key);
+    for (int i=0; i<8; i++)
+    {
+      if ((b[i] & ((uint32_t)1 << ((key*filter_salt[i]) >> 27)))==0)
+	return false;
+    }
+    return true;
+}
+
+
 /**
  * search for a hash with an (optional) given filename.
  * Return the first hash that matches the filename.
  * If nothing matches the filename, return the first hash that matches.
- * If a match is found, set file_number in the hash that is found.
- * Not sure I like modifying the store, but it's okay for now.
+ * If a match is found and file_number is set, the record is marked matched.
+ * The records loaded from text are in the hashmap and those of each index
+ * are in the index; first means the lowest record number of them all.
  */
 file_data_t *hashlist::find_hash(hashid_t alg,
-				 const std::string &hash_hex,
+				 const uint8_t *digest,
 				 const std::string &file_name,
 				 uint64_t file_number)
 {
     if(opt_debug>2)
-      std::cerr << "find_hash alg=" << alg << " hash_hex=" << hash_hex <<
-	" fn=" << file_name << " file_number=" << file_number;
-    std::pair<hashmap::iterator,hashmap::iterator> match;
-    match = this->hashmaps[alg].equal_range(hash_hex);
-    if (match.first==match.second)
+      std::cerr << "find_hash alg=" << alg << " fn=" << file_name << " file_number=" << file_number;
+    known_filter *filter = filters[alg];
+    bool in_hashmap = true;
+    if (filter)
+    {
+      in_hashmap = filter->may_contain(digest);
+      if (filter->counting)
+      {
+	__sync_fetch_and_add(&filter->lookups,1);
+	if (!in_hashmap)
+	  __sync_fetch_and_add(&filter->rejected,1);
+      }
+      if (!in_hashmap && indexes.empty())
+      {
+	if (opt_debug>2)
+	  std::cerr << " RETURNS 0\n";
+	return 0; // certainly not known
+      }
+    }
+
+    const uint64_t none = ~(uint64_t)0;
+    uint64_t first = none;
+    uint64_t exact = none;
+
+    if (in_hashmap)
+    {
+      hashmap::cursor match = this->hashmaps[alg].find(*this,alg,digest);
+      if (match.done() && filter && filter->counting)
+	__sync_fetch_and_add(&filter->false_positives,1);
+      if (!match.done())
+	first = match.record();
+      for (; !match.done(); match.advance())
+      {
+	if ((*this)[match.record()]->file_name == file_name)
+	{
+	  exact = match.record();
+	  break;
+	}
+      }
+    }
+
+    for (std::vector<known_index *>::const_iterator it = indexes.begin(); it!=indexes.end(); it++)
+    {
+      const known_index *ix = *it;
+      if (!ix->has(alg) || ix->first > exact)
+	continue;
+      uint64_t p, end;
+      ix->find(alg,digest,&p,&end);
+      if (p < end && ix->first + ix->ordered(alg,p) < first)
+	first = ix->first + ix->ordered(alg,p);
+      for (; p < end && ix->first + ix->ordered(alg,p) < exact; p++)
+      {
+	if (ix->name_is(ix->ordered(alg,p),file_name))
+	{
+	  exact = ix->first + ix->ordered(alg,p);
+	  break;
+	}
+      }
+    }
+
+    if (first == none)
     {
       if (opt_debug>2)
 	std::cerr << " RETURNS 0\n";
       return 0; // nothing found
     }
 
-    for (hashmap::iterator it = match.first; it!=match.second; ++it)
+    if (exact != none)
     {
-      if ((*it).second->file_name == file_name)
-      {
-	if (file_number)
-	  (*it).second->matched_file_number = file_number;
-	if (opt_debug)
-	  std::cerr << " RETURNS EXACT MATCH " << file_number << "\n";
-	return (*it).second;
-      }
+      if (file_number)
+	mark_matched(exact);
+      if (opt_debug)
+	std::cerr << " RETURNS EXACT MATCH " << file_number << "\n";
+      return record(exact);
     }
 
     // No exact matches; return the first match
     if (file_number)
-      (*match.first).second->matched_file_number = file_number;
+      mark_matched(first);
     if (opt_debug)
       std::cerr << " RETURNS FIRST MATCH " << file_number << "\n";
-    return (*match.first).second;
+    return record(first);
 }
 
 
@@ -100,14 +304,14 @@ hashlist::searchstatus_t hashlist::search(const file_data_hasher_t *fdht,
   for (int alg = 0 ; alg < NUM_ALGORITHMS ; ++alg)
   {
     // Only search hash functions that are in use and hashes that are in the fdt
-    if (hashes[alg].inuse==0 || fdht->hash_hex[alg].size()==0)
+    if (hashes[alg].inuse==0 || fdht->digests.has(alg)==false)
     {
       continue;
     }
 
     // Find the best match using find_hash
     file_data_t *matched = find_hash((hashid_t)alg,
-				     fdht->hash_hex[alg],
+				     fdht->digests.get(alg),
 				     fdht->file_name,
 				     fdht->file_number);
 
@@ -127,10 +331,10 @@ hashlist::searchstatus_t hashlist::search(const file_data_hasher_t *fdht,
     {
       if (hashes[j].inuse and
 	  j != alg and
-	  fdht->hash_hex[j].size() and
-	  matched->hash_hex[j].size())
+	  fdht->digests.has(j) and
+	  matched->digests.has(j))
       {
-	if (fdht->hash_hex[j] != matched->hash_hex[j])
+	if (fdht->digests.same(j,matched->digests)==false)
 	{
 	  // We have found a hash collision for one algorithm, but not all
 	  // of them. For example, MD5(A) == MD5(B), but SHA1(A) != SHA1(B).
@@ -208,14 +412,24 @@ hashlist::hashfile_format hashlist::identify_format(class display *ocb,
 	return file_unknown;
     }
 
+    // Skip the "%%%% size," when parsing the list of hashes
+    use_algorithms(ocb,fn,buf + 10);
+    return file_hashdeep_10;
+}
+
+
+/*
+ * Enable the algorithms of a known file, and warn if they aren't
+ * the ones of the file loaded before it.
+ */
+void hashlist::use_algorithms(class display *ocb,const std::string &fn,const std::string &val)
+{
     /**
      * Remember previously loaded hashes.
      */
     std::string previously_enabled_algorithms = last_enabled_algorithms;
 
-    // Skip the "%%%% size," when parsing the list of hashes
-    enable_hashing_algorithms_from_hashdeep_file(ocb,fn,buf + 10);
-
+    enable_hashing_algorithms_from_hashdeep_file(ocb,fn,val);
 
     // If the set of hashes now in use doesn't match those previously in use,
     // give a warning.
@@ -224,7 +438,6 @@ hashlist::hashfile_format hashlist::identify_format(class display *ocb,
 	if(ocb) ocb->error("%s: Hashes not in same format as previously loaded",
 				 fn.c_str());
     }
-    return file_hashdeep_10;
 }
 
 
@@ -261,7 +474,8 @@ void hashlist::enable_hashing_algorithms_from_hashdeep_file(class display *ocb,c
 
 	/* Found a known algorithm */
 	hashes[id].inuse = TRUE;
-	hash_column[num_columns] = id;
+	if (num_columns < MAX_KNOWN_COLUMNS)	// the rest are ignored
+	  hash_column[num_columns] = id;
 	num_columns++;
     }
 }
@@ -270,37 +484,60 @@ void hashlist::enable_hashing_algorithms_from_hashdeep_file(class display *ocb,c
 void hashlist::dump_hashlist()
 {
     std::cout << "md5,sha1,bytes,filename   matched\n";
-    for (hashlist::const_iterator it = begin(); it!=end(); it++)
+    for (size_t i = 0; i<size(); i++)
     {
-      std::cout << (*it)->hash_hex[alg_md5] << "," << (*it)->hash_hex[alg_sha1] << ","
-		<< (*it)->file_bytes << "," << (*it)->file_name
-		<< "\tmatched=" << (*it)->matched_file_number << "\n";
+      const file_data_t *fi = record(i);
+      std::cout << fi->digests.hex(alg_md5) << "," << fi->digests.hex(alg_sha1) << ","
+		<< fi->file_bytes << "," << fi->file_name
+		<< "\tmatched=" << is_matched(i) << "\n";
     }
 }
 
 uint64_t hashlist::total_matched()
 {
     uint64_t total = 0;
-    for (hashlist::const_iterator it = begin(); it!=end(); it++)
+    for (std::vector<uint64_t>::const_iterator it = matched_bits.begin(); it!=matched_bits.end(); it++)
     {
-      if ( (*it)->matched_file_number > 0)
-	  total++;
+      total += __builtin_popcountll(__atomic_load_n(&*it,__ATOMIC_RELAXED));
     }
 
     return total;
 }
 
 
+/****************************************************************
+ *** Loading known files
+ ****************************************************************/
+
+/**
+ * The lines of a hashdeep file. It keeps the columns from its own header,
+ * because the next file in the queue may list different ones.
+ */
+class hashdeep_file : public hashlist::known_file {
+public:
+    hashdeep_file(const std::string &fn_,FILE *handle_,
+		  const hashid_t *hash_column_,uint8_t filename_column_):
+	known_file(fn_,handle_,2),filename_column(filename_column_){
+	memcpy(hash_column,hash_column_,sizeof(hash_column));
+    }
+    hashid_t	hash_column[hashlist::MAX_KNOWN_COLUMNS];
+    uint8_t	filename_column;
+    virtual void parse(hashlist::known_chunk &c) const;
+    virtual void bad_line(display *ocb,uint64_t line_number,int why) const {
+	if (ocb)
+	  ocb->error("%s: Invalid %s hash in line %"PRIu64,
+		     fn.c_str(), hashes[why].name.c_str(), line_number);
+    }
+};
+
+
+//
+// Reads the header of a file of known hashes, which says which
+// hashes it has, and queues the rest for load_queued_files().
 //
-// Loads a file of known hashes.
-// First identifies the file type, then reads the file.
- //
 hashlist::loadstatus_t
-hashlist::load_hash_file(display *ocb,const std::string &fn)
+hashlist::queue_hash_file(display *ocb,const std::string &fn)
 {
-  loadstatus_t status = loadstatus_ok;
-  hashfile_format type;
-
   FILE *hl_handle = fopen(fn.c_str(),"rb");
   if (NULL == hl_handle)
   {
@@ -309,8 +546,15 @@ hashlist::load_hash_file(display *ocb,const std::string &fn)
     return status_file_error;
   }
 
-  type = identify_format(ocb,fn,hl_handle);
-  if (file_unknown == type)
+  if (known_index::is_index(hl_handle))
+  {
+    loadstatus_t status = queue_index_file(ocb,fn,hl_handle,alg_unknown);
+    if (status == loadstatus_ok)
+      use_algorithms(ocb,fn,queued_files.back()->index->algorithms()+",filename");
+    return status;
+  }
+
+  if (file_unknown == identify_format(ocb,fn,hl_handle))
   {
     if (ocb)
       ocb->error("%s: Unable to identify file format", fn.c_str());
@@ -319,103 +563,971 @@ hashlist::load_hash_file(display *ocb,const std::string &fn)
     return status_unknown_filetype;
   }
 
-  bool contains_bad_lines = false;
-  bool record_valid;
+  queue_known_file(new hashdeep_file(fn,hl_handle,hash_column,filename_column));
+  return loadstatus_ok;
+}
 
-  // We start our counter at line number two for the two lines
-  // of header we've already read
-  uint64_t line_number = 2;
 
-  // TODO: Read the line directly into a std::string
-  char line[MAX_STRING_LENGTH];
-  while (fgets(line,MAX_STRING_LENGTH,hl_handle))
-  {
-    line_number++;
+hashlist::known_file::~known_file()
+{
+#ifdef HAVE_MMAP
+  if (map)
+    munmap(map,map_size);
+#endif
+  if (handle)
+    fclose(handle);
+}
 
-    // Lines starting with a pound sign are comments and can be ignored
-    if ('#' == line[0])
-      continue;
 
+/**
+ * Known files are allocated in blocks; the hashlist never frees them.
+ * Returns 0 if we are out of memory.
+ */
+file_data_t *hashlist::known_chunk::new_record()
+{
+  if (record_pool_left == 0)
+  {
     // C++ typically fails with a bad_alloc, but you can make it return null
-    // http://www.cplusplus.com/reference/std/new/bad_alloc/
     // http://www.cplusplus.com/reference/std/new/nothrow/
-    file_data_t *t = new (std::nothrow) file_data_t();
-    if (NULL == t)
+    record_pool = new (std::nothrow) file_data_t[RECORD_POOL_SIZE];
+    if (NULL == record_pool)
+      return 0;
+    record_pool_left = RECORD_POOL_SIZE;
+  }
+  record_pool_left--;
+  return record_pool++;
+}
+
+
+/**
+ * Parse the lines of a hashdeep file in the chunk, in place.
+ * The hex hashes are decoded straight into the digests; a line can be
+ * any length.
+ */
+void hashdeep_file::parse(hashlist::known_chunk &c) const
+{
+  file_data_t rec;			// the line being parsed
+  const char *p = c.begin;
+  const char *end = c.end;
+  while (p < end)
+  {
+    const char *newline = (const char *)memchr(p,'\n',end-p);
+    const char *eol  = newline ? newline : end;
+    const char *next = newline ? newline+1 : end;
+    c.lines++;
+
+    // Lines starting with a pound sign are comments and can be ignored
+    if ('#' == *p)
     {
-      ocb->fatal_error("%s: Out of memory in line %"PRIu64,
-		       fn.c_str(), line_number);
+      p = next;
+      continue;
     }
 
-    chop_line(line);
-    record_valid = true;
+    // Remove the carriage returns of DOS newlines
+    while (eol > p && ('\r'==eol[-1] || '\n'==eol[-1]))
+      eol--;
 
-    // Convert the input line to a string for easier manipulations
-    std::string line_as_string(line);
-    std::vector<std::string> fields = split(line_as_string,',');
-
-    size_t column_number;
-    // The offset of the current word within this line. Used for filenames.
-    size_t offset_in_line = 0;
-    for (column_number=0 ; column_number<fields.size() ; column_number++)
+    // Blank lines have no hashes
+    if (eol == p)
     {
-      std::string word = fields[column_number];
+      p = next;
+      continue;
+    }
+
+    rec.digests.clear();
+    rec.file_name.clear();
+    rec.file_bytes = 0;
+    bool record_valid = true;
 
+    const char *field = p;
+    for (size_t column_number = 0 ; field < eol && column_number < hashlist::MAX_KNOWN_COLUMNS ; column_number++)
+    {
       if (column_number == filename_column)
       {
-	// If the filename contained commas, it was split
-	// incorrectly by the 'split' statememt above. The filename
-	// will be split across more than one column.
-	// To be safe, we grab everything from where this field starts
+	// If the filename contains commas, it runs across several columns.
+	// To be safe, we take everything from where this field starts
 	// to the end of the line, and call that the 'filename'.
 	// (This also avoids a problem
 	// when the filename is the same as one of the hashes, which
 	// happens now and again.)
-	t->file_name = line_as_string.substr(offset_in_line, std::string::npos);
+	rec.file_name.assign(field,eol-field);
 
 	// This should be the last column, so we break out now.
 	break;
       }
 
-      // The extra +1 is for the comma
-      offset_in_line += word.size() + 1;
+      const char *comma = (const char *)memchr(field,',',eol-field);
+      const char *field_end = comma ? comma : eol;
 
       // The first column should always be the file size
       if (0 == column_number)
       {
-	t->file_bytes = (uint64_t)strtoll(word.c_str(),NULL,10);
-	continue;
+	char num[32];
+	size_t len = std::min((size_t)(field_end-field),sizeof(num)-1);
+	memcpy(num,field,len);
+	num[len] = 0;
+	rec.file_bytes = (uint64_t)strtoll(num,NULL,10);
       }
-
       // All other columns should contain a valid hash in hex
-      if ( !algorithm_t::valid_hash(hash_column[column_number],word))
+      else if (!rec.digests.set_hex(hash_column[column_number],field,field_end-field))
       {
-	if (ocb)
-	  ocb->error("%s: Invalid %s hash in line %"PRIu64,
-		     fn.c_str(),
-		     hashes[hash_column[column_number]].name.c_str(),
-		     line_number);
-	contains_bad_lines = true;
+	c.add_bad_line(hash_column[column_number]);
 	record_valid = false;
-	// Break out (done = true) and then process the next line
+	// Break out and then process the next line
 	break;
       }
 
-      // Convert the hash to a std::string and save it
-      lowercase(word);
-      t->hash_hex[hash_column[column_number]] = word;
+      if (NULL == comma)
+	break;
+      field = comma+1;
     }
 
     if (record_valid)
-      add_fdt(t);
+    {
+      file_data_t *t = c.new_record();
+      if (NULL == t)
+      {
+	c.out_of_memory = true;
+	return;
+      }
+      t->digests    = rec.digests;
+      t->file_bytes = rec.file_bytes;
+      t->file_name.swap(rec.file_name);
+      c.records.push_back(t);
+    }
+    p = next;
+  }
+}
+
+
+/*
+ * The loader threads take jobs numbered 0 through jobs-1 until there are none left.
+ * The calling thread is one of them.
+ */
+struct loader_jobs_t {
+    void	(*job)(void *arg,size_t n);
+    void	*arg;
+    size_t	jobs;
+    size_t	next;				// the next job to take; taken atomically
+};
+
+static void *run_loader(void *arg)
+{
+    loader_jobs_t *lj = (loader_jobs_t *)arg;
+    size_t n;
+    while ((n = __sync_fetch_and_add(&lj->next,1)) < lj->jobs)
+      lj->job(lj->arg,n);
+    return 0;
+}
+
+static void run_loader_jobs(int threads,size_t jobs,void (*job)(void *,size_t),void *arg)
+{
+    loader_jobs_t lj;
+    lj.job  = job;
+    lj.arg  = arg;
+    lj.jobs = jobs;
+    lj.next = 0;
+#ifdef HAVE_PTHREAD
+    // If a thread can't be started, the others just take more of the jobs
+    std::vector<pthread_t> loaders;
+    for (int i=1; i<threads && (size_t)i<jobs; i++)
+    {
+      pthread_t t;
+      if (pthread_create(&t,NULL,run_loader,&lj)==0)
+	loaders.push_back(t);
+    }
+#endif
+    run_loader(&lj);
+#ifdef HAVE_PTHREAD
+    for (std::vector<pthread_t>::const_iterator it = loaders.begin(); it!=loaders.end(); it++)
+      pthread_join(*it,NULL);
+#endif
+}
+
+static void parse_chunk(void *arg,size_t n)
+{
+    hashlist::known_chunk *c = (*(std::vector<hashlist::known_chunk *> *)arg)[n];
+    c->file->parse(*c);
+}
+
+struct index_job_t {
+    hashlist	*known;
+    uint32_t	first;				// the first record to index
+};
+
+/* Each algorithm has its own hashmap, so each is indexed by its own job */
+static void index_algorithm(void *arg,size_t alg)
+{
+    index_job_t *ij = (index_job_t *)arg;
+    uint32_t count = (uint32_t)ij->known->size();
+    for (uint32_t record = ij->first; record < count; record++)
+    {
+      if ((*ij->known)[record])		// the records of an index are in the index
+	ij->known->hashmaps[alg].add_file(*ij->known,record,(int)alg);
+    }
+}
+
+
+/* Chunks are big enough that a thread spends its time parsing, not
+ * fetching them, and small enough that the threads finish together.
+ */
+static const size_t LOAD_CHUNK_SIZE = 4*1024*1024;
+
+/**
+ * Get the lines after the header of a queued file into memory:
+ * we map the file if we can, and read it if we can't (a pipe, perhaps).
+ */
+static void read_known_file(hashlist::known_file *f,const char **begin,const char **end)
+{
+  off_t body = ftello(f->handle);
+
+#ifdef HAVE_MMAP
+  struct stat sb;
+  if (body >= 0 && fstat(fileno(f->handle),&sb)==0 && S_ISREG(sb.st_mode))
+  {
+    if (sb.st_size <= body)
+    {
+      *begin = *end = 0;		// nothing but the header
+      return;
+    }
+    void *base = mmap(0,sb.st_size,PROT_READ,
+#if HAVE_DECL_MAP_FILE
+		      MAP_FILE|
+#endif
+		      MAP_SHARED,fileno(f->handle),0);
+    if (base != (void *)-1)
+    {
+#ifdef MADV_WILLNEED
+      madvise(base,sb.st_size,MADV_WILLNEED); // the chunks are all read at once
+#endif
+      f->map = base;
+      f->map_size = sb.st_size;
+      *begin = (const char *)base + body;
+      *end   = (const char *)base + sb.st_size;
+      return;
+    }
   }
+#endif
+
+  char block[65536];
+  size_t len;
+  while ((len = fread(block,1,sizeof(block),f->handle)) > 0)
+    f->text.append(block,len);
+  *begin = f->text.data();
+  *end   = f->text.data() + f->text.size();
+}
 
-  fclose(hl_handle);
-  hl_handle = 0;
 
-  if (contains_bad_lines)
-    return status_contains_bad_hashes;
+/**
+ * Load the lines of every queued file. The files are split into chunks
+ * that end at line boundaries, and up to 'threads' threads parse the
+ * chunks, of all the files at once. Then the records are added in the
+ * order of the files and their lines, and the bad lines are reported in
+ * that order too, so the hashlist is the same as if the files had been
+ * read a line at a time. Lastly the hashmaps are brought up to date,
+ * each by its own thread.
+ */
+void hashlist::load_queued_files(display *ocb,int threads,load_results_t &results)
+{
+  if (queued_files.empty())
+    return;
+
+  std::vector<known_chunk *> chunks;
+  for (std::vector<known_file *>::const_iterator it = queued_files.begin(); it!=queued_files.end(); it++)
+  {
+    if ((*it)->index)
+      continue;				// nothing to parse
+    const char *p, *end;
+    read_known_file(*it,&p,&end);
+    while (p < end)
+    {
+      const char *chunk_end = end;
+      if ((size_t)(end-p) > LOAD_CHUNK_SIZE)
+      {
+	const char *newline = (const char *)memchr(p+LOAD_CHUNK_SIZE,'\n',end-p-LOAD_CHUNK_SIZE);
+	if (newline)
+	  chunk_end = newline+1;
+      }
+      chunks.push_back(new known_chunk(*it,p,chunk_end));
+      p = chunk_end;
+    }
+  }
+
+  run_loader_jobs(threads,chunks.size(),parse_chunk,&chunks);
+
+  uint32_t first = (uint32_t)size();
+  std::vector<known_chunk *>::const_iterator c = chunks.begin();
+  for (std::vector<known_file *>::const_iterator it = queued_files.begin(); it!=queued_files.end(); it++)
+  {
+    known_file *f = *it;
+    uint64_t line_number = f->header_lines;
+    load_result_t result(f->fn);
+    if (f->index)
+    {
+      add_index(ocb,f->fn,f->index);
+      f->index = 0;
+    }
+    for (; c!=chunks.end() && (*c)->file==f; c++)
+    {
+      for (std::vector<known_chunk::bad_line_t>::const_iterator b = (*c)->bad_lines.begin();
+	   b!=(*c)->bad_lines.end(); b++)
+      {
+	f->bad_line(ocb,line_number + b->line,b->why);
+	result.status = status_contains_bad_hashes;
+      }
+      if ((*c)->out_of_memory)
+      {
+	ocb->fatal_error("%s: Out of memory in line %"PRIu64,
+			 f->fn.c_str(), line_number + (*c)->lines);
+      }
+      insert(end(),(*c)->records.begin(),(*c)->records.end());
+      line_number += (*c)->lines;
+      delete *c;
+    }
+    result.known_after = size();
+    results.push_back(result);
+    delete f;
+  }
+  queued_files.clear();
+
+  matched_bits.resize((size()+63)/64,0);
+  index_job_t ij;
+  ij.known = this;
+  ij.first = first;
+  run_loader_jobs(threads,NUM_ALGORITHMS,index_algorithm,&ij);
+}
+
+
+struct filter_job_t {
+    hashlist				*known;
+    hashlist::known_filter		**filters;
+};
+
+/* Each algorithm's filter is filled by its own job */
+static void fill_filter(void *arg,size_t alg)
+{
+    filter_job_t *fj = (filter_job_t *)arg;
+    hashlist::known_filter *filter = fj->filters[alg];
+    if (filter == 0)
+      return;
+    for (size_t i = 0; i < fj->known->size(); i++)
+    {
+      const file_data_t *fi = (*fj->known)[i];
+      if (fi && fi->digests.has(alg))
+	filter->add(fi->digests.get(alg));
+    }
+}
+
+/**
+ * Once everything is loaded the list is only searched. Algorithms with
+ * enough known hashes in the hashmaps get a filter, filled by up to
+ * 'threads' threads, unless use_filters is false (-N). Indexes are left
+ * out: they are searched in place, and reading every digest of one
+ * here would undo loading it at once.
+ */
+void hashlist::freeze(int threads,bool counting,bool use_filters)
+{
+    frozen = true;
+    if (!use_filters)
+      return;
+    for (int alg = 0; alg < NUM_ALGORITHMS; alg++)
+    {
+      if (hashmaps[alg].files() >= known_filter::MIN_KEYS)
+	filters[alg] = new known_filter(hashmaps[alg].files(),counting);
+    }
+    filter_job_t fj;
+    fj.known   = this;
+    fj.filters = filters;
+    run_loader_jobs(threads,NUM_ALGORITHMS,fill_filter,&fj);
+}
+
+
+/****************************************************************
+ *** Compiled indexes of known hashes
+ ****************************************************************/
+
+/*
+ * An index is written in the byte order of the machine that wrote it.
+ * Everything after the header is at an offset that is a multiple of 8:
+ * the records' file sizes and name numbers, the table of distinct names,
+ * and for each algorithm its digests in record order, a bitmap of the
+ * records that have one, and those records sorted by digest.
+ */
+static const char	INDEX_MAGIC[8] = {'H','D','E','E','P','I','D','X'};
+static const uint32_t	INDEX_BYTE_ORDER = 0x01020304;
+static const uint32_t	INDEX_VERSION = 1;
+
+struct index_header_t {
+    char	magic[8];
+    uint32_t	byte_order;			// INDEX_BYTE_ORDER as the writer had it
+    uint32_t	version;
+    uint64_t	count;				// records
+    uint64_t	sizes;				// count uint64_t file sizes
+    uint64_t	names;				// count uint32_t name numbers
+    uint64_t	name_count;
+    uint64_t	name_offsets;			// name_count+1 uint64_t offsets into the text
+    uint64_t	name_text;
+    uint64_t	name_text_size;
+    uint64_t	algorithm_count;		// followed by that many index_algorithm_t
+};
+
+struct index_algorithm_t {
+    char	name[16];			// as -c takes it
+    uint64_t	digest_size;
+    uint64_t	digests;
+    uint64_t	present;
+    uint64_t	order;
+    uint64_t	order_count;
+};
+
+/*
+ * Queued in place of a text file, so that its records are numbered
+ * in the order the files were given.
+ */
+class index_file : public hashlist::known_file {
+public:
+    index_file(const std::string &fn_,hashlist::known_index *ix):known_file(fn_,0,0){ index = ix; }
+    virtual void parse(hashlist::known_chunk &) const {}
+    virtual void bad_line(display *,uint64_t,int) const {}
+};
+
+
+bool hashlist::known_index::is_index(FILE *handle)
+{
+    char magic[sizeof(INDEX_MAGIC)];
+    bool ret = fread(magic,1,sizeof(magic),handle)==sizeof(magic)
+      && memcmp(magic,INDEX_MAGIC,sizeof(magic))==0;
+    rewind(handle);
+    return ret;
+}
+
+
+/* Is [offset,offset+len) in a file of size bytes, and aligned? */
+static bool index_range_ok(uint64_t offset,uint64_t count,uint64_t size,uint64_t bytes)
+{
+    return offset%8==0 && offset <= bytes && count <= (bytes-offset)/size;
+}
+
+/**
+ * Map an index. The header and where each of its arrays lies are checked
+ * here, so a damaged index is rejected instead of read out of bounds.
+ * Checking the entries of the arrays would read the whole index, so they
+ * are checked as they are used (see ordered() and index_name()).
+ */
+bool hashlist::known_index::open(class display *ocb,const std::string &fn,FILE *handle)
+{
+#ifdef HAVE_MMAP
+    struct stat sb;
+    if (fstat(fileno(handle),&sb) || !S_ISREG(sb.st_mode))
+    {
+      if (ocb) ocb->error("%s: An index of known hashes must be a regular file", fn.c_str());
+      return false;
+    }
+    uint64_t bytes = sb.st_size;
+    if (bytes < sizeof(index_header_t))
+    {
+      if (ocb) ocb->error("%s: Damaged index of known hashes", fn.c_str());
+      return false;
+    }
+    map = mmap(0,bytes,PROT_READ,
+#if HAVE_DECL_MAP_FILE
+	       MAP_FILE|
+#endif
+	       MAP_SHARED,fileno(handle),0);
+    if (map == (void *)-1)
+    {
+      map = 0;
+      if (ocb) ocb->error("%s: %s", fn.c_str(), strerror(errno));
+      return false;
+    }
+    map_size = bytes;
+#ifdef MADV_RANDOM
+    madvise(map,map_size,MADV_RANDOM);	// lookups touch a page here and there
+#endif
+
+    const uint8_t *base = (const uint8_t *)map;
+    const index_header_t *h = (const index_header_t *)base;
+    if (h->byte_order != INDEX_BYTE_ORDER)
+    {
+      if (ocb) ocb->error("%s: Index was made on a computer with a different byte order", fn.c_str());
+      return false;
+    }
+    if (h->version != INDEX_VERSION)
+    {
+      if (ocb) ocb->error("%s: Index version %"PRIu32" is not supported", fn.c_str(), h->version);
+      return false;
+    }
+
+    bool ok = h->count < UINT32_MAX
+      && index_range_ok(h->sizes,h->count,sizeof(uint64_t),bytes)
+      && index_range_ok(h->names,h->count,sizeof(uint32_t),bytes)
+      && h->name_count < UINT64_MAX
+      && index_range_ok(h->name_offsets,h->name_count+1,sizeof(uint64_t),bytes)
+      && index_range_ok(h->name_text,h->name_text_size,1,bytes)
+      && index_range_ok(sizeof(index_header_t),h->algorithm_count,sizeof(index_algorithm_t),bytes);
+    if (ok)
+    {
+      count          = h->count;
+      sizes          = (const uint64_t *)(base + h->sizes);
+      names          = (const uint32_t *)(base + h->names);
+      name_count     = h->name_count;
+      name_offsets   = (const uint64_t *)(base + h->name_offsets);
+      name_text      = (const char *)(base + h->name_text);
+      name_text_size = h->name_text_size;
+
+      const index_algorithm_t *ia = (const index_algorithm_t *)(base + sizeof(index_header_t));
+      for (uint64_t i = 0; ok && i < h->algorithm_count; i++, ia++)
+      {
+	std::string name(ia->name,sizeof(ia->name));
+	name.erase(std::min(name.find('\0'),name.size()));
+	hashid_t alg = algorithm_t::get_hashid_for_name(name);
+	if (alg == alg_unknown)
+	  continue;			// from a newer program; we can't use it
+	ok = ia->digest_size == hash_digests::size(alg)
+	  && index_range_ok(ia->digests,count,ia->digest_size,bytes)
+	  && index_range_ok(ia->present,(count+63)/64,sizeof(uint64_t),bytes)
+	  && ia->order_count <= count
+	  && index_range_ok(ia->order,ia->order_count,sizeof(uint32_t),bytes);
+	if (!ok)
+	  break;
+	column_t &c = columns[alg];
+	c.digests     = base + ia->digests;
+	c.present     = (const uint64_t *)(base + ia->present);
+	c.order       = (const uint32_t *)(base + ia->order);
+	c.order_count = ia->order_count;
+      }
+    }
+    if (!ok)
+    {
+      if (ocb) ocb->error("%s: Damaged index of known hashes", fn.c_str());
+      return false;
+    }
+    return true;
+#else
+    if (ocb) ocb->error("%s: Indexes of known hashes need memory-mapped files, which we don't have", fn.c_str());
+    return false;
+#endif
+}
+
+
+hashlist::known_index::~known_index()
+{
+#ifdef HAVE_MMAP
+    if (map)
+      munmap(map,map_size);
+#endif
+}
+
+
+std::string hashlist::known_index::algorithms() const
+{
+    std::string ret;
+    for (int alg = 0; alg < NUM_ALGORITHMS; alg++)
+    {
+      if (!has(alg))
+	continue;
+      if (ret.size())
+	ret += ",";
+      ret += hashes[alg].name;
+    }
+    return ret;
+}
+
+
+void hashlist::known_index::find(int alg,const uint8_t *digest,
+				 uint64_t *begin,uint64_t *end) const
+{
+    const column_t &c = columns[alg];
+    size_t size = hash_digests::size(alg);
+    uint64_t lo = 0, hi = c.order_count;
+    while (lo < hi)			// the first that isn't less than digest
+    {
+      uint64_t mid = lo + (hi-lo)/2;
+      if (memcmp(this->digest(alg,ordered(alg,mid)),digest,size) < 0)
+	lo = mid+1;
+      else
+	hi = mid;
+    }
+    hi = lo;
+    while (hi < c.order_count && memcmp(this->digest(alg,ordered(alg,hi)),digest,size)==0)
+      hi++;
+    *begin = lo;
+    *end   = hi;
+}
+
+
+/* A damaged name is the empty name */
+static void index_name(const hashlist::known_index *ix,uint64_t record,const char **name,size_t *len)
+{
+    *name = "";
+    *len  = 0;
+    uint32_t n = ix->names ? ix->names[record] : 0;
+    if (n >= ix->name_count)
+      return;
+    uint64_t start = ix->name_offsets[n], stop = ix->name_offsets[n+1];
+    if (start > stop || stop > ix->name_text_size)
+      return;
+    *name = ix->name_text + start;
+    *len  = stop - start;
+}
+
+bool hashlist::known_index::name_is(uint64_t record,const std::string &name) const
+{
+    const char *p;
+    size_t len;
+    index_name(this,record,&p,&len);
+    return len==name.size() && memcmp(p,name.data(),len)==0;
+}
+
+file_data_t *hashlist::known_index::make_record(uint64_t record) const
+{
+    file_data_t *fi = new file_data_t();
+    for (int alg = 0; alg < NUM_ALGORITHMS; alg++)
+    {
+      if (has(alg) && (columns[alg].present[record/64] >> (record%64)) & 1)
+	fi->digests.set(alg,digest(alg,record));
+    }
+    fi->file_bytes = sizes ? sizes[record] : 0;
+    const char *p;
+    size_t len;
+    index_name(this,record,&p,&len);
+    fi->file_name.assign(p,len);
+    return fi;
+}
+
+
+/**
+ * Open an index and queue it; it is added to the hashlist in its turn.
+ * The caller decides which of its algorithms to use.
+ */
+hashlist::loadstatus_t
+hashlist::queue_index_file(display *ocb,const std::string &fn,FILE *handle,int need_alg)
+{
+    known_index *ix = new known_index();
+    bool ok = ix->open(ocb,fn,handle);
+    fclose(handle);			// the mapping stays
+    if (!ok)
+    {
+      delete ix;
+      return status_file_error;
+    }
+    if (need_alg != alg_unknown && !ix->has(need_alg))
+    {
+      if (ocb)
+	ocb->error("%s: Index has no %s hashes, skipped.", fn.c_str(), hashes[need_alg].name.c_str());
+      delete ix;
+      return status_unknown_filetype;
+    }
+    queue_known_file(new index_file(fn,ix));
+    return loadstatus_ok;
+}
+
+
+/*
+ * The records of an index are numbered after those we have so far.
+ * They get their places in the list, which stay empty until asked for.
+ */
+void hashlist::add_index(display *ocb,const std::string &fn,known_index *ix)
+{
+    assert(!frozen);
+    if (ix->count > UINT32_MAX - size())
+      ocb->fatal_error("%s: Too many known hashes", fn.c_str());
+    ix->first = (uint32_t)size();
+    indexes.push_back(ix);
+    resize(size()+ix->count,0);
+    matched_bits.resize((size()+63)/64,0);
+}
+
+
+file_data_t *hashlist::record(size_t i)
+{
+    file_data_t **slot = &(*this)[i];
+    file_data_t *fi = __atomic_load_n(slot,__ATOMIC_ACQUIRE);
+    if (fi)
+      return fi;
+
+    // It's in an index. Several threads may ask at once; the first one wins.
+    std::vector<known_index *>::const_iterator it = indexes.begin();
+    while (i >= (*it)->first + (*it)->count)
+      it++;
+    fi = (*it)->make_record(i - (*it)->first);
+    if (!__sync_bool_compare_and_swap(slot,(file_data_t *)0,fi))
+    {
+      delete fi;
+      fi = __atomic_load_n(slot,__ATOMIC_ACQUIRE);
+    }
+    return fi;
+}
+
+
+/* Sorts record numbers by one algorithm's digests, which are in record order,
+ * and then by record number, so that any sort keeps equal digests in order.
+ */
+class digest_order {
+    const uint8_t	*digests;
+    size_t		size;
+public:
+    digest_order(const uint8_t *digests_,size_t size_):digests(digests_),size(size_){}
+    bool operator()(uint32_t a,uint32_t b) const {
+	int cmp = memcmp(digests+(size_t)a*size,digests+(size_t)b*size,size);
+	return cmp < 0 || (cmp == 0 && a < b);
+    }
+};
+
+static inline size_t digest_bucket(const uint8_t *digest)
+{
+    return ((size_t)digest[0] << 8) | digest[1];
+}
+
+/**
+ * Index digests that were read from a binary set, such as EnCase's.
+ * They stay packed in record order, as in a mapped index, and sorting
+ * their record numbers is all it takes to search them; no record is
+ * made for a digest until it is matched.
+ */
+void hashlist::known_index::build(int alg,std::vector<uint8_t> &digests_,const std::string &name)
+{
+    size_t size = hash_digests::size(alg);
+    built_digests.swap(digests_);
+    count = built_digests.size() / size;
+    built_present.assign((count+63)/64,~(uint64_t)0);
+    const uint8_t *digests = built_digests.size() ? &built_digests[0] : 0;
+
+    // Digests are close to random, so we deal the records out by their
+    // first two bytes, in record order, and only have small buckets to sort.
+    std::vector<uint32_t> bucket_start(65536+1,0);
+    for (uint64_t i = 0; i < count; i++)
+      bucket_start[digest_bucket(digests + i*size) + 1]++;
+    for (size_t b = 0; b < 65536; b++)
+      bucket_start[b+1] += bucket_start[b];
+    std::vector<uint32_t> bucket_next(bucket_start.begin(),bucket_start.end()-1);
+    built_order.resize(count);
+    for (uint64_t i = 0; i < count; i++)
+      built_order[bucket_next[digest_bucket(digests + i*size)]++] = (uint32_t)i;
+    for (size_t b = 0; b < 65536; b++)
+    {
+      if (bucket_start[b+1] - bucket_start[b] > 1)
+	std::sort(built_order.begin() + bucket_start[b],built_order.begin() + bucket_start[b+1],
+		  digest_order(digests,size));
+    }
+
+    column_t &c = columns[alg];
+    c.digests     = digests;
+    c.present     = built_present.size() ? &built_present[0] : 0;
+    c.order       = built_order.size() ? &built_order[0] : 0;
+    c.order_count = count;
+
+    built_name = name;
+    built_name_offsets[0] = 0;
+    built_name_offsets[1] = built_name.size();
+    name_count     = 1;
+    name_offsets   = built_name_offsets;
+    name_text      = built_name.data();
+    name_text_size = built_name.size();
+}
+
+
+/*
+ * Queue digests of one algorithm as an index of their own, so that
+ * they are numbered in the order the files were given.
+ */
+void hashlist::queue_digests(const std::string &fn,int alg,std::vector<uint8_t> &digests)
+{
+    known_index *ix = new known_index();
+    ix->build(alg,digests,fn);
+    queue_known_file(new index_file(fn,ix));
+}
+
+
+/* Write a section at the next multiple of 8 and note where it is */
+static void write_index_section(display *ocb,const std::string &fn,FILE *f,
+				uint64_t &offset,uint64_t &where,const void *buf,size_t len)
+{
+    static const char zeros[8] = {0,0,0,0,0,0,0,0};
+    size_t pad = (8 - offset%8) % 8;
+    if (fwrite(zeros,1,pad,f)!=pad || fwrite(buf,1,len,f)!=len)
+      ocb->fatal_error("%s: %s", fn.c_str(), strerror(errno));
+    where   = offset + pad;
+    offset += pad + len;
+}
+
+/*
+ * Reads the records of a hashlist in order for write_index. A record
+ * loaded from a text file is a file_data_t; one in an index is read
+ * where it is, so that compiling a large index doesn't make a file_data_t
+ * of each of its records.
+ */
+class index_record_reader {
+    const hashlist			&list;
+    const std::vector<hashlist::known_index *> &indexes;
+    std::vector<hashlist::known_index *>::const_iterator next_ix;
+public:
+    index_record_reader(const hashlist &list_,const std::vector<hashlist::known_index *> &indexes_):
+	list(list_),indexes(indexes_),next_ix(indexes_.begin()),fi(0),ix(0),r(0){}
+    const file_data_t		*fi;	// the record, if it is a file_data_t
+    const hashlist::known_index	*ix;	// otherwise, its index
+    uint64_t			r;	// and its number there
+
+    void seek(uint64_t i) {		// i must not be less than last time
+	fi = __atomic_load_n(&list[i],__ATOMIC_ACQUIRE);
+	ix = 0;
+	r  = 0;
+	if (fi)
+	  return;
+	while (i >= (*next_ix)->first + (*next_ix)->count)
+	  next_ix++;
+	ix = *next_ix;
+	r  = i - ix->first;
+    }
+    bool has(int alg) const {
+	if (fi)
+	  return fi->digests.has(alg);
+	return ix->has(alg) && ((ix->columns[alg].present[r/64] >> (r%64)) & 1);
+    }
+    const uint8_t *get(int alg) const { return fi ? fi->digests.get(alg) : ix->digest(alg,r); }
+    uint64_t size() const { return fi ? fi->file_bytes : (ix->sizes ? ix->sizes[r] : 0); }
+};
+
+/*
+ * Numbers the distinct names for write_index. The names of an index are
+ * already numbered, so each of them is looked up only once.
+ */
+class index_name_table {
+    static const uint32_t NO_NAME = 0xffffffff;
+    std::map<std::string,uint32_t> numbers;
+    std::map<const hashlist::known_index *,std::vector<uint32_t> > index_numbers;
+    uint32_t add(const std::string &name) {
+	std::map<std::string,uint32_t>::const_iterator it = numbers.find(name);
+	if (it == numbers.end())
+	{
+	  it = numbers.insert(std::make_pair(name,(uint32_t)offsets.size())).first;
+	  offsets.push_back(text.size());
+	  text += name;
+	}
+	return it->second;
+    }
+public:
+    index_name_table(const std::vector<hashlist::known_index *> &indexes):
+	numbers(),index_numbers(),offsets(),text(){
+	for (std::vector<hashlist::known_index *>::const_iterator it = indexes.begin(); it!=indexes.end(); it++)
+	  index_numbers[*it].assign((*it)->name_count,NO_NAME);
+    }
+    std::vector<uint64_t> offsets;	// where each name starts in text
+    std::string		text;
+    uint32_t number(const index_record_reader &rec) {
+	if (rec.fi)
+	  return add(rec.fi->file_name);
+	uint32_t n = rec.ix->names ? rec.ix->names[rec.r] : 0;
+	std::vector<uint32_t> &known = index_numbers[rec.ix];
+	if (n < known.size() && known[n] != NO_NAME)
+	  return known[n];
+	const char *p;
+	size_t len;
+	index_name(rec.ix,rec.r,&p,&len);
+	uint32_t number = add(std::string(p,len));
+	if (n < known.size())
+	  known[n] = number;
+	return number;
+    }
+};
+const uint32_t index_name_table::NO_NAME;
+
+/**
+ * Compile the known hashes we have into an index (-G).
+ * File names that appear more than once are stored once.
+ * The records keep their order, so matching against the index gives
+ * the same results as matching against what it was made from.
+ */
+void hashlist::write_index(display *ocb,const std::string &fn)
+{
+    uint64_t count = size();
+    index_header_t h;
+    memset(&h,0,sizeof(h));
+    memcpy(h.magic,INDEX_MAGIC,sizeof(h.magic));
+    h.byte_order = INDEX_BYTE_ORDER;
+    h.version    = INDEX_VERSION;
+    h.count      = count;
+
+    std::vector<uint64_t> sizes(count);
+    std::vector<uint32_t> names(count);
+    index_name_table name_table(indexes);
+    int algs_present = 0;
+    index_record_reader rec(*this,indexes);
+    for (uint64_t i = 0; i < count; i++)
+    {
+      rec.seek(i);
+      sizes[i] = rec.size();
+      names[i] = name_table.number(rec);
+      for (int alg = 0; alg < NUM_ALGORITHMS; alg++)
+      {
+	if (rec.has(alg))
+	  algs_present |= 1<<alg;
+      }
+    }
+    name_table.offsets.push_back(name_table.text.size());
+    h.name_count     = name_table.offsets.size()-1;
+    h.name_text_size = name_table.text.size();
+
+    std::vector<index_algorithm_t> algs;
+    for (int alg = 0; alg < NUM_ALGORITHMS; alg++)
+    {
+      if (algs_present & (1<<alg))
+      {
+	index_algorithm_t ia;
+	memset(&ia,0,sizeof(ia));
+	strncpy(ia.name,hashes[alg].name.c_str(),sizeof(ia.name)-1);
+	ia.digest_size = hash_digests::size(alg);
+	algs.push_back(ia);
+      }
+    }
+    h.algorithm_count = algs.size();
+
+    FILE *f = fopen(fn.c_str(),"wb");
+    if (f == NULL)
+      ocb->fatal_error("%s: %s", fn.c_str(), strerror(errno));
+
+    // The header and the table of algorithms are written again at the end,
+    // once we know where everything is.
+    uint64_t offset = 0, where = 0;
+    write_index_section(ocb,fn,f,offset,where,&h,sizeof(h));
+    if (algs.size())
+      write_index_section(ocb,fn,f,offset,where,&algs[0],algs.size()*sizeof(index_algorithm_t));
+    write_index_section(ocb,fn,f,offset,h.sizes,sizes.size() ? &sizes[0] : 0,sizes.size()*sizeof(uint64_t));
+    write_index_section(ocb,fn,f,offset,h.names,names.size() ? &names[0] : 0,names.size()*sizeof(uint32_t));
+    write_index_section(ocb,fn,f,offset,h.name_offsets,&name_table.offsets[0],
+			name_table.offsets.size()*sizeof(uint64_t));
+    write_index_section(ocb,fn,f,offset,h.name_text,name_table.text.data(),name_table.text.size());
+
+    for (std::vector<index_algorithm_t>::iterator ia = algs.begin(); ia!=algs.end(); ia++)
+    {
+      hashid_t alg = algorithm_t::get_hashid_for_name(ia->name);
+      size_t size = ia->digest_size;
+      std::vector<uint8_t> digests(count*size);
+      std::vector<uint64_t> present((count+63)/64);
+      std::vector<uint32_t> order;
+      index_record_reader digest_rec(*this,indexes);
+      for (uint64_t i = 0; i < count; i++)
+      {
+	digest_rec.seek(i);
+	if (!digest_rec.has(alg))
+	  continue;
+	memcpy(&digests[i*size],digest_rec.get(alg),size);
+	present[i/64] |= (uint64_t)1 << (i%64);
+	order.push_back((uint32_t)i);
+      }
+      // Stable, so the records with a digest stay in the order they were loaded
+      std::stable_sort(order.begin(),order.end(),digest_order(digests.size() ? &digests[0] : 0,size));
+      ia->order_count = order.size();
+      write_index_section(ocb,fn,f,offset,ia->digests,digests.size() ? &digests[0] : 0,digests.size());
+      write_index_section(ocb,fn,f,offset,ia->present,present.size() ? &present[0] : 0,present.size()*sizeof(uint64_t));
+      write_index_section(ocb,fn,f,offset,ia->order,order.size() ? &order[0] : 0,order.size()*sizeof(uint32_t));
+    }
 
-  return status;
+    rewind(f);
+    if (fwrite(&h,sizeof(h),1,f)!=1
+	|| (algs.size() && fwrite(&algs[0],sizeof(index_algorithm_t),algs.size(),f)!=algs.size())
+	|| fclose(f))
+      ocb->fatal_error("%s: %s", fn.c_str(), strerror(errno));
 }
 
 
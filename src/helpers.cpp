@@ -14,6 +14,11 @@
 
 #include "main.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#define HAVE_X86_CPUID
+#endif
+
 // Remove the newlines, if any. Works on both DOS and *nix newlines
 void chop_line(char *s)
 {
@@ -35,6 +40,100 @@ void chop_line(char *s)
 
 
 
+// What the processor we are running on can do, for picking hash kernels.
+// It is found once, before there are threads.
+#ifdef HAVE_X86_CPUID
+static uint64_t xgetbv0()
+{
+  uint32_t lo=0, hi=0;
+  __asm__ __volatile__ ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  return ((uint64_t)hi << 32) | lo;
+}
+#endif
+
+uint32_t cpu_features()
+{
+  static bool found = false;
+  static uint32_t features = 0;
+  if (found)
+    return features;
+  found = true;
+#ifdef HAVE_X86_CPUID
+  unsigned int a, b, c, d;
+  if (!__get_cpuid(1,&a,&b,&c,&d))
+    return features;
+  if (c & (1<<19)) features |= CPU_SSE41;
+
+  // The wide registers are only ours if the operating system saves them
+  bool avx_state = false, avx512_state = false;
+  if (c & (1<<27))			// OSXSAVE
+  {
+    uint64_t xcr0 = xgetbv0();
+    avx_state    = (xcr0 & 0x06) == 0x06;
+    avx512_state = (xcr0 & 0xe6) == 0xe6;
+  }
+  if (__get_cpuid_max(0,0) < 7)
+    return features;
+  __cpuid_count(7,0,a,b,c,d);
+  if ((b & (1<<5)) && avx_state)     features |= CPU_AVX2;
+  if ((b & (1<<16)) && (b & (1<<30)) && avx512_state) features |= CPU_AVX512; // F and BW
+  if (b & (1<<29)) features |= CPU_SHA;
+  if (b & (1<<8))  features |= CPU_BMI2;
+#endif
+  return features;
+}
+
+std::string cpu_feature_names(uint32_t features)
+{
+  static const struct { uint32_t bit; const char *name; } names[] = {
+    {CPU_SSE41,"sse4.1"}, {CPU_AVX2,"avx2"}, {CPU_AVX512,"avx512"},
+    {CPU_SHA,"sha"}, {CPU_BMI2,"bmi2"}, {0,0}
+  };
+  std::string ret;
+  for (int i=0; names[i].name; i++)
+  {
+    if (features & names[i].bit)
+    {
+      if (ret.size()) ret += ",";
+      ret += names[i].name;
+    }
+  }
+  return ret;
+}
+
+
+// Allocate a buffer aligned on a page boundary, so that the kernel can
+// copy into it a page at a time. Release it with free_aligned.
+void *malloc_aligned(size_t size)
+{
+  size_t pagesize = 4096;
+#ifdef _SC_PAGESIZE
+  long ps = sysconf(_SC_PAGESIZE);
+  if (ps>0) pagesize = ps;
+#endif
+#if defined(_WIN32)
+  return _aligned_malloc(size,pagesize);
+#elif defined(HAVE_POSIX_MEMALIGN)
+  void *buf = 0;
+  if (posix_memalign(&buf,pagesize,size)) return 0;
+  return buf;
+#else
+  return malloc(size);
+#endif
+}
+
+
+void free_aligned(void *buf)
+{
+#if defined(_WIN32)
+  _aligned_free(buf);
+#else
+  free(buf);
+#endif
+}
+
+
+
 // Return the size, in bytes of an open file stream. On error, return 0 
 #ifndef _WIN32
 #if defined(__LINUX__) || defined(linux)
@@ -177,6 +177,17 @@ void state::hashdeep_usage()
     ocb.status("-B        - verbose mode; repeat for more verbosity");
     ocb.status("-C        - OS X only --- use Common Crypto hash functions");
     ocb.status("-Fb       - I/O mode buffered; -Fu unbuffered; -Fm memory-mapped");
+    ocb.status("-R <size> - read files in blocks of size (64k to 16m); default from st_blksize");
+    ocb.status("-T blocksize - report read throughput of each block size on FILES");
+    ocb.status("-T kernels - check each hash implementation against the others and time it");
+    ocb.status("-T hex - check the hex encoder and decoder against the portable ones and time them");
+    ocb.status("-P <size> - hash files of at least size with a thread for each algorithm");
+    ocb.status("-J <num>  - use num threads to read directories in recursive mode (default 1; not with -O)");
+    ocb.status("-L        - write each line as soon as it is computed");
+    ocb.status("-O        - write results in the order the files were found");
+    ocb.status("-G <file> - compile the known hashes (-k) into an index file and exit");
+    ocb.status("-N        - don't put a Bloom filter in front of the known hashes");
+    ocb.status("-H <name> - use the named hash implementation; -T kernels lists them");
     ocb.status("-o[bcpflsde] - Expert mode. only process certain types of files:");
     ocb.status("               b=block dev; c=character dev; p=named pipe");
     ocb.status("               f=regular file; l=symlink; s=socket; d=door e=Windows PE");
@@ -240,6 +251,16 @@ void state::md5deep_usage(void)
 	ocb.status("-B        - verbose mode; repeat for more verbosity");
 	ocb.status("-C        - OS X only --- use Common Crypto hash functions");
 	ocb.status("-Fb       - I/O mode buffered; -Fu unbuffered; -Fm memory-mapped");
+	ocb.status("-R <size> - read files in blocks of size (64k to 16m); default from st_blksize");
+	ocb.status("-T blocksize - report read throughput of each block size on FILES");
+	ocb.status("-T kernels - check each hash implementation against the others and time it");
+	ocb.status("-T hex - check the hex encoder and decoder against the portable ones and time them");
+	ocb.status("-J <num>  - use num threads to read directories in recursive mode (default 1; not with -O)");
+	ocb.status("-L        - write each line as soon as it is computed");
+	ocb.status("-O        - write results in the order the files were found");
+	ocb.status("-G <file> - compile the known hashes (-m, -x) into an index file and exit");
+	ocb.status("-N        - don't put a Bloom filter in front of the known hashes");
+	ocb.status("-H <name> - use the named hash implementation; -T kernels lists them");
 	ocb.status("-f <file> - take list of files to hash from filename");
 	ocb.status("-o[bcpflsde] - expert mode. Only process certain types of files:");
 	ocb.status("               b=block dev; c=character dev; p=named pipe");
@@ -303,6 +324,115 @@ void algorithm_t::add_algorithm(
     hashes[pos].bit_length  = bits;
     hashes[pos].inuse       = inuse;
     hashes[pos].id          = pos;
+    assert(bits/8 <= hash_digests::space(pos)); // digests are stored in binary at fixed offsets
+    hashes[pos].kernels.clear();
+    add_kernel(pos,"portable",0,func_init,func_update,func_finalize);
+    hashes[pos].kernel      = "portable";
+    hashes[pos].lane_kernels.clear();
+    hashes[pos].lanes       = 0;
+}
+
+
+/**
+ * Add another implementation of an algorithm, for processors that have
+ * the features it needs. Add them slowest first; add_algorithm adds the
+ * portable one.
+ */
+void algorithm_t::add_kernel(hashid_t pos, const char *name, uint32_t needs,
+			     void ( *func_init)(void *ctx),
+			     void ( *func_update)(void *ctx, const unsigned char *buf, size_t buflen),
+			     void ( *func_finalize)(void *ctx, unsigned char *))
+{
+    kernel_t k;
+    k.name       = name;
+    k.needs      = needs;
+    k.f_init     = func_init;
+    k.f_update   = func_update;
+    k.f_finalize = func_finalize;
+    hashes[pos].kernels.push_back(k);
+}
+
+
+/**
+ * Add a kernel that hashes several messages at once. Add them narrowest
+ * first. If the processor has the features in 'slower', one message at a
+ * time with the best ordinary kernel is faster, so this isn't chosen.
+ */
+void algorithm_t::add_lane_kernel(hashid_t pos, const char *name, uint32_t needs, uint32_t slower,
+				  unsigned int lanes,
+				  void ( *func_blocks)(uint32_t *state, const unsigned char **data, size_t blocks))
+{
+    assert(lanes<=lane_kernel_t::MAX_LANES);
+    lane_kernel_t k;
+    k.name     = name;
+    k.needs    = needs;
+    k.slower   = slower;
+    k.lanes    = lanes;
+    k.f_blocks = func_blocks;
+    hashes[pos].lane_kernels.push_back(k);
+}
+
+
+/**
+ * Bind each algorithm to the last kernel it has that this processor can
+ * run, and the last lane kernel. If name isn't empty, the algorithms that
+ * have a kernel or lane kernel of that name use it instead, so that it
+ * can be compared with the others, and no other lane kernel is used.
+ * This must be done before anything is hashed.
+ */
+std::string algorithm_t::choose_kernels(const std::string &name)
+{
+    bool found = name.size()==0;
+    std::vector<std::string> names;
+    for (int i = 0 ; i < NUM_ALGORITHMS ; ++i) {
+	algorithm_t &a = hashes[i];
+	const kernel_t *use = 0;
+	for (std::vector<kernel_t>::const_iterator it = a.kernels.begin(); it!=a.kernels.end(); it++) {
+	    if (std::find(names.begin(),names.end(),it->name)==names.end()) {
+		names.push_back(it->name);
+	    }
+	    if (name.size() && it->name==name) {
+		if (!it->runs_here()) {
+		    return "This processor can't run the " + name + " implementation of " + a.name
+			+ ", which needs " + cpu_feature_names(it->needs);
+		}
+		found = true;
+		use = &*it;
+		break;
+	    }
+	    if (it->runs_here()) use = &*it;
+	}
+	if (use==0) continue;		// not an algorithm we have
+	a.kernel     = use->name;
+	a.f_init     = use->f_init;
+	a.f_update   = use->f_update;
+	a.f_finalize = use->f_finalize;
+
+	a.lanes = 0;
+	for (std::vector<lane_kernel_t>::const_iterator it = a.lane_kernels.begin(); it!=a.lane_kernels.end(); it++) {
+	    if (std::find(names.begin(),names.end(),it->name)==names.end()) {
+		names.push_back(it->name);
+	    }
+	    if (name.size() && it->name==name) {
+		if (!it->runs_here()) {
+		    return "This processor can't run the " + name + " implementation of " + a.name
+			+ ", which needs " + cpu_feature_names(it->needs);
+		}
+		found = true;
+		a.lanes = &*it;
+		break;
+	    }
+	    if (name.size()==0 && it->runs_here() && (it->slower & cpu_features())==0) a.lanes = &*it;
+	}
+    }
+    if (!found) {
+	std::string valid;
+	for (std::vector<std::string>::const_iterator it = names.begin(); it!=names.end(); it++) {
+	    valid += (valid.size() ? ", " : "") + *it;
+	}
+	return "Unknown hash implementation '" + name + "'. Valid implementations are: " + valid;
+    }
+    return "";
 }
 
 
@@ -329,6 +459,18 @@ void hash_final_sha1(void * ctx, unsigned char *sum)
 {
     sha1_finish((sha1_context *)ctx,sum);
 }
+
+#ifdef HAVE_SHA_NI
+void hash_update_sha1_shani(void * ctx, const unsigned char *buf, size_t len)
+{
+    sha1_update_shani((sha1_context *)ctx,buf,len);
+}
+
+void hash_final_sha1_shani(void * ctx, unsigned char *sum)
+{
+    sha1_finish_shani((sha1_context *)ctx,sum);
+}
+#endif
 #endif
 
 #if defined(HAVE_COMMONCRYPTO_COMMONDIGEST_H)
@@ -446,6 +588,13 @@ void algorithm_t::load_hashing_algorithms()
     add_algorithm(alg_tiger,     "tiger",     192, hash_init_tiger,     hash_update_tiger,     hash_final_tiger,     DEFAULT_ENABLE_TIGER);
     add_algorithm(alg_whirlpool, "whirlpool", 512, hash_init_whirlpool, hash_update_whirlpool, hash_final_whirlpool, DEFAULT_ENABLE_WHIRLPOOL);
 
+    /* Faster kernels for the processors that can run them; see choose_kernels */
+#ifdef HAVE_SHA_NI
+    add_kernel(alg_sha1,   "shani", CPU_SHA|CPU_SSE41, hash_init_sha1,   hash_update_sha1_shani,   hash_final_sha1_shani);
+    add_kernel(alg_sha256, "shani", CPU_SHA|CPU_SSE41, hash_init_sha256, hash_update_sha256_shani, hash_final_sha256_shani);
+#endif
+    load_lane_kernels();
+
     //add_algorithm(alg_sha3,
     //		  "sha3",
     //256,
@@ -484,19 +633,13 @@ void algorithm_t::clear_algorithms_inuse()
 
 bool algorithm_t::valid_hex(const std::string &buf)
 {
-    for(std::string::const_iterator it = buf.begin(); it!=buf.end(); it++){
-	if(!isxdigit(*it)) return false;
-    }
-    return true;
+    return hex_valid(buf.data(),buf.size());
 }
 
 bool algorithm_t::valid_hash(hashid_t alg, const std::string &buf)
 {
-    for (size_t pos = 0 ; pos < hashes[alg].bit_length/4 ; pos++)  {
-	if (!isxdigit(buf[pos])) return false; // invalid character
-	if (pos==(hashes[alg].bit_length/4)-1) return true; // we found them all
-    }
-    return false;				// too short or too long
+    size_t len = hashes[alg].bit_length/4;
+    return len > 0 && buf.size() >= len && hex_valid(buf.data(),len);
 }
 
 
@@ -509,6 +652,14 @@ int algorithm_t::algorithms_in_use_count()
     return count;
 }
 
+bool algorithm_t::lanes_in_use()
+{
+    for (int i = 0 ; i < NUM_ALGORITHMS ; ++i)  {
+	if(hashes[i].inuse && hashes[i].lanes) return true;
+    }
+    return false;
+}
+
 
 // C++ string splitting code from
 // http://stackoverflow.com/questions/236129/how-to-split-a-string-in-c
@@ -614,7 +765,7 @@ int state::hashdeep_process_command_line(int argc_, char **argv_)
     bool did_usage = false;
   int i;
 
-  while ((i=getopt(argc_,argv_,"abc:CdeEF:f:o:I:i:MmXxtlk:rsp:wvVhW:0D:uj:")) != -1)  {
+  while ((i=getopt(argc_,argv_,"abc:CdeEF:f:o:G:H:I:i:MmXxtlk:rsp:wvVhW:0D:uj:R:T:P:J:LON")) != -1)  {
     switch (i)
     {
     case 'a':
@@ -697,23 +848,11 @@ int state::hashdeep_process_command_line(int argc_, char **argv_)
     case 'w': ocb.opt_show_matched = true;    break; // displays which known hash generated a match
 
     case 'k':
-	switch (ocb.load_hash_file(optarg)) {
+	/* The hashes themselves are loaded once we have all the options */
+	switch (ocb.queue_hash_file(optarg)) {
 	case hashlist::loadstatus_ok:
-	    if(opt_debug){
-		ocb.error("%s: Match file loaded %d known hash values.",
-				optarg,ocb.known_size());
-	    }
 	    break;
 
-      case hashlist::status_contains_no_hashes:
-	  /* Trying to load an empty file is fine, but we shouldn't
-	     change hashes_loaded */
-	  break;
-
-      case hashlist::status_contains_bad_hashes:
-	  ocb.error("%s: contains some bad hashes, using anyway",optarg);
-	  break;
-
       case hashlist::status_unknown_filetype:
       case hashlist::status_file_error:
 	  /* The loading code has already printed an error */
@@ -739,7 +878,22 @@ int state::hashdeep_process_command_line(int argc_, char **argv_)
     case '0': ocb.opt_zero = true; break;
     case 'u': ocb.opt_unicode_escape = true;break;
     case 'j': ocb.opt_threadcount = atoi(optarg); break;
+    case 'J':
+      opt_walk_threads = atoi(optarg);
+      sanity_check(opt_walk_threads<1,"The number of directory threads must be at least one.");
+      break;
+    case 'L': ocb.opt_flush_lines = true; break;
+    case 'O': ocb.opt_ordered = true; break;
+    case 'N': ocb.opt_known_filter = false; break;
     case 'F': ocb.opt_iomode = iomode::toiomode(optarg);break;
+    case 'R': set_read_block_size(optarg); break;
+    case 'T': opt_benchmark = optarg; break;
+    case 'G': opt_write_index = optarg; break;
+    case 'H': opt_kernel = optarg; break;
+    case 'P':
+      ocb.opt_pipeline_size = find_block_size(optarg);
+      sanity_check(ocb.opt_pipeline_size==0,"Pipelined hashing of zero byte files is pointless.");
+      break;
     case 'E': ocb.opt_case_sensitive = false; break;
 
     case 'h':
@@ -757,6 +911,27 @@ int state::hashdeep_process_command_line(int argc_, char **argv_)
 
   if(did_usage ) exit(EXIT_SUCCESS);
 
+  hashlist::load_results_t loaded;
+  ocb.load_queued_files(loaded);
+  for(hashlist::load_results_t::const_iterator it=loaded.begin();it!=loaded.end();it++){
+      switch(it->status){
+      case hashlist::loadstatus_ok:
+	  if(opt_debug){
+	      ocb.error("%s: Match file loaded %"PRIu64" known hash values.",
+			it->fn.c_str(),it->known_after);
+	  }
+	  break;
+
+      case hashlist::status_contains_bad_hashes:
+	  ocb.error("%s: contains some bad hashes, using anyway",it->fn.c_str());
+	  break;
+
+      default:
+	  break;
+      }
+  }
+  if(opt_write_index.size()) write_known_index();
+
   hashdeep_check_flags_okay();
   return FALSE;
 }
@@ -1028,7 +1203,7 @@ int state::md5deep_process_command_line(int argc_, char **argv_)
 
     while ((i = getopt(argc_,
 		       argv_,
-		       "A:a:bcCdeF:f:I:i:M:X:x:m:o:tnwzsSp:rhvV0lkqZW:D:uj:")) != -1) {
+		       "A:a:bcCdeF:f:G:H:I:i:M:X:x:m:o:tnwzsSp:rhvV0lkqZW:D:uj:R:T:J:LON")) != -1) {
 	switch (i) {
 	case 'C': opt_enable_mac_cc = true; break;
 	case 'D': opt_debug = atoi(optarg);	break;
@@ -1061,7 +1236,18 @@ int state::md5deep_process_command_line(int argc_, char **argv_)
 	case 'n': ocb.mode_not_matched	= true;		break;
 	case 'w': ocb.opt_show_matched	= true;		break; 	// display which known hash generated match
 	case 'j': ocb.opt_threadcount	= atoi(optarg);	break;
+	case 'J':
+	    opt_walk_threads = atoi(optarg);
+	    sanity_check(opt_walk_threads<1,"The number of directory threads must be at least one.");
+	    break;
+	case 'L': ocb.opt_flush_lines	= true;		break;
+	case 'O': ocb.opt_ordered	= true;		break;
+	case 'N': ocb.opt_known_filter	= false;	break;
 	case 'F': ocb.opt_iomode	= iomode::toiomode(optarg);break;
+	case 'R': set_read_block_size(optarg);		break;
+	case 'T': opt_benchmark		= optarg;	break;
+	case 'G': opt_write_index	= optarg;	break;
+	case 'H': opt_kernel		= optarg;	break;
 
 	case 'a':
 	    ocb.opt_mode_match=true;
@@ -1138,6 +1324,8 @@ int state::md5deep_process_command_line(int argc_, char **argv_)
 	}
     }
     if(did_usage) exit (EXIT_SUCCESS);
+    ocb.load_queued_files();		// the match files we were given
+    if(opt_write_index.size()) write_known_index();
 
     md5deep_check_flags_okay();
     return EXIT_SUCCESS;
@@ -1238,6 +1426,48 @@ uint64_t state::find_block_size(std::string input_str)
 
 
 
+/* Set the read block size from the -R argument */
+void state::set_read_block_size(const std::string &input_str)
+{
+    ocb.opt_blocksize = find_block_size(input_str);
+    sanity_check((ocb.opt_blocksize < file_data_hasher_t::MD5DEEP_MIN_BLOCK_SIZE) ||
+		 (ocb.opt_blocksize > file_data_hasher_t::MD5DEEP_MAX_BLOCK_SIZE),
+		 "Read block size must be between 64k and 16m.");
+}
+
+
+/* Compile the known hashes we loaded into the index requested with -G, and exit */
+void state::write_known_index()
+{
+    sanity_check(hashes_loaded()==0,"Unable to load any known hashes to index.");
+    ocb.write_known_index(opt_write_index);
+    if(ocb.opt_verbose){
+	ocb.status("%s: wrote %"PRIu64" known hashes",opt_write_index.c_str(),ocb.known_size());
+    }
+    exit(EXIT_SUCCESS);
+}
+
+
+/* Run the benchmark requested with -T on the files named on the command line */
+int state::run_benchmark()
+{
+    if(opt_benchmark=="kernels"){
+	ocb.benchmark_kernels();
+	return ocb.get_return_code();
+    }
+    if(opt_benchmark=="hex"){
+	ocb.benchmark_hex();
+	return ocb.get_return_code();
+    }
+    sanity_check(opt_benchmark!="blocksize","Unknown benchmark. Valid benchmarks are: blocksize, kernels, hex");
+    sanity_check(optind==argc,"Benchmark mode requires one or more files.");
+    for(int i=optind;i<argc;i++){
+	ocb.benchmark_block_sizes(generate_filename(this->argv[i]));
+    }
+    return ocb.get_return_code();
+}
+
+
 int main(int argc, char **argv)
 {
   // Because the main() function can handle wchar_t arguments on Win32,
@@ -1319,6 +1549,10 @@ int state::main(int _argc,char **_argv)
       md5deep_process_command_line(_argc,_argv);
     }
 
+    /* Every hash is computed with the kernels chosen here */
+    std::string kernel_error = algorithm_t::choose_kernels(opt_kernel);
+    sanity_check(kernel_error.size()>0,kernel_error.c_str());
+
     if (opt_debug==1)
     {
       printf("self-test...\n");
@@ -1345,23 +1579,45 @@ int state::main(int _argc,char **_argv)
 	ocb.fatal_error("%s", strerror(errno));
     }
 
+    if(opt_benchmark!=""){
+	return run_benchmark();
+    }
+
     /* Make the banner if we are not in md5deep mode */
     if (!md5deep_mode){
 	ocb.set_utf8_banner( make_banner());
     }
 
+    /* All of the known hashes are loaded; from here on they are only searched */
+    ocb.freeze_known();
+
 #ifdef HAVE_PTHREAD
     /* set up the threadpool */
     if(ocb.opt_threadcount>0){
 	ocb.tp = new threadpool(ocb.opt_threadcount);
     }
 #endif
+#ifdef HAVE_DIR_WALKER
+    /* Directories can be read by several threads if files are hashed by the pool.
+     * Not with -O: the files would be found in a different order every time.
+     */
+    if(opt_walk_threads>1 && ocb.opt_ordered){
+	ocb.error("-J is ignored with -O, so that files are found in the same order every run");
+	opt_walk_threads = 1;
+    }
+    if(mode_recursive && opt_walk_threads>1 && ocb.tp){
+	walker = new dir_walker(this,opt_walk_threads);
+    }
+#endif
 
     if(opt_debug>2){
 	std::cout << "dump hashlist before matching:\n";
 	ocb.dump_hashlist();
     }
 
+    /* Results are written in batches unless someone is watching them (or asked for -L) */
+    ocb.set_buffered_output(ocb.opt_flush_lines==false && !ocb.output_is_terminal());
+
     /* If we were given an input list, process it */
     if(opt_input_list!=""){
 	std::ifstream in;
@@ -1413,9 +1669,25 @@ int state::main(int _argc,char **_argv)
     }
 
     /* If we are multi-threading, wait for all threads to finish */
+#ifdef HAVE_DIR_WALKER
+    if(walker){
+	walker->wait();			// every file has been found
+	delete walker;
+	walker = 0;
+    }
+#endif
+    ocb.flush_file_batch();		// the small files we were saving up
 #ifdef HAVE_PTHREAD
-    if(ocb.tp) ocb.tp->wait_till_all_free();
+    if(ocb.tp){
+	ocb.tp->wait_till_all_free();
+	if(opt_debug>1){
+	    std::cerr << "*** threadpool: " << ocb.tp->jobs_submitted() << " jobs submitted, "
+		      << ocb.tp->jobs_completed() << " completed, "
+		      << ocb.tp->jobs_in_flight() << " in flight\n";
+	}
+    }
 #endif
+    ocb.set_buffered_output(false);	// everything hashed has been written
 
     if (opt_debug>2)
     {
@@ -1442,6 +1714,7 @@ int state::main(int _argc,char **_argv)
     {
       ocb.finalize_matching();
     }
+    if (ocb.opt_verbose) ocb.report_known_filters();
 
     /* If we were generating DFXML, finish the job */
     if(opt_debug>1) std::cerr << "*** main calling dfxml_shutdown\n";
@@ -22,9 +22,7 @@
 #include "common.h"
 #include "xml.h"
 
-#ifdef HAVE_PTHREAD
 #include "threadpool.h"
-#endif
 
 #include <map>
 #include <vector>
@@ -53,6 +51,7 @@
   * Add a call to insert the algorithm in state::load_hashing_algorithms
   * See if you need to increase MAX_ALGORITHM_NAME_LENGTH or
     MAX_ALGORITHM_CONTEXT_SIZE for your algorithm in common.h
+  * Make room for its digest in DIGEST_SPACE and hash_digests::offsets
   * Update the usage function and man page to include the function
   */
 
@@ -110,6 +109,17 @@ public:;
     }
 };
 
+/* Processor features that a hash kernel may need; helpers.cpp finds them */
+#define CPU_SSE41   0x01
+#define CPU_AVX2    0x02
+#define CPU_AVX512  0x04		// AVX-512 F and BW
+#define CPU_SHA     0x08		// the SHA-1 and SHA-256 instructions
+#define CPU_BMI2    0x10
+uint32_t cpu_features();		// those that this processor has
+std::string cpu_feature_names(uint32_t features); // "sse4.1,avx2" and so on
+
+class hash_digests;
+
 /* This class holds the information known about each hash algorithm.
  * It's sort of like the EVP system in OpenSSL.
  *
@@ -122,30 +132,86 @@ public:;
  * Perhaps the correct way to do this would be a global C++ vector of objects?
  */
 class algorithm_t {
+private:
+    algorithm_t(const algorithm_t &);
+    algorithm_t &operator=(const algorithm_t &);
 public:
+    algorithm_t():inuse(false),name(),bit_length(0),id(alg_unknown),
+		  f_init(0),f_update(0),f_finalize(0),kernels(),kernel(),lane_kernels(),lanes(0){}
     bool		inuse;		// true if we are using this algorithm
     std::string		name;		// name of algorithm
     size_t		bit_length;	// 128 for MD5
     hashid_t		id;		// usually the position in the array...
 
-    /* The hashing functions */
+    /* The hashing functions, from the kernel we chose */
     void ( *f_init)(void *ctx);
     void ( *f_update)(void *ctx, const unsigned char *buf, size_t len );
     void ( *f_finalize)(void *ctx, unsigned char *);
 
+    /* An implementation of the algorithm. They all use the same context,
+     * so any of them can be used where another was.
+     */
+    class kernel_t {
+    public:
+	kernel_t():name(),needs(0),f_init(0),f_update(0),f_finalize(0){}
+	std::string	name;
+	uint32_t	needs;		// the CPU_ features it can't run without
+	void ( *f_init)(void *ctx);
+	void ( *f_update)(void *ctx, const unsigned char *buf, size_t len );
+	void ( *f_finalize)(void *ctx, unsigned char *);
+	bool		runs_here() const { return (needs & ~cpu_features())==0; }
+    };
+    std::vector<kernel_t> kernels;	// "portable" first, then the faster ones
+    std::string		kernel;		// the name of the one we are using
+
+    /* An implementation that hashes several messages at once, one in each
+     * lane of a SIMD register; file_batch uses it for small files.
+     * multibuffer.cpp has them, and the engine that feeds them.
+     */
+    class lane_kernel_t {
+    public:
+	static const unsigned int MAX_LANES = 16;
+	lane_kernel_t():name(),needs(0),slower(0),lanes(0),f_blocks(0){}
+	std::string	name;
+	uint32_t	needs;		// the CPU_ features it can't run without
+	uint32_t	slower;		// not used unless named when the processor has these
+	unsigned int	lanes;		// how many messages at a time
+	/* Compress the next 'blocks' 64-byte blocks of each lane's data.
+	 * Word w of lane l's state is state[w*lanes+l].
+	 */
+	void ( *f_blocks)(uint32_t *state, const unsigned char **data, size_t blocks);
+	bool		runs_here() const { return (needs & ~cpu_features())==0; }
+	/* Hash count messages; dest[i] gets the digest of the len[i] bytes at data[i] */
+	void		digest(hashid_t alg,size_t count,const unsigned char *const *data,
+			       const size_t *len,hash_digests *const *dest) const;
+    };
+    std::vector<lane_kernel_t> lane_kernels;
+    const lane_kernel_t	*lanes;		// the one we are using, or 0
+
     /* The methods */
     static void add_algorithm(hashid_t pos, const char *name, uint16_t bits, 
 			      void ( *func_init)(void *ctx),
 			      void ( *func_update)(void *ctx, const unsigned char *buf, size_t len ),
 			      void ( *func_finalize)(void *ctx, unsigned char *),
 			      int inuse);
+    static void add_kernel(hashid_t pos, const char *name, uint32_t needs,
+			   void ( *func_init)(void *ctx),
+			   void ( *func_update)(void *ctx, const unsigned char *buf, size_t len ),
+			   void ( *func_finalize)(void *ctx, unsigned char *));
+    static void add_lane_kernel(hashid_t pos, const char *name, uint32_t needs, uint32_t slower,
+				unsigned int lanes,
+				void ( *func_blocks)(uint32_t *state, const unsigned char **data, size_t blocks));
+    static void load_lane_kernels();	// in multibuffer.cpp
     static void load_hashing_algorithms();
+    /* Use the fastest kernel this processor can run, or the one named; returns an error or "" */
+    static std::string choose_kernels(const std::string &name);
     static void clear_algorithms_inuse();
     static void enable_hashing_algorithms(std::string var);  // enable the algorithms in 'var'; var can be 'all'
     static hashid_t get_hashid_for_name(std::string name);   // return the hashid_t for 'name'
     static bool valid_hex(const std::string &buf);	     // returns true if buf contains only hex characters
     static bool valid_hash(hashid_t alg,const std::string &buf); // returns true if buf is a valid hash for hashid_t a
     static int  algorithms_in_use_count(); // returns count of algorithms in use
+    static bool lanes_in_use();	// an algorithm in use has a lane kernel
 };
 
 extern algorithm_t     hashes[NUM_ALGORITHMS];		// which hash algorithms are available and in use
@@ -221,43 +287,88 @@ public:
 
     // stat a file, print an error and return -1 if it fails, otherwise return 0
     static int stat(const filename_t &path,file_metadata_t *m,class display &ocb); 
+    // the same for a file we already have open, without looking up the path again
+    static int fstat(int fd,const filename_t &path,file_metadata_t *m,class display &ocb);
+    static void decode_stat(const struct __stat64 &sb,file_metadata_t *m); // copy what we care about
     class fileid_t {				      // uniquely defines a file on this system
     public:
 	fileid_t():dev(0),ino(0){};
 	fileid_t(uint64_t dev_,uint64_t ino_):dev(dev_),ino(ino_){};
+	bool operator==(const fileid_t &b) const { return dev==b.dev && ino==b.ino; }
 	uint64_t	dev;			      // device number
 	uint64_t	ino;			      // inode number
     };
-    file_metadata_t():fileid(),nlink(0),size(0),ctime(0),mtime(0),atime(0){};
+    file_metadata_t():fileid(),have_fileid(false),nlink(0),size(0),blksize(0),ctime(0),mtime(0),atime(0){};
     file_metadata_t(fileid_t fileid_,uint64_t nlink_,uint64_t size_,timestamp_t ctime_,timestamp_t mtime_,
-		    timestamp_t atime_):fileid(fileid_),nlink(nlink_),size(size_),ctime(ctime_),mtime(mtime_),atime(atime_){};
+		    timestamp_t atime_):fileid(fileid_),have_fileid(true),nlink(nlink_),size(size_),blksize(0),
+				       ctime(ctime_),mtime(mtime_),atime(atime_){};
     fileid_t	fileid;
+    bool	have_fileid;			      // false if windows couldn't tell us; not checked for cycles
     uint64_t	nlink;
     uint64_t	size;
+    uint64_t	blksize;			      // preferred I/O size (st_blksize); 0 if unknown
     timestamp_t ctime;
     timestamp_t mtime;
     timestamp_t atime;
     
 };
 
+/* Hex, in multihash.cpp. Upper and lower case are read; lower case is written. */
+void	hex_encode(const uint8_t *bin,size_t len,char *hex); // writes 2*len characters and no NUL
+bool	hex_decode(const char *hex,size_t len,uint8_t *bin); // false if len is odd or a character isn't hex
+bool	hex_valid(const char *hex,size_t len);
+/* The same with the table alone, whatever the processor; for -T hex */
+void	hex_encode_portable(const uint8_t *bin,size_t len,char *hex);
+bool	hex_decode_portable(const char *hex,size_t len,uint8_t *bin);
+bool	hex_valid_portable(const char *hex,size_t len);
+
+/**
+ * hash_digests holds one binary digest for each algorithm, at a fixed
+ * offset, and a bitmask of the ones we have. Nothing is allocated, and
+ * digests are compared with memcmp. Hex is only made for output.
+ * multihash.cpp contains the implementation.
+ */
+#define MAX_DIGEST_SIZE  64		// whirlpool and sha3 are 512 bits
+#define DIGEST_SPACE     (16+20+32+24+64+64) // md5, sha1, sha256, tiger, whirlpool, sha3
+
+class hash_digests {
+private:
+    static const size_t	offsets[NUM_ALGORITHMS+1]; // where each digest starts, in hashid_t order
+    uint8_t		bytes[DIGEST_SPACE];
+    uint8_t		present;	// bit (1<<alg) is set if we have the digest for alg
+    bool		skipped;	// not hashed because of -i/-I; hex() shows stars
+public:
+    hash_digests():present(0),skipped(false){}
+    static size_t	space(int alg){ return offsets[alg+1]-offsets[alg]; } // room for alg's digest
+    static size_t	size(int alg){ return hashes[alg].bit_length/8; }
+    void		clear(){ present=0; skipped=false; }
+    void		skip(){ skipped=true; }
+    bool		has(int alg) const { return present & (1<<alg); }
+    const uint8_t	*get(int alg) const { return bytes+offsets[alg]; }
+    void		set(int alg,const uint8_t *digest); // size(alg) bytes
+    bool		set_hex(int alg,const std::string &hex); // false unless hex is exactly a digest for alg
+    bool		set_hex(int alg,const char *hex,size_t hexlen);
+    bool		same(int alg,const hash_digests &b) const { // both have alg and it is equal
+	return has(alg) && b.has(alg) && memcmp(get(alg),b.get(alg),size(alg))==0;
+    }
+    std::string		hex(int alg) const; // "" if we don't have it
+};
+
 /** file_data_t contains information about a file.
  * It can be created by hashing an actual file, or by reading a hash file a file of hashes. 
  * The object is simple so that the built in C++ shallow copy will make a proper copy of it.
- * Note that all hashes are currently stored as a hex string. That incurs a 2x memory overhead.
- * This will be changed.
+ * Hashes are stored in binary, which is half the size of hex and needs no allocations.
  */
 class file_data_t {
 public:
-    file_data_t():file_bytes(0),matched_file_number(0){
+    file_data_t():digests(),file_name(),file_bytes(0){
     };
     virtual ~file_data_t(){}		// required because we subclass
 
-    std::string hash_hex[NUM_ALGORITHMS];	     // the hash in hex of the entire file
-    std::string	hash512_hex[NUM_ALGORITHMS];	     // hash of the first 512 bytes, for triage mode
+    hash_digests digests;		// the hashes of the entire file (or of the piece just hashed)
     std::string	file_name;		// just the file_name; native on POSIX; UTF-8 on Windows.
 
     uint64_t    file_bytes;		// how many bytes were actually read
-    uint64_t    matched_file_number;	 // file number that we matched.; 0 if no match
 
 };
 
@@ -275,7 +386,8 @@ public:;
     /* The actual hashing */
     void multihash_initialize();
     void multihash_update(const unsigned char *buffer,size_t bufsize);
-    void multihash_finalize(std::string dest[]);
+    void multihash_update(hashid_t alg,const unsigned char *buffer,size_t bufsize); // just one algorithm
+    void multihash_finalize(hash_digests &dest);
 
     // for piecewise hashing: where this segment was actually read
     uint64_t	read_offset;		// where the segment we read started
@@ -283,10 +395,131 @@ public:;
 };
 
 
+/**
+ * io_buffer is the page-aligned buffer that file data is read into.
+ * Each thread that hashes gets its own, the first time it asks for one.
+ * It is grown as needed and reused for every file the thread reads.
+ */
+class io_buffer {
+private:
+    io_buffer(const io_buffer &);
+    io_buffer &operator=(const io_buffer &);
+    static pthread_key_t	key;
+    static pthread_once_t	key_once;
+    static void make_key();
+    static void release(void *ib);
+public:
+    /* A file_batch keeps its files in a buffer of its own, because a file
+     * in the batch may have to be read the usual way while the others wait.
+     */
+    enum which_t { READ=0, BATCH=1, BUFFERS=2 };
+    io_buffer(){ for(int i=0;i<BUFFERS;i++){ buf[i]=0; size[i]=0; } }
+    ~io_buffer();
+    unsigned char	*buf[BUFFERS];
+    size_t		size[BUFFERS];
+    static unsigned char *get(size_t size,which_t which=READ); // this thread's buffer, at least size bytes; 0 if no memory
+};
+
+
+/**
+ * hash_pipeline hashes one large file with a thread for each algorithm (-P).
+ * The thread running compute_hash() reads the file into a ring of buffers
+ * and submits them; every algorithm's thread hashes each buffer in turn.
+ * The time to hash the file is then that of the slowest algorithm
+ * rather than the sum of all of them.
+ * multihash.cpp contains the implementation.
+ */
+class hash_pipeline {
+private:
+    hash_pipeline(const hash_pipeline &);
+    hash_pipeline &operator=(const hash_pipeline &);
+
+    static const unsigned int RING_SIZE = 4;
+    class slot {
+    public:
+	slot():buf(0),data(0),len(0),hc1(0),hc2(0),pending(0){}
+	unsigned char		*buf;	// our buffer, which the file is read into
+	const unsigned char	*data;	// what to hash; buf, or the mmapped file
+	size_t			len;
+	hash_context_obj	*hc1,*hc2;
+	unsigned int		pending; // hashers that have yet to hash this slot
+    };
+    class hasher {
+    public:
+	hasher(hash_pipeline *p_,hashid_t alg_):p(p_),alg(alg_),done(0),thread(){}
+	hash_pipeline	*p;
+	hashid_t	alg;
+	uint64_t	done;		// slots hashed so far
+	pthread_t	thread;
+    };
+
+    mutex_t		M;		// protects everything below
+    pthread_cond_t	TOREADER;	// a slot was freed
+    pthread_cond_t	TOHASHER;	// a slot was submitted, or we are quitting
+    slot		ring[RING_SIZE];
+    uint64_t		submitted;	// slots submitted so far
+    bool		quit;
+    std::vector<hasher *> hashers;
+    static void *start_hasher(void *arg);
+    void run_hasher(hasher *h);
+public:
+    hash_pipeline();
+    ~hash_pipeline();
+    bool start(size_t block_size);	// returns false if we can't; hash without us
+    unsigned char *get_buffer();	// waits for the next slot to be free and returns its buffer
+    void submit(const unsigned char *data,size_t len,hash_context_obj *hc1,hash_context_obj *hc2);
+    void wait();			// wait until everything submitted has been hashed
+};
+
+
+/**
+ * piecewise_job spreads the pieces of one large file across the threadpool (-p).
+ * The worker that was given the file is the sequencer: it displays the
+ * pieces in offset order and hashes each one itself if nobody has claimed it yet.
+ * Free workers are recruited as helpers; a helper claims the next piece,
+ * hashes it with positional reads and leaves the result in a bounded
+ * window of slots for the sequencer to pick up.
+ * hash.cpp contains the implementation.
+ */
+class piecewise_job : public threadpool_task {
+private:
+    piecewise_job(const piecewise_job &);
+    piecewise_job &operator=(const piecewise_job &);
+
+    class piece {
+    public:
+	piece():done(false),ok(false),read_len(0),digests(){}
+	bool		done;		// hashed by a helper; waiting to be displayed
+	bool		ok;		// false if there was a fatal read error
+	uint64_t	read_len;
+	hash_digests	digests;
+    };
+
+    mutex_t		M;		// protects everything below
+    pthread_cond_t	TOSEQUENCER;	// a piece was hashed, or a helper left
+    pthread_cond_t	TOHELPER;	// the window moved, or we are quitting
+    class file_data_hasher_t *fdht;	// the file; owned by the sequencer
+    uint64_t		piece_size;
+    uint64_t		npieces;
+    uint64_t		next_piece;	// next piece to be claimed
+    uint64_t		emitted;	// pieces displayed so far; the window starts here
+    unsigned int	helpers;	// helpers scheduled that have not yet left
+    bool		quit;
+    std::vector<piece>	window;
+public:
+    piecewise_job(class file_data_hasher_t *fdht,uint64_t piece_size,unsigned int window_size);
+    ~piecewise_job();
+    void recruit(class threadpool *tp); // offer helper tasks to any idle workers
+    void help();			// run by each helper
+    virtual void run(class worker *){ help(); }
+    void sequence(class threadpool *tp); // run by the sequencer
+};
+
+
 /** file_data_hasher_t is a subclass of file_data_t.
  * It contains additional information necessary to actually hash a file.
  */
-class file_data_hasher_t : public file_data_t {
+class file_data_hasher_t : public file_data_t, public threadpool_task {
 private:
     static uint64_t	next_file_number;
     static mutex_t	fdh_lock;
@@ -294,28 +527,40 @@ public:
     uint64_t	stat_megs() const {	// return how many megabytes is the file in MB?
 	return stat_bytes / ONE_MEGABYTE;
     }
-    static const size_t MD5DEEP_IDEAL_BLOCK_SIZE = 8192;
+
+    /* Limits on how much we read at a time. The default is used when
+     * the file system doesn't tell us its preferred I/O size.
+     */
+    static const size_t MD5DEEP_MIN_BLOCK_SIZE     = 64*1024;
+    static const size_t MD5DEEP_DEFAULT_BLOCK_SIZE = ONE_MEGABYTE;
+    static const size_t MD5DEEP_MAX_BLOCK_SIZE     = 16*ONE_MEGABYTE;
+    static size_t choose_block_size(uint64_t requested,uint64_t blksize);
     file_data_hasher_t(class display *ocb_):
 	ocb(ocb_),			// where we put results
 	handle(0),
 	fd(-1),
 	base(0),bounds(0),		// for mmap
 	file_number(0),ctime(0),mtime(0),atime(0),stat_bytes(0),
+	metadata(),
+	block_size(MD5DEEP_DEFAULT_BLOCK_SIZE),pipeline(0),
 	start_time(0),last_time(0),eof(false),workerid(-1){
-	file_number = ++next_file_number;
+	file_number = __sync_add_and_fetch(&next_file_number,1); // files are found by several threads
     };
     virtual ~file_data_hasher_t(){
+	close_file();
+    }
+    void close_file(){			// so that it can be opened again
 	if(handle){
 	    fclose(handle);
 	    handle = 0;
 	}
-	if(fd){
 #ifdef HAVE_MMAP
-	    if(base) munmap((void *)base,bounds);
+	if(base) munmap((void *)base,bounds);
 #endif
-	    close(fd);
-	    fd = 0;
-	}
+	base   = 0;
+	bounds = 0;
+	if(fd>=0) close(fd);
+	fd = -1;
     }
 
     bool is_stdin(){ return handle==stdin; }
@@ -346,6 +591,9 @@ public:
     // How many bytes (and megs) we think are in the file, via stat(2)
     // and how many bytes we've actually read in the file
     uint64_t    stat_bytes;		// how much stat returned
+    file_metadata_t metadata;		// what fstat returned
+    size_t	block_size;		// how much we read at a time
+    hash_pipeline *pipeline;		// if set, hash with a thread for each algorithm
 
     /* When we started the hashing, and when was the last time a display was printed,
      * for printing status updates.
@@ -363,16 +611,55 @@ public:
     // called to actually do the computation; returns true if successful
     // and fills in the read_offset and read_len
     void dfxml_timeout(const std::string &tag,const timestamp_t &val);
-    void dfxml_write_hashes(std::string hex_hashes[],int indent);
+    void dfxml_write_hashes(const hash_digests &d,int indent);
     bool compute_hash(uint64_t request_start,uint64_t request_len,hash_context_obj *segment,hash_context_obj *file);
+    // like compute_hash, but with positional reads, so helpers can call it at the same time
+    bool hash_piece(uint64_t request_start,uint64_t request_len,hash_context_obj *segment) const;
+    void display_piece(const hash_context_obj *hc); // display the hash of a piece (or the whole file)
+    bool open_file();	// open and stat file_name_to_hash; prints an error and returns false on failure
+    bool open_to_hash(); // open_file(), then skip it if -i/-I says to; false if there is nothing more to do
+    ssize_t read_small(unsigned char *buf); // file_batch: read all of a small file; -1 if we can't
     void hash();	// called to hash each file and record results
+    virtual void run(class worker *w);	// hash() in a worker, then delete this
+    static uint64_t files_numbered(){ return __atomic_load_n(&next_file_number,__ATOMIC_SEQ_CST); }
+};
+
+
+/**
+ * file_batch is a batch of small files that are hashed together, so that
+ * the algorithms with a lane kernel can hash several of them at once.
+ * display::hash_file() fills one and schedules it when it is full, or
+ * when MAX_PASSED larger files have been scheduled since it was started,
+ * so that a small file isn't left behind for long (and -O, which can't
+ * write the files after it until it is done, doesn't wait on it).
+ * Its files are read and hashed, then displayed in the order they were
+ * added; one that can't be read in one go, or has become too large, is
+ * hashed the usual way in its turn. hash.cpp contains the implementation.
+ */
+class file_batch : public threadpool_task {
+private:
+    file_batch(const file_batch &);
+    file_batch &operator=(const file_batch &);
+public:
+    static const size_t	  MAX_FILES     = 64;		// files in a batch
+    static const uint64_t MAX_FILE_SIZE = 64*1024;	// larger files are hashed on their own
+    static const uint64_t MAX_BYTES     = ONE_MEGABYTE; // a batch is full when its files have this much
+    static const unsigned int MAX_PASSED = 64;		// other files scheduled before it is
+    file_batch():files(),bytes(0),passed(0){}
+    virtual ~file_batch(){}
+    std::vector<file_data_hasher_t *> files;
+    uint64_t		bytes;		// how much the files were said to hold when they were added
+    unsigned int	passed;		// files scheduled on their own since it was started
+    bool		full() const { return files.size()>=MAX_FILES || bytes>=MAX_BYTES; }
+    void		hash(int workerid); // hash and display each file, and delete it
+    virtual void	run(class worker *w); // hash() in a worker, then delete this
 };
 
 
 /** The hashlist holds a list of file_data_t objects.
  * state->known is used to hold the audit file that is loaded.
  * state->seen is used to hold the hashes seen on the current run.
- * We store multiple maps for each algorithm number which map the hash hex code
+ * We store multiple maps for each algorithm number which map the binary hash
  * to the pointer as well. 
  *
  * the hashlist.cpp file contains the implementation. It's largely taken
@@ -432,12 +719,248 @@ public:;
 	file_unknown
     } hashfile_format; 
 
-    class hashmap : public  std::multimap<std::string,file_data_t *> {
-    public:;
-	void add_file(file_data_t *fi,int alg_num);
+    /**
+     * hashmap finds the files with a given digest for one algorithm.
+     * It is an open addressing table with linear probing. A slot is 8 bytes:
+     * 4 bytes of the digest, so that most probes never touch the file_data_t,
+     * and where the files with that digest are in entries. Files with the
+     * same digest (common in NSRL sets) are chained there in the order they
+     * were added, so they don't lengthen anyone's probes.
+     * Files are named by their record number in the hashlist.
+     */
+    class hashmap {
+    private:
+	hashmap(const hashmap &);
+	hashmap &operator=(const hashmap &);
+	typedef std::vector<file_data_t *> records_t;
+	struct slot {
+	    uint32_t	tag;		// the first 4 bytes of the digest
+	    uint32_t	entry;		// 1 + the index of its first file in entries; 0 if empty
+	};
+	struct entry {
+	    uint32_t	record;		// the file's index in the hashlist
+	    uint32_t	next;		// 1 + the index of the next file with this digest; 0 at the end
+	    uint32_t	last;		// on the first file of a digest: 1 + the index of the last
+	};
+	std::vector<slot>	slots;	// allocated on the first add; the size is a power of 2
+	std::vector<entry>	entries;
+	size_t			used;	// slots in use, which is the number of distinct digests
+	size_t			find_slot(const records_t &records,int alg,const uint8_t *digest) const; // its slot or an empty one
+	void			grow(const records_t &records,int alg);
+    public:
+	/* A lookup returns a cursor over the files with the digest, in the order added */
+	class cursor {
+	    friend class hashmap;
+	    const hashmap	*map;
+	    uint32_t		cur;
+	    cursor(const hashmap *map_,uint32_t cur_):map(map_),cur(cur_){}
+	public:
+	    bool	done() const { return cur==0; }
+	    uint32_t	record() const { return map->entries[cur-1].record; } // only if not done
+	    void	advance(){ if(cur) cur = map->entries[cur-1].next; }
+	};
+	hashmap():slots(),entries(),used(0){}
+	void	add_file(const records_t &records,uint32_t record,int alg);
+	size_t	files() const { return entries.size(); } // that have a digest for the algorithm
+	cursor	find(const records_t &records,int alg,const uint8_t *digest) const;
     };
     hashmap		hashmaps[NUM_ALGORITHMS];
 
+private:
+    /**
+     * Once the known hashes are loaded the list is frozen: nothing is added
+     * and the hashmaps are only read, so any number of threads can search it
+     * without a lock. The only thing a search writes is whether a record was
+     * matched, which is a bit in matched_bits set atomically.
+     */
+    std::vector<uint64_t> matched_bits; // one bit per record
+    bool		frozen;
+    void		mark_matched(size_t record);
+
+public:
+    class known_file;
+
+    /**
+     * A piece of a known file that ends at a line boundary.
+     * Each chunk is parsed by one loader thread into its own records,
+     * which are added to the hashlist in file order once every chunk is parsed.
+     */
+    class known_chunk {
+    private:
+	known_chunk(const known_chunk &);
+	known_chunk &operator=(const known_chunk &);
+	static const size_t	RECORD_POOL_SIZE = 1024;
+	file_data_t		*record_pool;	// the next unused record in the current block
+	size_t			record_pool_left;
+    public:
+	struct bad_line_t {
+	    uint64_t	line;			// in the chunk, starting at 1
+	    int		why;			// what the file's bad_line() should say
+	};
+	known_chunk(const known_file *file_,const char *begin_,const char *end_):
+	    record_pool(0),record_pool_left(0),file(file_),begin(begin_),end(end_),
+	    lines(0),records(),bad_lines(),out_of_memory(false){}
+	const known_file	*file;
+	const char		*begin,*end;
+	uint64_t		lines;		// counted by the parser
+	std::vector<file_data_t *> records;
+	std::vector<bad_line_t>	bad_lines;
+	bool			out_of_memory;	// parsing stopped after line 'lines'
+	file_data_t		*new_record();	// never freed; 0 if out of memory
+	void			add_bad_line(int why){
+	    bad_line_t b; b.line = lines; b.why = why; bad_lines.push_back(b);
+	}
+    };
+
+    /**
+     * A compiled index of known hashes, written with -G and mapped read-only.
+     * Its records are numbered from 'first' in the hashlist. They stay in the
+     * mapping, where each algorithm's digests are sorted for binary search;
+     * a file_data_t is only made for a record that is matched or listed.
+     * Processes that map the same index share its pages.
+     */
+    class known_index {
+    private:
+	known_index(const known_index &);
+	known_index &operator=(const known_index &);
+    public:
+	struct column_t {
+	    const uint8_t	*digests;	// count digests in record order; 0 if we don't have alg
+	    const uint64_t	*present;	// a bit for each record that has the digest
+	    const uint32_t	*order;		// the records that have it, sorted by digest
+	    uint64_t		order_count;
+	};
+	known_index():map(0),map_size(0),count(0),first(0),sizes(0),names(0),
+		      name_count(0),name_offsets(0),name_text(0),name_text_size(0),
+		      built_digests(),built_present(),built_order(),built_name(){
+	    memset(columns,0,sizeof(columns));
+	    memset(built_name_offsets,0,sizeof(built_name_offsets));
+	}
+	~known_index();
+	static bool	is_index(FILE *handle);	// by the magic number; rewinds the handle
+	bool		open(class display *ocb,const std::string &fn,FILE *handle); // false if it isn't valid
+	std::string	algorithms() const;	// the ones we have, as a hashdeep header lists them
+	bool		has(int alg) const { return columns[alg].digests!=0; }
+	const uint8_t	*digest(int alg,uint64_t record) const {
+	    return columns[alg].digests + record*hash_digests::size(alg);
+	}
+	/* The records with the digest are at [*begin,*end) in the order, and ascending */
+	void		find(int alg,const uint8_t *digest,uint64_t *begin,uint64_t *end) const;
+	/* The record at i in alg's order; a damaged entry is taken as the last record */
+	uint64_t	ordered(int alg,uint64_t i) const {
+	    uint32_t r = columns[alg].order[i];
+	    return r < count ? r : count-1;
+	}
+	bool		name_is(uint64_t record,const std::string &name) const;
+	file_data_t	*make_record(uint64_t record) const;
+	/* Make an index in memory of one algorithm's digests, which all have the name */
+	void		build(int alg,std::vector<uint8_t> &digests_,const std::string &name);
+
+	void		*map;
+	size_t		map_size;
+	uint64_t	count;			// records
+	uint32_t	first;			// the number of our first record in the hashlist
+	column_t	columns[NUM_ALGORITHMS];
+	const uint64_t	*sizes;			// 0 if every size is 0
+	const uint32_t	*names;			// each record's name number; 0 if they are all 0
+	uint64_t	name_count;
+	const uint64_t	*name_offsets;		// name_count+1 of them, into name_text
+	const char	*name_text;
+	uint64_t	name_text_size;
+    private:
+	/* What a built index points into, instead of a mapping */
+	std::vector<uint8_t>	built_digests;
+	std::vector<uint64_t>	built_present;
+	std::vector<uint32_t>	built_order;
+	uint64_t		built_name_offsets[2];
+	std::string		built_name;
+    };
+
+    /**
+     * A file of known hashes whose header has been read.
+     * Its lines are loaded later with the rest of the queue, so that
+     * large files and many files are parsed by several threads at once.
+     */
+    class known_file {
+    private:
+	known_file(const known_file &);
+	known_file &operator=(const known_file &);
+    public:
+	known_file(const std::string &fn_,FILE *handle_,uint64_t header_lines_):
+	    fn(fn_),handle(handle_),header_lines(header_lines_),index(0),text(),map(0),map_size(0){}
+	virtual ~known_file();
+	const std::string	fn;
+	FILE			*handle;	// positioned at the first line after the header
+	uint64_t		header_lines;	// the lines before that
+	known_index		*index;		// if it is a compiled index, which has no lines
+	std::string		text;		// what we read, if it couldn't be mapped
+	void			*map;
+	size_t			map_size;
+	/* Called by the loader threads; must not change anything but c */
+	virtual void parse(known_chunk &c) const=0;
+	/* Called in line order for the lines that parse() rejected */
+	virtual void bad_line(class display *ocb,uint64_t line_number,int why) const=0;
+    };
+
+    /* What happened to each file when the queue was loaded */
+    struct load_result_t {
+	load_result_t(const std::string &fn_):fn(fn_),status(loadstatus_ok),known_after(0){}
+	std::string	fn;
+	loadstatus_t	status;
+	uint64_t	known_after;		// hashes known after it was loaded
+    };
+    typedef std::vector<load_result_t> load_results_t;
+
+    /**
+     * known_filter is a split block Bloom filter of one algorithm's known
+     * digests. A digest sets one bit in each word of a 32 byte block, so
+     * a lookup reads a single cache line, and nearly every digest that
+     * isn't known is turned away without probing the hashmap. The digests
+     * of indexes aren't in it.
+     */
+    class known_filter {
+    private:
+	known_filter(const known_filter &);
+	known_filter &operator=(const known_filter &);
+	std::vector<uint32_t>	storage;
+	uint32_t		*blocks;	// 8 words each, aligned to a cache line
+	uint64_t		block_count;
+	const uint32_t		*block(const uint8_t *digest,uint32_t *key) const;
+    public:
+	static const uint64_t	MIN_KEYS = 65536; // smaller sets miss fast enough without one
+	static const uint64_t	BITS_PER_KEY = 16;
+	known_filter(uint64_t keys,bool counting_);
+	void		add(const uint8_t *digest);
+	bool		may_contain(const uint8_t *digest) const;
+	size_t		bytes() const { return block_count*8*sizeof(uint32_t); }
+	uint64_t	keys;
+	/* Only counted in verbose mode, so that threads don't share the counters otherwise */
+	bool		counting;
+	uint64_t	lookups;
+	uint64_t	rejected;
+	uint64_t	false_positives;	// passed, but the hashmap didn't have it
+    };
+
+private:
+    hashlist(const hashlist &);
+    hashlist &operator=(const hashlist &);
+    std::vector<known_file *> queued_files;
+    std::vector<known_index *> indexes;	// in the order of their records
+    known_filter	*filters[NUM_ALGORITHMS]; // 0 if the algorithm doesn't have enough hashes
+    void		add_index(class display *ocb,const std::string &fn,known_index *ix);
+    void		use_algorithms(class display *ocb,const std::string &fn,const std::string &val);
+public:
+    hashlist():matched_bits(),frozen(false),queued_files(),indexes(){
+	memset(filters,0,sizeof(filters));
+    }
+    void		freeze(int threads,bool counting,bool use_filters); // and build the filters if use_filters
+    const known_filter	*filter(int alg) const { return filters[alg]; }
+    /* A record by number; the records of an index are made when they are first asked for */
+    file_data_t		*record(size_t i);
+    bool		is_matched(size_t record) const {
+	return (__atomic_load_n(&matched_bits[record/64],__ATOMIC_RELAXED) >> (record%64)) & 1;
+    }
+
     /****************************************************************
      ** Search functions follow
      ** It's not entirely clear why we have two search functions, but we do.
@@ -448,7 +971,7 @@ public:;
      * hashlist.cpp
      * find_hash finds the 'best match', which ideally is a match for both the hash and the filename.
      */
-    file_data_t	*find_hash(hashid_t alg,const std::string &hash_hex,
+    file_data_t	*find_hash(hashid_t alg,const uint8_t *digest,
 				   const std::string &file_name,
 				   uint64_t file_number); 
 
@@ -470,17 +993,25 @@ public:;
 								     const std::string &fn,std::string val);
 
     std::string		last_enabled_algorithms; // a string with the algorithms that were enabled last
-    hashid_t		hash_column[NUM_ALGORITHMS]; // maps a column number to a hashid;
+    hashid_t		hash_column[MAX_KNOWN_COLUMNS]; // maps a column number to a hashid;
 						     // the order columns appear in the file being loaded.
     uint8_t   filename_column;  // Column number which should contain the filename
     hashfile_format	identify_format(class display *ocb,const std::string &fn,FILE *handle);
-    loadstatus_t	load_hash_file(class display *ocb,const std::string &fn); // not tstring! always ASCII
+    loadstatus_t	queue_hash_file(class display *ocb,const std::string &fn); // not tstring! always ASCII
+    void		queue_known_file(known_file *f){ assert(!frozen); queued_files.push_back(f); }
+    void		load_queued_files(class display *ocb,int threads,load_results_t &results);
+    loadstatus_t	queue_index_file(class display *ocb,const std::string &fn,FILE *handle,
+					 int need_alg); // alg_unknown if any will do
+    void		queue_digests(const std::string &fn,int alg,
+				      std::vector<uint8_t> &digests); // takes them; every one is named fn
+    void		write_index(class display *ocb,const std::string &fn); // compile what we have (-G)
 
     void		dump_hashlist(); // send contents to stdout
     
     /**
      * add_fdt adds a file_data_t record to the hashlist, and its hashes to all the hashmaps.
-     * @param fi - a file_data_t to add. Don't erase it; we're going to use it (and modify it)
+     * @param fi - a file_data_t to add. Don't erase it; we're going to use it.
+     * The list must not be frozen.
      */
     void add_fdt(file_data_t *fi);
 };
@@ -533,10 +1064,9 @@ public:
  * The hashing happens in lots of threads and then calls the output
  * classes in output_control_block to actually do the outputing. The
  * problem here is that one of the things that is done is looking up,
- * so the searches into "known" and "seen" also need to be
- * protected. Hence "known" and "seen" appear in the
- * output_control_block, and not elsewhere, and all of the access to
- * them needs to be mediated.
+ * so "known" and "seen" appear in the output_control_block, and not
+ * elsewhere, and all of the access to them needs to be mediated.
+ * "known" is frozen before hashing starts, so it is searched without the lock.
  *
  * It also needs to maintain all of the state for audit mode.
  * Finally, it maintains options for reading
@@ -563,10 +1093,71 @@ class display {
     class audit_stats	match;		// for the audit mode
     status_t		return_code;	// prevously returned by hash() and dig().
 
+    /**
+     * While files are being hashed, each thread collects the lines it
+     * writes to out in its own output_buffer, and writes them with the
+     * lock held only when the buffer is large or has been waiting a while.
+     * A thread that is busy with a large file isn't adding lines, so the
+     * flusher thread writes any buffer that has waited too long.
+     * The buffer's own mutex is only contended by a thread that flushes everyone's.
+     */
+    class output_buffer {
+    public:
+	output_buffer():M(),buf(),last_flush(time(0)),file_number(0),file_lines(){}
+	mutex_t		M;
+	std::string	buf;
+	time_t		last_flush;
+	uint64_t	file_number;	// -O: the file whose lines are being collected; 0 if none
+	std::string	file_lines;	// -O: its lines; only this thread touches them
+    };
+    static const size_t	OUTPUT_BUFFER_SIZE = 64*1024; // flush when a buffer is this big
+    static const int	OUTPUT_FLUSH_SECONDS = 1;     // or when its oldest line is this old
+    std::vector<output_buffer *> output_buffers; // every thread's buffer
+    pthread_key_t	output_key;	// this thread's buffer
+    bool		buffer_output;	// collect lines in output_buffers
+    output_buffer	*my_output_buffer();
+    void		flush_output_buffer(output_buffer *b); // M must be held
+    pthread_t		flusher;	// writes buffers that are due; see flush_due_output
+    pthread_cond_t	flusher_cond;	// signalled to stop it
+    bool		flusher_running;
+    static void		*flusher_main(void *arg);
+    void		flush_due_output();
+
+    /**
+     * Ordered output (-O). Each worker collects the lines of the file it is
+     * hashing; they are written in file_number order. Files finished ahead of
+     * the next one to write wait in ordered_pending. No more than
+     * ORDERED_WINDOW files are numbered but not yet written; past that,
+     * hash_file() waits, which holds back the directory traversal.
+     * Output made while finding files goes after the last file numbered.
+     */
+    static const uint64_t ORDERED_WINDOW = 4096;
+    pthread_cond_t	ordered_cond;	// signalled when next_ordered moves
+    uint64_t		next_ordered;	// the file_number to write next
+    std::map<uint64_t,std::string> ordered_pending;
+    std::map<uint64_t,std::string> ordered_after; // written after that file
+    output_buffer	ordered_out;	// lines that are in order, waiting to be written
+    void		write_ordered(std::string &text); // M must be held
+    void		flush_ordered();		  // M must be held
+    bool		collect_output(const std::string &text); // false if it should be written now
+    void		write_dfxml(const std::string &xml);
+    void		wait_for_ordered_window();
+
+    /* Small files waiting to be hashed together; see file_batch */
+    mutex_t		batch_lock;	// protects batch
+    file_batch		*batch;		// the batch being filled, or 0
+    bool		batching(const file_metadata_t *m) const; // should this file go in a batch?
+    void		pass_file_batch();	// a file that isn't in the batch is about to be numbered
+    void		hash_batch(file_batch *b);
+
  public:
  display():
     out(&std::cout),
       banner_displayed(0),dfxml(0),
+      output_buffers(),output_key(),buffer_output(false),
+      flusher(),flusher_cond(),flusher_running(false),
+      ordered_cond(),next_ordered(1),ordered_pending(),ordered_after(),ordered_out(),
+      batch_lock(),batch(0),
       mode_triage(false),
       mode_not_matched(false),mode_quiet(false),mode_timestamp(false),
       mode_barename(false),
@@ -594,7 +1185,15 @@ class display {
 #endif
       size_threshold(0),
       piecewise_size(0),	
+      opt_blocksize(0),
+      opt_pipeline_size(0),
+      opt_flush_lines(false),
+      opt_ordered(false),
+      opt_known_filter(true),
       primary_function(primary_compute){
+	pthread_key_create(&output_key,NULL);
+	pthread_cond_init(&ordered_cond,NULL);
+	pthread_cond_init(&flusher_cond,NULL);
       }
     
     /* These variables are read-only after threading starts */
@@ -630,12 +1229,18 @@ class display {
     // When only hashing files larger/smaller than a given threshold
     uint64_t        size_threshold;
     uint64_t        piecewise_size;    // non-zero for piecewise mode
+    uint64_t        opt_blocksize;     // read block size; 0 to pick one from st_blksize
+    uint64_t        opt_pipeline_size; // hash files this big with a thread per algorithm; 0 never
+    bool	    opt_flush_lines;   // write every line as soon as it is made (-L)
+    bool	    opt_ordered;       // write results in the order the files were found (-O)
+    bool	    opt_known_filter;  // put Bloom filters in front of the known hashes (not -N)
     primary_t       primary_function;    /* what do we want to do? */
 
 
     /* Functions for working */
 
     void	set_outfilename(std::string outfilename);
+    bool	output_is_terminal() const { return out==&std::cout && isatty(fileno(stdout)); }
 
     /* Return code support */
     int32_t	get_return_code(){ lock(); int ret = return_code.get_status(); unlock(); return ret; }
@@ -656,8 +1261,9 @@ class display {
     }
     void dfxml_startup(int argc,char **argv);
     void dfxml_shutdown();
-    void dfxml_timeout(const std::string &tag,const timestamp_t &val);
+    void dfxml_timeout(XML::fragment &x,const std::string &tag,const timestamp_t &val);
     void dfxml_write(file_data_hasher_t *fdht);
+    bool dfxml_enabled() const { return dfxml!=0; } // set before threading starts
 
 
     /* Known hash database interface */
@@ -698,6 +1304,9 @@ class display {
 	return fmt_filename(fdt->file_name);
     }
     void	writeln(std::ostream *s,const std::string &str);    // writes a line with NEWLINE and locking
+    void	set_buffered_output(bool on); // turning it off writes what every thread has buffered
+    void	begin_file_output(const file_data_hasher_t *fdht); // -O: this thread's lines are fdht's
+    void	end_file_output();	// -O: fdht is done; write its lines in turn
 
     // Display an ordinary message with newline added
     void	status(const char *fmt, ...) __attribute__((format(printf, 2, 0))); // note that 1 is 'self'
@@ -722,10 +1331,22 @@ class display {
      * Note that this is not locked() and unlocked().
      * It can only be run from the main thread before fork.
      */
-    hashlist::loadstatus_t load_hash_file(const std::string &fn){
-	hashlist::loadstatus_t ret = known.load_hash_file(this,fn);
+    hashlist::loadstatus_t queue_hash_file(const std::string &fn){
+	hashlist::loadstatus_t ret = known.queue_hash_file(this,fn);
 	return ret;
     }
+    void	queue_known_file(hashlist::known_file *f){ known.queue_known_file(f); }
+    hashlist::loadstatus_t queue_index_file(const std::string &fn,FILE *handle,int need_alg){
+	return known.queue_index_file(this,fn,handle,need_alg);
+    }
+    void	queue_digests(const std::string &fn,int alg,std::vector<uint8_t> &digests){
+	known.queue_digests(fn,alg,digests);
+    }
+    void	load_queued_files(hashlist::load_results_t &results){
+	known.load_queued_files(this,opt_threadcount,results);
+    }
+    void	load_queued_files(){ hashlist::load_results_t results; load_queued_files(results); }
+    void	write_known_index(const std::string &fn){ known.write_index(this,fn); }
 
     /** These are multi-threaded */
 
@@ -735,18 +1356,17 @@ class display {
 	unlock();
 	return ret;
     }
-    const file_data_t *find_hash(hashid_t alg,const std::string &hash_hex,
+    const file_data_t *find_hash(hashid_t alg,const uint8_t *digest,
 				 const std::string &file_name,
 				 uint64_t file_number){
-	lock();
-	const file_data_t *ret = known.find_hash(alg,hash_hex,file_name,file_number);
-	unlock();
-	return ret;
+	return known.find_hash(alg,digest,file_name,file_number); // known is frozen; no lock
     }
     void	clear_realtime_stats();
     void	display_realtime_stats(const file_data_hasher_t *fdht,const hash_context_obj *hc,time_t elapsed);
     bool	hashes_loaded() const{ lock(); bool ret = known.size()>0; unlock(); return ret; }
     void	add_fdt(file_data_t *fdt){ lock(); known.add_fdt(fdt); unlock(); }
+    void	freeze_known(){ known.freeze(opt_threadcount,opt_verbose>0,opt_known_filter); } // before any thread searches it
+    void	report_known_filters();
 
     /* audit mode */
     int		audit_update(file_data_hasher_t *fdt);
@@ -755,8 +1375,12 @@ class display {
     void	finalize_matching();
 
     /* hash.cpp: Actually trigger the hashing. */
-    void	hash_file(const tstring &file_name);
+    void	hash_file(const tstring &file_name,const file_metadata_t *m=0); // m, if the caller stat'ed it, only picks how it is scheduled
     void	hash_stdin();
+    void	flush_file_batch();	// hash the files still waiting in a batch, once every file has been found
+    void	benchmark_block_sizes(const tstring &file_name);
+    void	benchmark_kernels();
+    void	benchmark_hex();
     void	dump_hashlist(){ lock(); known.dump_hashlist(); unlock(); }
 };
 
@@ -789,6 +1413,103 @@ inline std::ostream & operator <<(std::ostream &os,const std::wstring &wstr) {
 }
 #endif
 
+/**
+ * dir_table_t is the set of directories we are in the middle of
+ * processing, so that a symlink back to one of them is reported as a
+ * cycle instead of being followed forever. Directories are known by
+ * their device and inode rather than by their full path, in an open
+ * addressing hash table that grows as needed. It locks, so that
+ * threads may share it.
+ * dig.cpp contains the implementation.
+ */
+class dir_table_t {
+private:
+    dir_table_t(const dir_table_t &);
+    dir_table_t &operator=(const dir_table_t &);
+    struct slot {
+	slot():used(false),id(){}
+	bool			  used;
+	file_metadata_t::fileid_t id;
+    };
+    mutex_t		M;
+    std::vector<slot>	slots;		// the size is a power of 2
+    size_t		count;
+    size_t		find(const file_metadata_t::fileid_t &id) const; // the slot for id, or an empty one
+    void		grow();
+public:
+    dir_table_t():M(),slots(64),count(0){}
+    bool insert(const file_metadata_t::fileid_t &id);	// false if already there
+    bool erase(const file_metadata_t::fileid_t &id);	// false if not there
+    bool contains(const file_metadata_t::fileid_t &id) const;
+};
+
+/* The parallel directory walker needs the *at() functions */
+#if !defined(_WIN32) && defined(HAVE_PTHREAD) && defined(HAVE_OPENAT) && defined(HAVE_FSTATAT) && defined(HAVE_FDOPENDIR)
+#define HAVE_DIR_WALKER
+#endif
+
+/**
+ * dir_walker reads directories with several threads at once (-J).
+ * Each directory is a task on a shared stack. A walker thread opens it
+ * relative to its parent's descriptor, reads it, and gives each entry
+ * to should_hash() with the type from readdir() when there is one, so
+ * that most entries are never stat'ed. Subdirectories become new tasks;
+ * files go straight to the hashing pool.
+ * dig.cpp contains the implementation.
+ */
+class dir_walker {
+private:
+    dir_walker(const dir_walker &);
+    dir_walker &operator=(const dir_walker &);
+
+    /* A directory that is being walked. Its subdirectories keep it (and its
+     * descriptor) alive, so that they can be opened with openat() and
+     * so that we can tell if one of them is also one of its parents.
+     */
+    class dir_node {
+    public:
+	dir_node(dir_node *parent_,const file_metadata_t::fileid_t &id_,int fd_):
+	    parent(parent_),id(id_),fd(fd_),refs(1){}
+	dir_node			*parent;
+	file_metadata_t::fileid_t	id;
+	int				fd;	// for opening subdirectories; -1 if not kept open
+	unsigned int			refs;	// protected by M
+    };
+    class dir_task {
+    private:
+	dir_task(const dir_task &);
+	dir_task &operator=(const dir_task &);
+    public:
+	dir_task(const tstring &path_,const tstring &name_,dir_node *parent_):
+	    path(path_),name(name_),parent(parent_){}
+	tstring		path;
+	tstring		name;		// relative to parent
+	dir_node	*parent;
+    };
+
+    static const unsigned int MAX_OPEN_DIRS = 256; // descriptors we keep for openat()
+    class state		*s;
+    mutex_t		M;		// protects everything below
+    pthread_cond_t	TOWALKER;	// there is a directory to read, or we are quitting
+    pthread_cond_t	TOMAIN;		// everything has been walked
+    std::vector<dir_task *> tasks;	// a stack, so that we go deep before we go wide
+    std::vector<pthread_t> threads;
+    unsigned int	pending;	// directories queued or being read
+    unsigned int	open_dirs;	// dir_node descriptors that are open
+    bool		quit;
+    pthread_key_t	current;	// the dir_node this thread is reading
+    static void *start_walker(void *arg);
+    void run();
+    void walk(dir_task *t);
+    void release(dir_node *n);
+public:
+    dir_walker(class state *s,unsigned int nthreads);
+    ~dir_walker();
+    void add(const tstring &path);	// walk this directory
+    void wait();			// until everything has been walked
+};
+
+
 class state {
 public:;
 
@@ -815,7 +1536,9 @@ public:;
       h_plain(0),h_bsd(0),
       h_md5deep_size(0),
       h_hashkeeper(0),h_ilook(0),h_ilook3(0),h_ilook4(0), h_nsrl20(0), h_encase(0),
-      usage_count(0)		// allows -hh to print extra help
+      opt_benchmark(),opt_write_index(),opt_kernel(),
+      usage_count(0),		// allows -hh to print extra help
+      opt_walk_threads(1),walker(0)
 	{};
 
     bool	mode_recursive;
@@ -856,6 +1579,12 @@ public:;
 
     /* main.cpp */
     uint64_t	find_block_size(std::string input_str);
+    void	set_read_block_size(const std::string &input_str);
+    std::string	opt_benchmark;		// benchmark to run instead of hashing
+    std::string	opt_write_index;	// compile the known hashes to this file instead of hashing (-G)
+    std::string	opt_kernel;		// the hash implementation to use instead of the fastest (-H)
+    void	write_known_index() __attribute__ ((__noreturn__)); // and exit
+    int		run_benchmark();
     int		usage_count;
     bool	opt_enable_mac_cc;
     tstring	generate_filename(const tstring &input);
@@ -884,6 +1613,7 @@ public:;
     int         find_md5deep_size_hash(char *buf, char *known_fn);
     int		find_bsd_hash(char *buf, char *fn);
     int		find_rigid_hash(char *buf,  char *fn, unsigned int fn_location, unsigned int hash_location);
+    int		rigid_columns(int fileType, unsigned int *fn_column, unsigned int *hash_column) const;
     int		find_ilook_hash(char *buf, char *known_fn);
     int		check_for_encase(FILE *f,uint32_t *expected_hashes);
 
@@ -892,12 +1622,10 @@ public:;
      * Note the file typing system needs to be able to display errors...
      */
 
-    class dir_table_t : public std::set<tstring>{
-    };
     dir_table_t dir_table;
-    void	done_processing_dir(const tstring &fn_);
-    void	processing_dir(const tstring &fn_);
-    bool	have_processed_dir(const tstring &fn_);
+    void	done_processing_dir(const tstring &fn,const file_metadata_t::fileid_t &id);
+    void	processing_dir(const tstring &fn,const file_metadata_t::fileid_t &id);
+    bool	have_processed_dir(const file_metadata_t::fileid_t &id);
     
 
     int		identify_hash_file_type(FILE *f,uint32_t *expected_hashes); // identify the hash file type
@@ -905,6 +1633,7 @@ public:;
     bool        should_hash_winpe(const tstring &fn);
     bool	should_hash_expert(const tstring &fn, file_types type);
     bool	should_hash(const tstring &fn);
+    bool	should_hash(const tstring &fn, file_types type); // type from lstat or readdir
 
     /* file_type returns the file type of a string.
      * If an error is found and ocb is provided, send the error to ocb.
@@ -912,11 +1641,14 @@ public:;
      */
     static file_types file_type(const filename_t &fn,class display *ocb,uint64_t *filesize,
 				timestamp_t *ctime,timestamp_t *mtime,timestamp_t *atime);
+    static file_types file_type(const filename_t &fn,class display *ocb,file_metadata_t *m); // everything lstat says
 #ifdef _WIN32
     bool	is_junction_point(const std::wstring &fn);
 #endif
     void	clean_name_posix(std::string &fn);
     void	process_dir(const tstring &path);
+    int		opt_walk_threads;	// threads reading directories (-J)
+    dir_walker	*walker;		// if set, process_dir() hands directories to it
     void	dig_normal(const tstring &path);	// posix  & win32 
     void	dig_win32(const tstring &path);	// win32 only; calls dig_normal
     static	void dig_self_test();
@@ -957,6 +1689,8 @@ extern std::string progname;		// formerly const char *__progname
 // ------------------------------------------------------------------
 
 void     chop_line(char *s);
+void    *malloc_aligned(size_t size);	// page-aligned; returns 0 if out of memory
+void     free_aligned(void *buf);
 off_t	find_file_size(FILE *f,class display *ocb); // Return the size, in bytes of an open file stream. On error, return -1 
 
 // ------------------------------------------------------------------
@@ -0,0 +1,674 @@
+/*
+ * Multi-buffer hashing.
+ *
+ * MD5, SHA-1 and SHA-256 work on 32-bit words, so a SIMD register can
+ * hold the state of 8 (AVX2) or 16 (AVX-512) separate messages, one in
+ * each lane, and compress a block of all of them at once. A single
+ * message is no faster this way, but a batch of small files is hashed
+ * several times faster than one file after another. file_batch, in
+ * hash.cpp, is what uses it.
+ *
+ * $Id$
+ */
+
+#include "main.h"
+
+#ifdef HAVE_LANE_KERNELS
+#include <immintrin.h>
+#endif
+
+/****************************************************************
+ *** The engine
+ ****************************************************************/
+
+static const uint32_t md5_iv[4]    = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476};
+static const uint32_t sha1_iv[5]   = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+static const uint32_t sha256_iv[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+				      0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+
+/*
+ * One lane's message. The lane hashes its whole blocks where they are,
+ * then the tail, which is what is left of the message and the padding.
+ */
+class lane_message {
+public:
+    size_t		msg;		// which message; count when the lane is idle
+    const unsigned char	*p;		// where we are, in the message or the tail
+    size_t		blocks;		// blocks left before the tail, or in it
+    bool		in_tail;
+    size_t		tail_blocks;	// 1 or 2
+    unsigned char	tail[128];
+
+    void start(size_t msg_,const unsigned char *data,size_t len,bool big_endian){
+	size_t   rem  = len % 64;
+	uint64_t bits = (uint64_t)len * 8;
+	msg = msg_;
+	tail_blocks = rem < 56 ? 1 : 2;
+	memset(tail,0,sizeof(tail));
+	if(rem) memcpy(tail,data+len-rem,rem);
+	tail[rem] = 0x80;
+	unsigned char *lp = tail + tail_blocks*64 - 8;
+	for(int i=0;i<8;i++){
+	    lp[big_endian ? 7-i : i] = (unsigned char)(bits >> (8*i));
+	}
+	p       = data;
+	blocks  = len / 64;
+	in_tail = false;
+	if(blocks==0) next_part();
+    }
+    bool next_part(){			// false if the message is done
+	if(in_tail) return false;
+	in_tail = true;
+	p       = tail;
+	blocks  = tail_blocks;
+	return true;
+    }
+};
+
+/*
+ * Hash count messages with this kernel, as many at a time as it has
+ * lanes; dest[i] gets the digest of data[i]. Each call to the kernel
+ * goes as far as the lane with the fewest blocks left in the part it is
+ * in. A lane with no message left hashes another lane's data, and what
+ * it gets is thrown away.
+ */
+void algorithm_t::lane_kernel_t::digest(hashid_t alg,size_t count,const unsigned char *const *data,
+					const size_t *len,hash_digests *const *dest) const
+{
+    const uint32_t *iv = md5_iv;
+    unsigned int words = 4;
+    bool big_endian = false;
+    switch(alg){
+    case alg_md5:	iv = md5_iv;    words = 4; big_endian = false; break;
+    case alg_sha1:	iv = sha1_iv;   words = 5; big_endian = true;  break;
+    case alg_sha256:	iv = sha256_iv; words = 8; big_endian = true;  break;
+    default:		assert(0);	// no lane kernels
+    }
+    assert(lanes<=MAX_LANES && f_blocks);
+
+    lane_message	lane[MAX_LANES];
+    uint32_t		state[8*MAX_LANES];
+    const unsigned char	*ptr[MAX_LANES];
+    size_t		next = 0;
+    unsigned int	active = 0;
+
+    for(unsigned int l=0;l<lanes;l++){
+	lane[l].msg = count;
+	if(next<count){
+	    lane[l].start(next,data[next],len[next],big_endian);
+	    for(unsigned int w=0;w<words;w++) state[w*lanes+l] = iv[w];
+	    next++;
+	    active++;
+	}
+    }
+    while(active>0){
+	size_t n = (size_t)-1;
+	unsigned int busy = 0;
+	for(unsigned int l=0;l<lanes;l++){
+	    if(lane[l].msg<count){
+		if(lane[l].blocks<n) n = lane[l].blocks;
+		busy = l;
+	    }
+	}
+	for(unsigned int l=0;l<lanes;l++){
+	    ptr[l] = lane[l].msg<count ? lane[l].p : lane[busy].p;
+	}
+	f_blocks(state,ptr,n);
+
+	for(unsigned int l=0;l<lanes;l++){
+	    if(lane[l].msg>=count) continue;
+	    lane[l].p      += 64*n;
+	    lane[l].blocks -= n;
+	    if(lane[l].blocks>0 || lane[l].next_part()) continue;
+
+	    uint8_t digest[32];
+	    for(unsigned int w=0;w<words;w++){
+		uint32_t v = state[w*lanes+l];
+		for(int i=0;i<4;i++){
+		    digest[4*w + (big_endian ? 3-i : i)] = (uint8_t)(v >> (8*i));
+		}
+	    }
+	    dest[lane[l].msg]->set(alg,digest);
+
+	    lane[l].msg = count;
+	    if(next<count){
+		lane[l].start(next,data[next],len[next],big_endian);
+		for(unsigned int w=0;w<words;w++) state[w*lanes+l] = iv[w];
+		next++;
+	    } else {
+		active--;
+	    }
+	}
+    }
+}
+
+
+#ifdef HAVE_LANE_KERNELS
+/****************************************************************
+ *** The kernels
+ ***
+ *** The rounds are written once, with V_ operations on vectors of
+ *** 32-bit words, which are defined for AVX2 and then for AVX-512.
+ *** The state is the first word of every lane, then the second...
+ *** w[i] holds word i of each lane's block.
+ ****************************************************************/
+
+#define V_ROR(x,n)	V_ROL(x,32-(n))
+
+#define MD5_STEP(f,a,b,c,d,x,k,s) \
+    a = V_ADD(b,V_ROL(V_ADD(V_ADD(a,f(b,c,d)),V_ADD(x,V_SET1(k))),s))
+
+#define MD5_ROUNDS                                       \
+    MD5_STEP( V_F, a, b, c, d, w[ 0], 0xD76AA478,  7 );  \
+    MD5_STEP( V_F, d, a, b, c, w[ 1], 0xE8C7B756, 12 );  \
+    MD5_STEP( V_F, c, d, a, b, w[ 2], 0x242070DB, 17 );  \
+    MD5_STEP( V_F, b, c, d, a, w[ 3], 0xC1BDCEEE, 22 );  \
+    MD5_STEP( V_F, a, b, c, d, w[ 4], 0xF57C0FAF,  7 );  \
+    MD5_STEP( V_F, d, a, b, c, w[ 5], 0x4787C62A, 12 );  \
+    MD5_STEP( V_F, c, d, a, b, w[ 6], 0xA8304613, 17 );  \
+    MD5_STEP( V_F, b, c, d, a, w[ 7], 0xFD469501, 22 );  \
+    MD5_STEP( V_F, a, b, c, d, w[ 8], 0x698098D8,  7 );  \
+    MD5_STEP( V_F, d, a, b, c, w[ 9], 0x8B44F7AF, 12 );  \
+    MD5_STEP( V_F, c, d, a, b, w[10], 0xFFFF5BB1, 17 );  \
+    MD5_STEP( V_F, b, c, d, a, w[11], 0x895CD7BE, 22 );  \
+    MD5_STEP( V_F, a, b, c, d, w[12], 0x6B901122,  7 );  \
+    MD5_STEP( V_F, d, a, b, c, w[13], 0xFD987193, 12 );  \
+    MD5_STEP( V_F, c, d, a, b, w[14], 0xA679438E, 17 );  \
+    MD5_STEP( V_F, b, c, d, a, w[15], 0x49B40821, 22 );  \
+    MD5_STEP( V_G, a, b, c, d, w[ 1], 0xF61E2562,  5 );  \
+    MD5_STEP( V_G, d, a, b, c, w[ 6], 0xC040B340,  9 );  \
+    MD5_STEP( V_G, c, d, a, b, w[11], 0x265E5A51, 14 );  \
+    MD5_STEP( V_G, b, c, d, a, w[ 0], 0xE9B6C7AA, 20 );  \
+    MD5_STEP( V_G, a, b, c, d, w[ 5], 0xD62F105D,  5 );  \
+    MD5_STEP( V_G, d, a, b, c, w[10], 0x02441453,  9 );  \
+    MD5_STEP( V_G, c, d, a, b, w[15], 0xD8A1E681, 14 );  \
+    MD5_STEP( V_G, b, c, d, a, w[ 4], 0xE7D3FBC8, 20 );  \
+    MD5_STEP( V_G, a, b, c, d, w[ 9], 0x21E1CDE6,  5 );  \
+    MD5_STEP( V_G, d, a, b, c, w[14], 0xC33707D6,  9 );  \
+    MD5_STEP( V_G, c, d, a, b, w[ 3], 0xF4D50D87, 14 );  \
+    MD5_STEP( V_G, b, c, d, a, w[ 8], 0x455A14ED, 20 );  \
+    MD5_STEP( V_G, a, b, c, d, w[13], 0xA9E3E905,  5 );  \
+    MD5_STEP( V_G, d, a, b, c, w[ 2], 0xFCEFA3F8,  9 );  \
+    MD5_STEP( V_G, c, d, a, b, w[ 7], 0x676F02D9, 14 );  \
+    MD5_STEP( V_G, b, c, d, a, w[12], 0x8D2A4C8A, 20 );  \
+    MD5_STEP( V_H, a, b, c, d, w[ 5], 0xFFFA3942,  4 );  \
+    MD5_STEP( V_H, d, a, b, c, w[ 8], 0x8771F681, 11 );  \
+    MD5_STEP( V_H, c, d, a, b, w[11], 0x6D9D6122, 16 );  \
+    MD5_STEP( V_H, b, c, d, a, w[14], 0xFDE5380C, 23 );  \
+    MD5_STEP( V_H, a, b, c, d, w[ 1], 0xA4BEEA44,  4 );  \
+    MD5_STEP( V_H, d, a, b, c, w[ 4], 0x4BDECFA9, 11 );  \
+    MD5_STEP( V_H, c, d, a, b, w[ 7], 0xF6BB4B60, 16 );  \
+    MD5_STEP( V_H, b, c, d, a, w[10], 0xBEBFBC70, 23 );  \
+    MD5_STEP( V_H, a, b, c, d, w[13], 0x289B7EC6,  4 );  \
+    MD5_STEP( V_H, d, a, b, c, w[ 0], 0xEAA127FA, 11 );  \
+    MD5_STEP( V_H, c, d, a, b, w[ 3], 0xD4EF3085, 16 );  \
+    MD5_STEP( V_H, b, c, d, a, w[ 6], 0x04881D05, 23 );  \
+    MD5_STEP( V_H, a, b, c, d, w[ 9], 0xD9D4D039,  4 );  \
+    MD5_STEP( V_H, d, a, b, c, w[12], 0xE6DB99E5, 11 );  \
+    MD5_STEP( V_H, c, d, a, b, w[15], 0x1FA27CF8, 16 );  \
+    MD5_STEP( V_H, b, c, d, a, w[ 2], 0xC4AC5665, 23 );  \
+    MD5_STEP( V_I, a, b, c, d, w[ 0], 0xF4292244,  6 );  \
+    MD5_STEP( V_I, d, a, b, c, w[ 7], 0x432AFF97, 10 );  \
+    MD5_STEP( V_I, c, d, a, b, w[14], 0xAB9423A7, 15 );  \
+    MD5_STEP( V_I, b, c, d, a, w[ 5], 0xFC93A039, 21 );  \
+    MD5_STEP( V_I, a, b, c, d, w[12], 0x655B59C3,  6 );  \
+    MD5_STEP( V_I, d, a, b, c, w[ 3], 0x8F0CCC92, 10 );  \
+    MD5_STEP( V_I, c, d, a, b, w[10], 0xFFEFF47D, 15 );  \
+    MD5_STEP( V_I, b, c, d, a, w[ 1], 0x85845DD1, 21 );  \
+    MD5_STEP( V_I, a, b, c, d, w[ 8], 0x6FA87E4F,  6 );  \
+    MD5_STEP( V_I, d, a, b, c, w[15], 0xFE2CE6E0, 10 );  \
+    MD5_STEP( V_I, c, d, a, b, w[ 6], 0xA3014314, 15 );  \
+    MD5_STEP( V_I, b, c, d, a, w[13], 0x4E0811A1, 21 );  \
+    MD5_STEP( V_I, a, b, c, d, w[ 4], 0xF7537E82,  6 );  \
+    MD5_STEP( V_I, d, a, b, c, w[11], 0xBD3AF235, 10 );  \
+    MD5_STEP( V_I, c, d, a, b, w[ 2], 0x2AD7D2BB, 15 );  \
+    MD5_STEP( V_I, b, c, d, a, w[ 9], 0xEB86D391, 21 );
+
+#define SHA1_W(t) \
+    (w[(t)&15] = V_ROL(V_XOR(V_XOR3(w[((t)-3)&15],w[((t)-8)&15],w[((t)-14)&15]),w[(t)&15]),1))
+
+#define SHA1_STEP(f,a,b,c,d,e,x,k) \
+{ e = V_ADD(V_ADD(e,V_ROL(a,5)),V_ADD(f(b,c,d),V_ADD(x,V_SET1(k)))); b = V_ROL(b,30); }
+
+#define SHA1_ROUNDS                                              \
+    SHA1_STEP( V_CH  , a, b, c, d, e, w[ 0], 0x5A827999 );       \
+    SHA1_STEP( V_CH  , e, a, b, c, d, w[ 1], 0x5A827999 );       \
+    SHA1_STEP( V_CH  , d, e, a, b, c, w[ 2], 0x5A827999 );       \
+    SHA1_STEP( V_CH  , c, d, e, a, b, w[ 3], 0x5A827999 );       \
+    SHA1_STEP( V_CH  , b, c, d, e, a, w[ 4], 0x5A827999 );       \
+    SHA1_STEP( V_CH  , a, b, c, d, e, w[ 5], 0x5A827999 );       \
+    SHA1_STEP( V_CH  , e, a, b, c, d, w[ 6], 0x5A827999 );       \
+    SHA1_STEP( V_CH  , d, e, a, b, c, w[ 7], 0x5A827999 );       \
+    SHA1_STEP( V_CH  , c, d, e, a, b, w[ 8], 0x5A827999 );       \
+    SHA1_STEP( V_CH  , b, c, d, e, a, w[ 9], 0x5A827999 );       \
+    SHA1_STEP( V_CH  , a, b, c, d, e, w[10], 0x5A827999 );       \
+    SHA1_STEP( V_CH  , e, a, b, c, d, w[11], 0x5A827999 );       \
+    SHA1_STEP( V_CH  , d, e, a, b, c, w[12], 0x5A827999 );       \
+    SHA1_STEP( V_CH  , c, d, e, a, b, w[13], 0x5A827999 );       \
+    SHA1_STEP( V_CH  , b, c, d, e, a, w[14], 0x5A827999 );       \
+    SHA1_STEP( V_CH  , a, b, c, d, e, w[15], 0x5A827999 );       \
+    SHA1_STEP( V_CH  , e, a, b, c, d, SHA1_W(16), 0x5A827999 );  \
+    SHA1_STEP( V_CH  , d, e, a, b, c, SHA1_W(17), 0x5A827999 );  \
+    SHA1_STEP( V_CH  , c, d, e, a, b, SHA1_W(18), 0x5A827999 );  \
+    SHA1_STEP( V_CH  , b, c, d, e, a, SHA1_W(19), 0x5A827999 );  \
+    SHA1_STEP( V_XOR3, a, b, c, d, e, SHA1_W(20), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_XOR3, e, a, b, c, d, SHA1_W(21), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_XOR3, d, e, a, b, c, SHA1_W(22), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_XOR3, c, d, e, a, b, SHA1_W(23), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_XOR3, b, c, d, e, a, SHA1_W(24), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_XOR3, a, b, c, d, e, SHA1_W(25), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_XOR3, e, a, b, c, d, SHA1_W(26), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_XOR3, d, e, a, b, c, SHA1_W(27), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_XOR3, c, d, e, a, b, SHA1_W(28), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_XOR3, b, c, d, e, a, SHA1_W(29), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_XOR3, a, b, c, d, e, SHA1_W(30), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_XOR3, e, a, b, c, d, SHA1_W(31), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_XOR3, d, e, a, b, c, SHA1_W(32), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_XOR3, c, d, e, a, b, SHA1_W(33), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_XOR3, b, c, d, e, a, SHA1_W(34), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_XOR3, a, b, c, d, e, SHA1_W(35), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_XOR3, e, a, b, c, d, SHA1_W(36), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_XOR3, d, e, a, b, c, SHA1_W(37), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_XOR3, c, d, e, a, b, SHA1_W(38), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_XOR3, b, c, d, e, a, SHA1_W(39), 0x6ED9EBA1 );  \
+    SHA1_STEP( V_MAJ , a, b, c, d, e, SHA1_W(40), 0x8F1BBCDC );  \
+    SHA1_STEP( V_MAJ , e, a, b, c, d, SHA1_W(41), 0x8F1BBCDC );  \
+    SHA1_STEP( V_MAJ , d, e, a, b, c, SHA1_W(42), 0x8F1BBCDC );  \
+    SHA1_STEP( V_MAJ , c, d, e, a, b, SHA1_W(43), 0x8F1BBCDC );  \
+    SHA1_STEP( V_MAJ , b, c, d, e, a, SHA1_W(44), 0x8F1BBCDC );  \
+    SHA1_STEP( V_MAJ , a, b, c, d, e, SHA1_W(45), 0x8F1BBCDC );  \
+    SHA1_STEP( V_MAJ , e, a, b, c, d, SHA1_W(46), 0x8F1BBCDC );  \
+    SHA1_STEP( V_MAJ , d, e, a, b, c, SHA1_W(47), 0x8F1BBCDC );  \
+    SHA1_STEP( V_MAJ , c, d, e, a, b, SHA1_W(48), 0x8F1BBCDC );  \
+    SHA1_STEP( V_MAJ , b, c, d, e, a, SHA1_W(49), 0x8F1BBCDC );  \
+    SHA1_STEP( V_MAJ , a, b, c, d, e, SHA1_W(50), 0x8F1BBCDC );  \
+    SHA1_STEP( V_MAJ , e, a, b, c, d, SHA1_W(51), 0x8F1BBCDC );  \
+    SHA1_STEP( V_MAJ , d, e, a, b, c, SHA1_W(52), 0x8F1BBCDC );  \
+    SHA1_STEP( V_MAJ , c, d, e, a, b, SHA1_W(53), 0x8F1BBCDC );  \
+    SHA1_STEP( V_MAJ , b, c, d, e, a, SHA1_W(54), 0x8F1BBCDC );  \
+    SHA1_STEP( V_MAJ , a, b, c, d, e, SHA1_W(55), 0x8F1BBCDC );  \
+    SHA1_STEP( V_MAJ , e, a, b, c, d, SHA1_W(56), 0x8F1BBCDC );  \
+    SHA1_STEP( V_MAJ , d, e, a, b, c, SHA1_W(57), 0x8F1BBCDC );  \
+    SHA1_STEP( V_MAJ , c, d, e, a, b, SHA1_W(58), 0x8F1BBCDC );  \
+    SHA1_STEP( V_MAJ , b, c, d, e, a, SHA1_W(59), 0x8F1BBCDC );  \
+    SHA1_STEP( V_XOR3, a, b, c, d, e, SHA1_W(60), 0xCA62C1D6 );  \
+    SHA1_STEP( V_XOR3, e, a, b, c, d, SHA1_W(61), 0xCA62C1D6 );  \
+    SHA1_STEP( V_XOR3, d, e, a, b, c, SHA1_W(62), 0xCA62C1D6 );  \
+    SHA1_STEP( V_XOR3, c, d, e, a, b, SHA1_W(63), 0xCA62C1D6 );  \
+    SHA1_STEP( V_XOR3, b, c, d, e, a, SHA1_W(64), 0xCA62C1D6 );  \
+    SHA1_STEP( V_XOR3, a, b, c, d, e, SHA1_W(65), 0xCA62C1D6 );  \
+    SHA1_STEP( V_XOR3, e, a, b, c, d, SHA1_W(66), 0xCA62C1D6 );  \
+    SHA1_STEP( V_XOR3, d, e, a, b, c, SHA1_W(67), 0xCA62C1D6 );  \
+    SHA1_STEP( V_XOR3, c, d, e, a, b, SHA1_W(68), 0xCA62C1D6 );  \
+    SHA1_STEP( V_XOR3, b, c, d, e, a, SHA1_W(69), 0xCA62C1D6 );  \
+    SHA1_STEP( V_XOR3, a, b, c, d, e, SHA1_W(70), 0xCA62C1D6 );  \
+    SHA1_STEP( V_XOR3, e, a, b, c, d, SHA1_W(71), 0xCA62C1D6 );  \
+    SHA1_STEP( V_XOR3, d, e, a, b, c, SHA1_W(72), 0xCA62C1D6 );  \
+    SHA1_STEP( V_XOR3, c, d, e, a, b, SHA1_W(73), 0xCA62C1D6 );  \
+    SHA1_STEP( V_XOR3, b, c, d, e, a, SHA1_W(74), 0xCA62C1D6 );  \
+    SHA1_STEP( V_XOR3, a, b, c, d, e, SHA1_W(75), 0xCA62C1D6 );  \
+    SHA1_STEP( V_XOR3, e, a, b, c, d, SHA1_W(76), 0xCA62C1D6 );  \
+    SHA1_STEP( V_XOR3, d, e, a, b, c, SHA1_W(77), 0xCA62C1D6 );  \
+    SHA1_STEP( V_XOR3, c, d, e, a, b, SHA1_W(78), 0xCA62C1D6 );  \
+    SHA1_STEP( V_XOR3, b, c, d, e, a, SHA1_W(79), 0xCA62C1D6 );
+
+#define SHA256_S0(x) V_XOR3(V_ROR(x, 7),V_ROR(x,18),V_SHR(x, 3))
+#define SHA256_S1(x) V_XOR3(V_ROR(x,17),V_ROR(x,19),V_SHR(x,10))
+#define SHA256_S2(x) V_XOR3(V_ROR(x, 2),V_ROR(x,13),V_ROR(x,22))
+#define SHA256_S3(x) V_XOR3(V_ROR(x, 6),V_ROR(x,11),V_ROR(x,25))
+
+#define SHA256_W(t) \
+    (w[(t)&15] = V_ADD(V_ADD(SHA256_S1(w[((t)-2)&15]),w[((t)-7)&15]),V_ADD(SHA256_S0(w[((t)-15)&15]),w[(t)&15])))
+
+#define SHA256_STEP(a,b,c,d,e,f,g,h,x,k)				\
+{									\
+    V_T t1 = V_ADD(V_ADD(h,SHA256_S3(e)),V_ADD(V_CH(e,f,g),V_ADD(x,V_SET1(k)))); \
+    d = V_ADD(d,t1);							\
+    h = V_ADD(t1,V_ADD(SHA256_S2(a),V_MAJ(a,b,c)));			\
+}
+
+#define SHA256_ROUNDS                                                 \
+    SHA256_STEP( a, b, c, d, e, f, g, h, w[ 0], 0x428A2F98 );         \
+    SHA256_STEP( h, a, b, c, d, e, f, g, w[ 1], 0x71374491 );         \
+    SHA256_STEP( g, h, a, b, c, d, e, f, w[ 2], 0xB5C0FBCF );         \
+    SHA256_STEP( f, g, h, a, b, c, d, e, w[ 3], 0xE9B5DBA5 );         \
+    SHA256_STEP( e, f, g, h, a, b, c, d, w[ 4], 0x3956C25B );         \
+    SHA256_STEP( d, e, f, g, h, a, b, c, w[ 5], 0x59F111F1 );         \
+    SHA256_STEP( c, d, e, f, g, h, a, b, w[ 6], 0x923F82A4 );         \
+    SHA256_STEP( b, c, d, e, f, g, h, a, w[ 7], 0xAB1C5ED5 );         \
+    SHA256_STEP( a, b, c, d, e, f, g, h, w[ 8], 0xD807AA98 );         \
+    SHA256_STEP( h, a, b, c, d, e, f, g, w[ 9], 0x12835B01 );         \
+    SHA256_STEP( g, h, a, b, c, d, e, f, w[10], 0x243185BE );         \
+    SHA256_STEP( f, g, h, a, b, c, d, e, w[11], 0x550C7DC3 );         \
+    SHA256_STEP( e, f, g, h, a, b, c, d, w[12], 0x72BE5D74 );         \
+    SHA256_STEP( d, e, f, g, h, a, b, c, w[13], 0x80DEB1FE );         \
+    SHA256_STEP( c, d, e, f, g, h, a, b, w[14], 0x9BDC06A7 );         \
+    SHA256_STEP( b, c, d, e, f, g, h, a, w[15], 0xC19BF174 );         \
+    SHA256_STEP( a, b, c, d, e, f, g, h, SHA256_W(16), 0xE49B69C1 );  \
+    SHA256_STEP( h, a, b, c, d, e, f, g, SHA256_W(17), 0xEFBE4786 );  \
+    SHA256_STEP( g, h, a, b, c, d, e, f, SHA256_W(18), 0x0FC19DC6 );  \
+    SHA256_STEP( f, g, h, a, b, c, d, e, SHA256_W(19), 0x240CA1CC );  \
+    SHA256_STEP( e, f, g, h, a, b, c, d, SHA256_W(20), 0x2DE92C6F );  \
+    SHA256_STEP( d, e, f, g, h, a, b, c, SHA256_W(21), 0x4A7484AA );  \
+    SHA256_STEP( c, d, e, f, g, h, a, b, SHA256_W(22), 0x5CB0A9DC );  \
+    SHA256_STEP( b, c, d, e, f, g, h, a, SHA256_W(23), 0x76F988DA );  \
+    SHA256_STEP( a, b, c, d, e, f, g, h, SHA256_W(24), 0x983E5152 );  \
+    SHA256_STEP( h, a, b, c, d, e, f, g, SHA256_W(25), 0xA831C66D );  \
+    SHA256_STEP( g, h, a, b, c, d, e, f, SHA256_W(26), 0xB00327C8 );  \
+    SHA256_STEP( f, g, h, a, b, c, d, e, SHA256_W(27), 0xBF597FC7 );  \
+    SHA256_STEP( e, f, g, h, a, b, c, d, SHA256_W(28), 0xC6E00BF3 );  \
+    SHA256_STEP( d, e, f, g, h, a, b, c, SHA256_W(29), 0xD5A79147 );  \
+    SHA256_STEP( c, d, e, f, g, h, a, b, SHA256_W(30), 0x06CA6351 );  \
+    SHA256_STEP( b, c, d, e, f, g, h, a, SHA256_W(31), 0x14292967 );  \
+    SHA256_STEP( a, b, c, d, e, f, g, h, SHA256_W(32), 0x27B70A85 );  \
+    SHA256_STEP( h, a, b, c, d, e, f, g, SHA256_W(33), 0x2E1B2138 );  \
+    SHA256_STEP( g, h, a, b, c, d, e, f, SHA256_W(34), 0x4D2C6DFC );  \
+    SHA256_STEP( f, g, h, a, b, c, d, e, SHA256_W(35), 0x53380D13 );  \
+    SHA256_STEP( e, f, g, h, a, b, c, d, SHA256_W(36), 0x650A7354 );  \
+    SHA256_STEP( d, e, f, g, h, a, b, c, SHA256_W(37), 0x766A0ABB );  \
+    SHA256_STEP( c, d, e, f, g, h, a, b, SHA256_W(38), 0x81C2C92E );  \
+    SHA256_STEP( b, c, d, e, f, g, h, a, SHA256_W(39), 0x92722C85 );  \
+    SHA256_STEP( a, b, c, d, e, f, g, h, SHA256_W(40), 0xA2BFE8A1 );  \
+    SHA256_STEP( h, a, b, c, d, e, f, g, SHA256_W(41), 0xA81A664B );  \
+    SHA256_STEP( g, h, a, b, c, d, e, f, SHA256_W(42), 0xC24B8B70 );  \
+    SHA256_STEP( f, g, h, a, b, c, d, e, SHA256_W(43), 0xC76C51A3 );  \
+    SHA256_STEP( e, f, g, h, a, b, c, d, SHA256_W(44), 0xD192E819 );  \
+    SHA256_STEP( d, e, f, g, h, a, b, c, SHA256_W(45), 0xD6990624 );  \
+    SHA256_STEP( c, d, e, f, g, h, a, b, SHA256_W(46), 0xF40E3585 );  \
+    SHA256_STEP( b, c, d, e, f, g, h, a, SHA256_W(47), 0x106AA070 );  \
+    SHA256_STEP( a, b, c, d, e, f, g, h, SHA256_W(48), 0x19A4C116 );  \
+    SHA256_STEP( h, a, b, c, d, e, f, g, SHA256_W(49), 0x1E376C08 );  \
+    SHA256_STEP( g, h, a, b, c, d, e, f, SHA256_W(50), 0x2748774C );  \
+    SHA256_STEP( f, g, h, a, b, c, d, e, SHA256_W(51), 0x34B0BCB5 );  \
+    SHA256_STEP( e, f, g, h, a, b, c, d, SHA256_W(52), 0x391C0CB3 );  \
+    SHA256_STEP( d, e, f, g, h, a, b, c, SHA256_W(53), 0x4ED8AA4A );  \
+    SHA256_STEP( c, d, e, f, g, h, a, b, SHA256_W(54), 0x5B9CCA4F );  \
+    SHA256_STEP( b, c, d, e, f, g, h, a, SHA256_W(55), 0x682E6FF3 );  \
+    SHA256_STEP( a, b, c, d, e, f, g, h, SHA256_W(56), 0x748F82EE );  \
+    SHA256_STEP( h, a, b, c, d, e, f, g, SHA256_W(57), 0x78A5636F );  \
+    SHA256_STEP( g, h, a, b, c, d, e, f, SHA256_W(58), 0x84C87814 );  \
+    SHA256_STEP( f, g, h, a, b, c, d, e, SHA256_W(59), 0x8CC70208 );  \
+    SHA256_STEP( e, f, g, h, a, b, c, d, SHA256_W(60), 0x90BEFFFA );  \
+    SHA256_STEP( d, e, f, g, h, a, b, c, SHA256_W(61), 0xA4506CEB );  \
+    SHA256_STEP( c, d, e, f, g, h, a, b, SHA256_W(62), 0xBEF9A3F7 );  \
+    SHA256_STEP( b, c, d, e, f, g, h, a, SHA256_W(63), 0xC67178F2 );
+
+/*
+ * Load the next block of 8 lanes into w, a word of every lane in each,
+ * and advance data. The SHAs are big-endian, so their bytes are swapped.
+ */
+__attribute__((target("avx2")))
+static inline void lane_words_avx2(__m256i w[16],const unsigned char **data,bool big_endian)
+{
+    const __m256i swap = _mm256_set_epi8(12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3,
+					 12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3);
+    for(int half=0;half<2;half++){
+	__m256i r[8], t[8];
+	for(int l=0;l<8;l++){
+	    r[l] = _mm256_loadu_si256((const __m256i *)(data[l] + 32*half));
+	    if(big_endian) r[l] = _mm256_shuffle_epi8(r[l],swap);
+	}
+	for(int l=0;l<8;l+=2){		// pairs of words from pairs of lanes
+	    t[l]   = _mm256_unpacklo_epi32(r[l],r[l+1]);
+	    t[l+1] = _mm256_unpackhi_epi32(r[l],r[l+1]);
+	}
+	for(int l=0;l<8;l+=4){		// then from four lanes
+	    r[l]   = _mm256_unpacklo_epi64(t[l],  t[l+2]);
+	    r[l+1] = _mm256_unpackhi_epi64(t[l],  t[l+2]);
+	    r[l+2] = _mm256_unpacklo_epi64(t[l+1],t[l+3]);
+	    r[l+3] = _mm256_unpackhi_epi64(t[l+1],t[l+3]);
+	}
+	for(int i=0;i<4;i++){		// then from all eight
+	    w[8*half+i]   = _mm256_permute2x128_si256(r[i],r[i+4],0x20);
+	    w[8*half+i+4] = _mm256_permute2x128_si256(r[i],r[i+4],0x31);
+	}
+    }
+    for(int l=0;l<8;l++) data[l] += 64;
+}
+
+/* AVX2 has no rotate or three-way logic, so they take a few instructions */
+#define V_T		__m256i
+#define V_LOAD(p)	_mm256_loadu_si256((const __m256i *)(p))
+#define V_STORE(p,x)	_mm256_storeu_si256((__m256i *)(p),x)
+#define V_SET1(k)	_mm256_set1_epi32((int)(k))
+#define V_ADD(a,b)	_mm256_add_epi32(a,b)
+#define V_XOR(a,b)	_mm256_xor_si256(a,b)
+#define V_XOR3(a,b,c)	V_XOR(V_XOR(a,b),c)
+#define V_ROL(x,n)	_mm256_or_si256(_mm256_slli_epi32(x,n),_mm256_srli_epi32(x,32-(n)))
+#define V_SHR(x,n)	_mm256_srli_epi32(x,n)
+#define V_CH(b,c,d)	V_XOR(d,_mm256_and_si256(b,V_XOR(c,d)))		/* b ? c : d */
+#define V_F(b,c,d)	V_CH(b,c,d)
+#define V_G(b,c,d)	V_CH(d,b,c)
+#define V_H(b,c,d)	V_XOR3(b,c,d)
+#define V_I(b,c,d)	V_XOR(c,_mm256_or_si256(b,V_XOR(d,_mm256_set1_epi32(-1))))
+#define V_MAJ(a,b,c)	_mm256_or_si256(_mm256_and_si256(a,b),_mm256_and_si256(c,_mm256_or_si256(a,b)))
+
+__attribute__((target("avx2")))
+static void md5_lanes_avx2(uint32_t *state,const unsigned char **data,size_t blocks)
+{
+    V_T a = V_LOAD(state+0), b = V_LOAD(state+8), c = V_LOAD(state+16), d = V_LOAD(state+24);
+    V_T w[16];
+
+    while(blocks--){
+	V_T a0 = a, b0 = b, c0 = c, d0 = d;
+	lane_words_avx2(w,data,false);
+	MD5_ROUNDS;
+	a = V_ADD(a,a0);
+	b = V_ADD(b,b0);
+	c = V_ADD(c,c0);
+	d = V_ADD(d,d0);
+    }
+    V_STORE(state+0,a);
+    V_STORE(state+8,b);
+    V_STORE(state+16,c);
+    V_STORE(state+24,d);
+}
+
+__attribute__((target("avx2")))
+static void sha1_lanes_avx2(uint32_t *state,const unsigned char **data,size_t blocks)
+{
+    V_T a = V_LOAD(state+0), b = V_LOAD(state+8), c = V_LOAD(state+16), d = V_LOAD(state+24), e = V_LOAD(state+32);
+    V_T w[16];
+
+    while(blocks--){
+	V_T a0 = a, b0 = b, c0 = c, d0 = d, e0 = e;
+	lane_words_avx2(w,data,true);
+	SHA1_ROUNDS;
+	a = V_ADD(a,a0);
+	b = V_ADD(b,b0);
+	c = V_ADD(c,c0);
+	d = V_ADD(d,d0);
+	e = V_ADD(e,e0);
+    }
+    V_STORE(state+0,a);
+    V_STORE(state+8,b);
+    V_STORE(state+16,c);
+    V_STORE(state+24,d);
+    V_STORE(state+32,e);
+}
+
+__attribute__((target("avx2")))
+static void sha256_lanes_avx2(uint32_t *state,const unsigned char **data,size_t blocks)
+{
+    V_T a = V_LOAD(state+0), b = V_LOAD(state+8), c = V_LOAD(state+16), d = V_LOAD(state+24), e = V_LOAD(state+32), f = V_LOAD(state+40), g = V_LOAD(state+48), h = V_LOAD(state+56);
+    V_T w[16];
+
+    while(blocks--){
+	V_T a0 = a, b0 = b, c0 = c, d0 = d, e0 = e, f0 = f, g0 = g, h0 = h;
+	lane_words_avx2(w,data,true);
+	SHA256_ROUNDS;
+	a = V_ADD(a,a0);
+	b = V_ADD(b,b0);
+	c = V_ADD(c,c0);
+	d = V_ADD(d,d0);
+	e = V_ADD(e,e0);
+	f = V_ADD(f,f0);
+	g = V_ADD(g,g0);
+	h = V_ADD(h,h0);
+    }
+    V_STORE(state+0,a);
+    V_STORE(state+8,b);
+    V_STORE(state+16,c);
+    V_STORE(state+24,d);
+    V_STORE(state+32,e);
+    V_STORE(state+40,f);
+    V_STORE(state+48,g);
+    V_STORE(state+56,h);
+}
+
+#undef V_T
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_XOR
+#undef V_XOR3
+#undef V_ROL
+#undef V_SHR
+#undef V_CH
+#undef V_F
+#undef V_G
+#undef V_H
+#undef V_I
+#undef V_MAJ
+
+/* The same for 16 lanes: lanes 0-7 go in the low half, and 8-15 in the high */
+__attribute__((target("avx512f,avx512bw")))
+static inline void lane_words_avx512(__m512i w[16],const unsigned char **data,bool big_endian)
+{
+    __m256i lo[16], hi[16];
+    lane_words_avx2(lo,data,big_endian);
+    lane_words_avx2(hi,data+8,big_endian);
+    for(int i=0;i<16;i++){
+	w[i] = _mm512_maskz_inserti64x4(0xFF,_mm512_castsi256_si512(lo[i]),hi[i],1);
+    }
+}
+
+/*
+ * AVX-512 can rotate, and does any function of three words in one instruction.
+ * The maskz forms with every lane set are the same instructions; gcc 12 warns
+ * about the undefined source that the unmasked forms give the builtins.
+ */
+#define V_T		__m512i
+#define V_LOAD(p)	_mm512_loadu_si512((const void *)(p))
+#define V_STORE(p,x)	_mm512_storeu_si512((void *)(p),x)
+#define V_SET1(k)	_mm512_set1_epi32((int)(k))
+#define V_ADD(a,b)	_mm512_add_epi32(a,b)
+#define V_XOR(a,b)	_mm512_xor_si512(a,b)
+#define V_XOR3(a,b,c)	_mm512_ternarylogic_epi32(a,b,c,0x96)
+#define V_ROL(x,n)	_mm512_maskz_rol_epi32(0xFFFF,x,n)
+#define V_SHR(x,n)	_mm512_maskz_srli_epi32(0xFFFF,x,n)
+#define V_CH(b,c,d)	_mm512_ternarylogic_epi32(b,c,d,0xCA)
+#define V_F(b,c,d)	V_CH(b,c,d)
+#define V_G(b,c,d)	_mm512_ternarylogic_epi32(b,c,d,0xE4)
+#define V_H(b,c,d)	V_XOR3(b,c,d)
+#define V_I(b,c,d)	_mm512_ternarylogic_epi32(b,c,d,0x39)
+#define V_MAJ(a,b,c)	_mm512_ternarylogic_epi32(a,b,c,0xE8)
+
+__attribute__((target("avx512f,avx512bw")))
+static void md5_lanes_avx512(uint32_t *state,const unsigned char **data,size_t blocks)
+{
+    V_T a = V_LOAD(state+0), b = V_LOAD(state+16), c = V_LOAD(state+32), d = V_LOAD(state+48);
+    V_T w[16];
+
+    while(blocks--){
+	V_T a0 = a, b0 = b, c0 = c, d0 = d;
+	lane_words_avx512(w,data,false);
+	MD5_ROUNDS;
+	a = V_ADD(a,a0);
+	b = V_ADD(b,b0);
+	c = V_ADD(c,c0);
+	d = V_ADD(d,d0);
+    }
+    V_STORE(state+0,a);
+    V_STORE(state+16,b);
+    V_STORE(state+32,c);
+    V_STORE(state+48,d);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void sha1_lanes_avx512(uint32_t *state,const unsigned char **data,size_t blocks)
+{
+    V_T a = V_LOAD(state+0), b = V_LOAD(state+16), c = V_LOAD(state+32), d = V_LOAD(state+48), e = V_LOAD(state+64);
+    V_T w[16];
+
+    while(blocks--){
+	V_T a0 = a, b0 = b, c0 = c, d0 = d, e0 = e;
+	lane_words_avx512(w,data,true);
+	SHA1_ROUNDS;
+	a = V_ADD(a,a0);
+	b = V_ADD(b,b0);
+	c = V_ADD(c,c0);
+	d = V_ADD(d,d0);
+	e = V_ADD(e,e0);
+    }
+    V_STORE(state+0,a);
+    V_STORE(state+16,b);
+    V_STORE(state+32,c);
+    V_STORE(state+48,d);
+    V_STORE(state+64,e);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void sha256_lanes_avx512(uint32_t *state,const unsigned char **data,size_t blocks)
+{
+    V_T a = V_LOAD(state+0), b = V_LOAD(state+16), c = V_LOAD(state+32), d = V_LOAD(state+48), e = V_LOAD(state+64), f = V_LOAD(state+80), g = V_LOAD(state+96), h = V_LOAD(state+112);
+    V_T w[16];
+
+    while(blocks--){
+	V_T a0 = a, b0 = b, c0 = c, d0 = d, e0 = e, f0 = f, g0 = g, h0 = h;
+	lane_words_avx512(w,data,true);
+	SHA256_ROUNDS;
+	a = V_ADD(a,a0);
+	b = V_ADD(b,b0);
+	c = V_ADD(c,c0);
+	d = V_ADD(d,d0);
+	e = V_ADD(e,e0);
+	f = V_ADD(f,f0);
+	g = V_ADD(g,g0);
+	h = V_ADD(h,h0);
+    }
+    V_STORE(state+0,a);
+    V_STORE(state+16,b);
+    V_STORE(state+32,c);
+    V_STORE(state+48,d);
+    V_STORE(state+64,e);
+    V_STORE(state+80,f);
+    V_STORE(state+96,g);
+    V_STORE(state+112,h);
+}
+
+#undef V_T
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_XOR
+#undef V_XOR3
+#undef V_ROL
+#undef V_SHR
+#undef V_CH
+#undef V_F
+#undef V_G
+#undef V_H
+#undef V_I
+#undef V_MAJ
+#endif
+
+
+/*
+ * Add the lane kernels this compiler could build; load_hashing_algorithms
+ * calls this. choose_kernels picks the widest one the processor can run.
+ * Eight lanes of SHA-256 are slower than the SHA extensions (see -T kernels).
+ */
+void algorithm_t::load_lane_kernels()
+{
+#ifdef HAVE_LANE_KERNELS
+    add_lane_kernel(alg_md5,    "avx2",   CPU_AVX2,   0,        8, md5_lanes_avx2);
+    add_lane_kernel(alg_sha1,   "avx2",   CPU_AVX2,   0,        8, sha1_lanes_avx2);
+    add_lane_kernel(alg_sha256, "avx2",   CPU_AVX2,   CPU_SHA,  8, sha256_lanes_avx2);
+    add_lane_kernel(alg_md5,    "avx512", CPU_AVX512, 0,       16, md5_lanes_avx512);
+    add_lane_kernel(alg_sha1,   "avx512", CPU_AVX512, 0,       16, sha1_lanes_avx512);
+    add_lane_kernel(alg_sha256, "avx512", CPU_AVX512, 0,       16, sha256_lanes_avx512);
+#endif
+}
@@ -1,5 +1,9 @@
 #include "main.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 void hash_context_obj::multihash_initialize()
 {
   for (int i = 0 ; i < NUM_ALGORITHMS ; ++i)    {
@@ -25,28 +29,339 @@ void hash_context_obj::multihash_update(const unsigned char *buf, size_t len)
 }
 
 
+void hash_context_obj::multihash_update(hashid_t alg,const unsigned char *buf, size_t len)
+{
+    hashes[alg].f_update(this->hash_context[alg],buf,len);
+}
+
+
 /**
- * multihash_finalizes finalizes each algorithm and converts to hex.
- * Only the hex is preserved.
+ * multihash_finalizes finalizes each algorithm in use and saves its digest.
  */
-void hash_context_obj::multihash_finalize(std::string dest[])
+void hash_context_obj::multihash_finalize(hash_digests &dest)
 {
-    uint16_t j;
-    static char hex[] = "0123456789abcdef";
-    
+    dest.clear();
     for (int i = 0 ; i < NUM_ALGORITHMS ; ++i) {
-	dest[i]="";
 	if (hashes[i].inuse) {
-	    /* Calculate the residue and convert to hex */
 	    uint8_t residue[MAX_ALGORITHM_RESIDUE_SIZE];
 	    hashes[i].f_finalize(this->hash_context[i], residue);
-	    for (j = 0; j < hashes[i].bit_length/8 ; j++) {
-		dest[i].push_back(hex[(residue[j] >> 4) & 0xf]);
-		dest[i].push_back(hex[residue[j] & 0xf]);
+	    dest.set(i,residue);
+	}
+    }
+}
+
+
+/****************************************************************
+ *** Hex
+ ***
+ *** Digests are kept in binary, so hex is made when a hash is written
+ *** and read when a file of known hashes is loaded. With SSE2, which
+ *** every x86-64 has, 16 bytes are done at a time; the table does
+ *** whatever is left, and everything on other processors.
+ ****************************************************************/
+
+static const char hex_chars[] = "0123456789abcdef";
+
+/* The value of each hex character, and -1 for everything else */
+static const signed char hex_values[256] = {
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+     0, 1, 2, 3, 4, 5, 6, 7, 8, 9,-1,-1,-1,-1,-1,-1,
+    -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
+};
+
+#ifdef __SSE2__
+/* 16 nibbles to their lowercase hex characters */
+static inline __m128i hex_nibbles_to_chars(__m128i n)
+{
+    __m128i letters = _mm_cmpgt_epi8(n,_mm_set1_epi8(9));
+    return _mm_add_epi8(_mm_add_epi8(n,_mm_set1_epi8('0')),
+			_mm_and_si128(letters,_mm_set1_epi8('a'-'0'-10)));
+}
+
+/*
+ * 16 characters to their values. The compares are signed, but a
+ * character above 0x7f can't wrap around into either range.
+ * Returns a mask with a bit for each character that isn't hex.
+ */
+static inline int hex_chars_to_nibbles(__m128i c,__m128i *n)
+{
+    __m128i digit  = _mm_sub_epi8(c,_mm_set1_epi8('0'));
+    __m128i letter = _mm_sub_epi8(_mm_or_si128(c,_mm_set1_epi8(0x20)),_mm_set1_epi8('a'));
+    __m128i is_digit  = _mm_and_si128(_mm_cmpgt_epi8(digit,_mm_set1_epi8(-1)),
+				      _mm_cmplt_epi8(digit,_mm_set1_epi8(10)));
+    __m128i is_letter = _mm_and_si128(_mm_cmpgt_epi8(letter,_mm_set1_epi8(-1)),
+				      _mm_cmplt_epi8(letter,_mm_set1_epi8(6)));
+    *n = _mm_or_si128(_mm_and_si128(is_digit,digit),
+		      _mm_and_si128(is_letter,_mm_add_epi8(letter,_mm_set1_epi8(10))));
+    return ~_mm_movemask_epi8(_mm_or_si128(is_digit,is_letter)) & 0xffff;
+}
+
+/* The pairs of nibbles in each 16-bit lane to a byte in its low half */
+static inline __m128i hex_pairs_to_bytes(__m128i n)
+{
+    __m128i hi = _mm_and_si128(n,_mm_set1_epi16(0x00ff));
+    __m128i lo = _mm_srli_epi16(n,8);
+    return _mm_or_si128(_mm_slli_epi16(hi,4),lo);
+}
+#endif
+
+/* The table alone; the SSE2 code leaves the ends to these */
+void hex_encode_portable(const uint8_t *bin,size_t len,char *hex)
+{
+    for (size_t i = 0; i < len; i++) {
+	hex[i*2]   = hex_chars[bin[i] >> 4];
+	hex[i*2+1] = hex_chars[bin[i] & 0xf];
+    }
+}
+
+bool hex_decode_portable(const char *hex,size_t len,uint8_t *bin)
+{
+    if (len & 1) return false;
+    for (size_t i = 0; i < len; i += 2) {
+	int hi = hex_values[(unsigned char)hex[i]];
+	int lo = hex_values[(unsigned char)hex[i+1]];
+	if (hi<0 || lo<0) return false;
+	bin[i/2] = (uint8_t)((hi<<4) | lo);
+    }
+    return true;
+}
+
+bool hex_valid_portable(const char *hex,size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+	if (hex_values[(unsigned char)hex[i]] < 0) return false;
+    }
+    return true;
+}
+
+void hex_encode(const uint8_t *bin,size_t len,char *hex)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i+16 <= len; i += 16) {
+	__m128i v  = _mm_loadu_si128((const __m128i *)(bin+i));
+	__m128i hi = hex_nibbles_to_chars(_mm_and_si128(_mm_srli_epi16(v,4),_mm_set1_epi8(0x0f)));
+	__m128i lo = hex_nibbles_to_chars(_mm_and_si128(v,_mm_set1_epi8(0x0f)));
+	_mm_storeu_si128((__m128i *)(hex+i*2),   _mm_unpacklo_epi8(hi,lo));
+	_mm_storeu_si128((__m128i *)(hex+i*2+16),_mm_unpackhi_epi8(hi,lo));
+    }
+#endif
+    hex_encode_portable(bin+i,len-i,hex+i*2);
+}
+
+bool hex_decode(const char *hex,size_t len,uint8_t *bin)
+{
+    size_t i = 0;
+    if (len & 1) return false;
+#ifdef __SSE2__
+    for (; i+32 <= len; i += 32) {
+	__m128i a, b;
+	int bad = hex_chars_to_nibbles(_mm_loadu_si128((const __m128i *)(hex+i)),&a)
+	    | hex_chars_to_nibbles(_mm_loadu_si128((const __m128i *)(hex+i+16)),&b);
+	if (bad) return false;
+	_mm_storeu_si128((__m128i *)(bin+i/2),
+			 _mm_packus_epi16(hex_pairs_to_bytes(a),hex_pairs_to_bytes(b)));
+    }
+#endif
+    return hex_decode_portable(hex+i,len-i,bin+i/2);
+}
+
+bool hex_valid(const char *hex,size_t len)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i+16 <= len; i += 16) {
+	__m128i n;
+	if (hex_chars_to_nibbles(_mm_loadu_si128((const __m128i *)(hex+i)),&n)) return false;
+    }
+#endif
+    return hex_valid_portable(hex+i,len-i);
+}
+
+
+/****************************************************************
+ *** hash_digests
+ ****************************************************************/
+
+const size_t hash_digests::offsets[NUM_ALGORITHMS+1] = {
+    0,					// md5
+    16,					// sha1
+    16+20,				// sha256
+    16+20+32,				// tiger
+    16+20+32+24,			// whirlpool
+    16+20+32+24+64,			// sha3
+    DIGEST_SPACE
+};
+
+void hash_digests::set(int alg,const uint8_t *digest)
+{
+    memcpy(bytes+offsets[alg],digest,size(alg));
+    present |= (1<<alg);
+}
+
+bool hash_digests::set_hex(int alg,const std::string &hex)
+{
+    return set_hex(alg,hex.data(),hex.size());
+}
+
+bool hash_digests::set_hex(int alg,const char *hex,size_t hexlen)
+{
+    size_t len = size(alg);
+    if (len==0 || hexlen!=len*2) return false;
+    if (!hex_decode(hex,hexlen,bytes+offsets[alg])) {
+	present &= ~(1<<alg);		// we may have clobbered it
+	return false;
+    }
+    present |= (1<<alg);
+    return true;
+}
+
+std::string hash_digests::hex(int alg) const
+{
+    if (skipped) return std::string(size(alg)*2,'*');
+    if (!has(alg)) return std::string();
+    std::string ret(size(alg)*2,'0');
+    hex_encode(get(alg),size(alg),&ret[0]);
+    return ret;
+}
+
+
+/****************************************************************
+ *** Pipelined hashing with a thread for each algorithm.
+ ***
+ *** The reader (the thread in compute_hash) waits for the next slot
+ *** in the ring to be free, reads into it, and submits it with
+ *** pending set to the number of hashers. Each hasher works through
+ *** the slots in order, decrementing pending when it is done with one.
+ *** A slot is free again when pending reaches zero.
+ ****************************************************************/
+
+hash_pipeline::hash_pipeline():M(),TOREADER(),TOHASHER(),submitted(0),quit(false),hashers()
+{
+    pthread_cond_init(&TOREADER,NULL);
+    pthread_cond_init(&TOHASHER,NULL);
+}
+
+
+bool hash_pipeline::start(size_t block_size)
+{
+    for(unsigned int i=0;i<RING_SIZE;i++){
+	ring[i].buf = (unsigned char *)malloc_aligned(block_size);
+	if(ring[i].buf==0) return false;
+    }
+    for (int i = 0 ; i < NUM_ALGORITHMS ; ++i)  {
+	if (hashes[i].inuse)    {
+	    hasher *h = new hasher(this,(hashid_t)i);
+	    if(pthread_create(&h->thread,NULL,hash_pipeline::start_hasher,(void *)h)){
+		delete h;
+		return false;
 	    }
+	    hashers.push_back(h);
+	}
+    }
+    return true;
+}
+
+
+hash_pipeline::~hash_pipeline()
+{
+    M.lock();
+    quit = true;
+    pthread_cond_broadcast(&TOHASHER);
+    M.unlock();
+    for(std::vector<hasher *>::iterator it=hashers.begin();it!=hashers.end();it++){
+	pthread_join((*it)->thread,NULL);
+	delete *it;
+    }
+    for(unsigned int i=0;i<RING_SIZE;i++){
+	if(ring[i].buf) free_aligned(ring[i].buf);
+    }
+    pthread_cond_destroy(&TOREADER);
+    pthread_cond_destroy(&TOHASHER);
+}
+
+
+void *hash_pipeline::start_hasher(void *arg)
+{
+    hasher *h = (hasher *)arg;
+    h->p->run_hasher(h);
+    return 0;
+}
+
+
+void hash_pipeline::run_hasher(hasher *h)
+{
+    M.lock();
+    while(true){
+	while(h->done==submitted && quit==false){
+	    pthread_cond_wait(&TOHASHER,&M.mutex);
 	}
+	if(h->done==submitted) break;	// told to quit and nothing left to do
+	slot &s = ring[h->done % RING_SIZE];
+	M.unlock();
+
+	s.hc1->multihash_update(h->alg,s.data,s.len);
+	if(s.hc2) s.hc2->multihash_update(h->alg,s.data,s.len);
+
+	M.lock();
+	h->done++;
+	if(--s.pending==0) pthread_cond_broadcast(&TOREADER);
     }
+    M.unlock();
 }
 
 
+unsigned char *hash_pipeline::get_buffer()
+{
+    M.lock();
+    slot &s = ring[submitted % RING_SIZE];
+    while(s.pending>0){
+	pthread_cond_wait(&TOREADER,&M.mutex);
+    }
+    M.unlock();
+    return s.buf;
+}
+
 
+/* data must be the slot's buffer or memory that outlives the pipeline.
+ * The caller must have called get_buffer() first.
+ */
+void hash_pipeline::submit(const unsigned char *data,size_t len,hash_context_obj *hc1,hash_context_obj *hc2)
+{
+    M.lock();
+    slot &s = ring[submitted % RING_SIZE];
+    assert(s.pending==0);
+    s.data    = data;
+    s.len     = len;
+    s.hc1     = hc1;
+    s.hc2     = hc2;
+    s.pending = hashers.size();
+    submitted++;
+    pthread_cond_broadcast(&TOHASHER);
+    M.unlock();
+}
+
+
+void hash_pipeline::wait()
+{
+    M.lock();
+    for(unsigned int i=0;i<RING_SIZE;i++){
+	while(ring[i].pending>0){
+	    pthread_cond_wait(&TOREADER,&M.mutex);
+	}
+    }
+    M.unlock();
+}
@@ -33,8 +33,13 @@
 //#if defined(POLARSSL_SHA1_C)
 
 //#include "polarssl/sha1.h"
+#include "common.h"
 #include "sha1.h"			/* modified for md5deep */
 
+#ifdef HAVE_SHA_NI
+#include <immintrin.h>
+#endif
+
 #if defined(POLARSSL_FS_IO) || defined(POLARSSL_SELF_TEST)
 #include <stdio.h>
 #endif
@@ -233,10 +238,25 @@ static void sha1_process( sha1_context *ctx, const unsigned char data[64] )
     ctx->state[4] += E;
 }
 
+/*
+ * Run the compression function over some whole blocks
+ */
+typedef void (*sha1_blocks_t)( sha1_context *ctx, const unsigned char *data, size_t blocks );
+
+static void sha1_blocks( sha1_context *ctx, const unsigned char *data, size_t blocks )
+{
+    while( blocks-- )
+    {
+        sha1_process( ctx, data );
+        data += 64;
+    }
+}
+
 /*
  * SHA-1 process buffer
  */
-void sha1_update( sha1_context *ctx, const unsigned char *input, size_t ilen )
+static void sha1_update_with( sha1_context *ctx, const unsigned char *input, size_t ilen,
+                              sha1_blocks_t blocks )
 {
     size_t fill;
     unsigned long left;
@@ -257,17 +277,17 @@ void sha1_update( sha1_context *ctx, const unsigned char *input, size_t ilen )
     {
         memcpy( (void *) (ctx->buffer + left),
                 (const void *) input, fill );
-        sha1_process( ctx, ctx->buffer );
+        blocks( ctx, ctx->buffer, 1 );
         input += fill;
         ilen  -= fill;
         left = 0;
     }
 
-    while( ilen >= 64 )
+    if( ilen >= 64 )
     {
-        sha1_process( ctx, input );
-        input += 64;
-        ilen  -= 64;
+        blocks( ctx, input, ilen / 64 );
+        input += ilen & ~(size_t) 0x3F;
+        ilen  &= 0x3F;
     }
 
     if( ilen > 0 )
@@ -277,6 +297,11 @@ void sha1_update( sha1_context *ctx, const unsigned char *input, size_t ilen )
     }
 }
 
+void sha1_update( sha1_context *ctx, const unsigned char *input, size_t ilen )
+{
+    sha1_update_with( ctx, input, ilen, sha1_blocks );
+}
+
 static const unsigned char sha1_padding[64] =
 {
  0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
@@ -288,7 +313,7 @@ static const unsigned char sha1_padding[64] =
 /*
  * SHA-1 final digest
  */
-void sha1_finish( sha1_context *ctx, unsigned char output[20] )
+static void sha1_finish_with( sha1_context *ctx, unsigned char output[20], sha1_blocks_t blocks )
 {
     unsigned long last, padn;
     unsigned long high, low;
@@ -304,8 +329,8 @@ void sha1_finish( sha1_context *ctx, unsigned char output[20] )
     last = ctx->total[0] & 0x3F;
     padn = ( last < 56 ) ? ( 56 - last ) : ( 120 - last );
 
-    sha1_update( ctx, (const unsigned char *) sha1_padding, padn );
-    sha1_update( ctx, msglen, 8 );
+    sha1_update_with( ctx, (const unsigned char *) sha1_padding, padn, blocks );
+    sha1_update_with( ctx, msglen, 8, blocks );
 
     PUT_ULONG_BE( ctx->state[0], output,  0 );
     PUT_ULONG_BE( ctx->state[1], output,  4 );
@@ -314,6 +339,101 @@ void sha1_finish( sha1_context *ctx, unsigned char output[20] )
     PUT_ULONG_BE( ctx->state[4], output, 16 );
 }
 
+void sha1_finish( sha1_context *ctx, unsigned char output[20] )
+{
+    sha1_finish_with( ctx, output, sha1_blocks );
+}
+
+#ifdef HAVE_SHA_NI
+/*
+ * The compression function using the SHA extensions (SHA-NI); modified
+ * for md5deep. Each QUAD does four rounds with sha1rnds4, alternating
+ * between E0 and E1 for the fifth word, and works the message schedule
+ * a few words ahead in M0-M3. Only called when cpu_features() reports
+ * CPU_SHA and CPU_SSE41.
+ */
+#define QUAD(i,Ein,Eout,Mprev2,Mprev,Mi,Mnext)                         \
+{                                                                       \
+    if( (i) == 0 )                                                      \
+        Ein = _mm_add_epi32( Ein, Mi );                                 \
+    else                                                                \
+        Ein = _mm_sha1nexte_epu32( Ein, Mi );                           \
+    Eout = abcd;                                                        \
+    if( (i) >= 3 && (i) <= 18 )                                         \
+        Mnext = _mm_sha1msg2_epu32( Mnext, Mi );                        \
+    abcd = _mm_sha1rnds4_epu32( abcd, Ein, (i) / 5 );                   \
+    if( (i) >= 1 && (i) <= 16 )                                         \
+        Mprev = _mm_sha1msg1_epu32( Mprev, Mi );                        \
+    if( (i) >= 2 && (i) <= 17 )                                         \
+        Mprev2 = _mm_xor_si128( Mprev2, Mi );                           \
+}
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_blocks_shani( sha1_context *ctx, const unsigned char *data, size_t blocks )
+{
+    const __m128i swap = _mm_set_epi64x( 0x0001020304050607ULL, 0x08090A0B0C0D0E0FULL );
+    __m128i abcd, abcd_save, E0, E0_save, E1, M0, M1, M2, M3;
+
+    abcd = _mm_set_epi32( (int) ctx->state[0], (int) ctx->state[1],
+                          (int) ctx->state[2], (int) ctx->state[3] );
+    E0   = _mm_set_epi32( (int) ctx->state[4], 0, 0, 0 );
+
+    while( blocks-- )
+    {
+        abcd_save = abcd;
+        E0_save   = E0;
+
+        M0 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) (data +  0) ), swap );
+        M1 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) (data + 16) ), swap );
+        M2 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) (data + 32) ), swap );
+        M3 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) (data + 48) ), swap );
+
+        QUAD(  0, E0, E1, M2, M3, M0, M1 );
+        QUAD(  1, E1, E0, M3, M0, M1, M2 );
+        QUAD(  2, E0, E1, M0, M1, M2, M3 );
+        QUAD(  3, E1, E0, M1, M2, M3, M0 );
+        QUAD(  4, E0, E1, M2, M3, M0, M1 );
+        QUAD(  5, E1, E0, M3, M0, M1, M2 );
+        QUAD(  6, E0, E1, M0, M1, M2, M3 );
+        QUAD(  7, E1, E0, M1, M2, M3, M0 );
+        QUAD(  8, E0, E1, M2, M3, M0, M1 );
+        QUAD(  9, E1, E0, M3, M0, M1, M2 );
+        QUAD( 10, E0, E1, M0, M1, M2, M3 );
+        QUAD( 11, E1, E0, M1, M2, M3, M0 );
+        QUAD( 12, E0, E1, M2, M3, M0, M1 );
+        QUAD( 13, E1, E0, M3, M0, M1, M2 );
+        QUAD( 14, E0, E1, M0, M1, M2, M3 );
+        QUAD( 15, E1, E0, M1, M2, M3, M0 );
+        QUAD( 16, E0, E1, M2, M3, M0, M1 );
+        QUAD( 17, E1, E0, M3, M0, M1, M2 );
+        QUAD( 18, E0, E1, M0, M1, M2, M3 );
+        QUAD( 19, E1, E0, M1, M2, M3, M0 );
+
+        E0   = _mm_sha1nexte_epu32( E0, E0_save );
+        abcd = _mm_add_epi32( abcd, abcd_save );
+        data += 64;
+    }
+
+    ctx->state[0] = (uint32_t) _mm_extract_epi32( abcd, 3 );
+    ctx->state[1] = (uint32_t) _mm_extract_epi32( abcd, 2 );
+    ctx->state[2] = (uint32_t) _mm_extract_epi32( abcd, 1 );
+    ctx->state[3] = (uint32_t) _mm_extract_epi32( abcd, 0 );
+    ctx->state[4] = (uint32_t) _mm_extract_epi32( E0, 3 );
+}
+
+#undef QUAD
+
+void sha1_update_shani( sha1_context *ctx, const unsigned char *input, size_t ilen )
+{
+    sha1_update_with( ctx, input, ilen, sha1_blocks_shani );
+}
+
+void sha1_finish_shani( sha1_context *ctx, unsigned char output[20] )
+{
+    sha1_finish_with( ctx, output, sha1_blocks_shani );
+}
+#endif
+
 /*
  * output = SHA-1( input buffer )
  */
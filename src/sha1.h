@@ -71,6 +71,15 @@ void sha1_update( sha1_context *ctx, const unsigned char *input, size_t ilen );
  */
 void sha1_finish( sha1_context *ctx, unsigned char output[20] );
 
+#ifdef HAVE_SHA_NI
+/**
+ * \brief          sha1_update and sha1_finish using the x86 SHA
+ *                 extensions; modified for md5deep
+ */
+void sha1_update_shani( sha1_context *ctx, const unsigned char *input, size_t ilen );
+void sha1_finish_shani( sha1_context *ctx, unsigned char output[20] );
+#endif
+
 /**
  * \brief          Output = SHA-1( input buffer )
  *
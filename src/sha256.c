@@ -16,6 +16,17 @@
 #include <string.h>
 #include "sha256.h"
 
+#ifdef HAVE_SHA_NI
+#include <immintrin.h>
+#endif
+
+/* Runs the compression function over some whole blocks */
+typedef void (*sha256_blocks_t)( uint32_t state[8], const uint8_t *data, size_t blocks );
+
+static void sha256_blocks( uint32_t state[8], const uint8_t *data, size_t blocks );
+static void sha256_update_with( context_sha256_t *ctx, const uint8_t *input, uint32_t length,
+				sha256_blocks_t blocks );
+static void sha256_finish_with( context_sha256_t *ctx, uint8_t digest[32], sha256_blocks_t blocks );
 
 void hash_init_sha256(void * ctx)
 {
@@ -32,6 +43,20 @@ void hash_final_sha256(void * ctx, unsigned char *digest)
   sha256_finish((context_sha256_t *)ctx, digest);
 }
 
+#ifdef HAVE_SHA_NI
+static void sha256_blocks_shani( uint32_t state[8], const uint8_t *data, size_t blocks );
+
+void hash_update_sha256_shani(void * ctx, const unsigned char *buf, size_t len)
+{
+  sha256_update_with((context_sha256_t *)ctx,buf,(uint32_t) len,sha256_blocks_shani);
+}
+
+void hash_final_sha256_shani(void * ctx, unsigned char *digest)
+{
+  sha256_finish_with((context_sha256_t *)ctx, digest, sha256_blocks_shani);
+}
+#endif
+
 
 
 #define GET_UINT32(n,b,i)                       \
@@ -65,8 +90,7 @@ void sha256_starts( context_sha256_t *ctx )
   ctx->state[7] = 0x5BE0CD19;
 }
 
-void sha256_process( context_sha256_t *ctx, const uint8_t data[64] );
-void sha256_process( context_sha256_t *ctx, const uint8_t data[64] )
+static void sha256_process( uint32_t state[8], const uint8_t data[64] )
 {
   uint32_t temp1, temp2, W[64];
   uint32_t A, B, C, D, E, F, G, H;
@@ -113,14 +137,14 @@ void sha256_process( context_sha256_t *ctx, const uint8_t data[64] )
     d += temp1; h = temp1 + temp2;              \
 }
 
-  A = ctx->state[0];
-  B = ctx->state[1];
-  C = ctx->state[2];
-  D = ctx->state[3];
-  E = ctx->state[4];
-  F = ctx->state[5];
-  G = ctx->state[6];
-  H = ctx->state[7];
+  A = state[0];
+  B = state[1];
+  C = state[2];
+  D = state[3];
+  E = state[4];
+  F = state[5];
+  G = state[6];
+  H = state[7];
 
   P( A, B, C, D, E, F, G, H, W[ 0], 0x428A2F98 );
   P( H, A, B, C, D, E, F, G, W[ 1], 0x71374491 );
@@ -187,17 +211,27 @@ void sha256_process( context_sha256_t *ctx, const uint8_t data[64] )
   P( C, D, E, F, G, H, A, B, R(62), 0xBEF9A3F7 );
   P( B, C, D, E, F, G, H, A, R(63), 0xC67178F2 );
 
-  ctx->state[0] += A;
-  ctx->state[1] += B;
-  ctx->state[2] += C;
-  ctx->state[3] += D;
-  ctx->state[4] += E;
-  ctx->state[5] += F;
-  ctx->state[6] += G;
-  ctx->state[7] += H;
+  state[0] += A;
+  state[1] += B;
+  state[2] += C;
+  state[3] += D;
+  state[4] += E;
+  state[5] += F;
+  state[6] += G;
+  state[7] += H;
 }
 
-void sha256_update( context_sha256_t *ctx, const uint8_t *input, uint32_t length )
+static void sha256_blocks( uint32_t state[8], const uint8_t *data, size_t blocks )
+{
+  while( blocks-- )
+    {
+      sha256_process( state, data );
+      data += 64;
+    }
+}
+
+static void sha256_update_with( context_sha256_t *ctx, const uint8_t *input, uint32_t length,
+				sha256_blocks_t blocks )
 {
   uint32_t left, fill;
 
@@ -216,17 +250,17 @@ void sha256_update( context_sha256_t *ctx, const uint8_t *input, uint32_t length
     {
       memcpy( (void *) (ctx->buffer + left),
 	      (const void *) input, fill );
-      sha256_process( ctx, ctx->buffer );
+      blocks( ctx->state, ctx->buffer, 1 );
       length -= fill;
       input  += fill;
       left = 0;
     }
 
-  while( length >= 64 )
+  if( length >= 64 )
     {
-      sha256_process( ctx, input );
-      length -= 64;
-      input  += 64;
+      blocks( ctx->state, input, length / 64 );
+      input  += length & ~0x3F;
+      length &= 0x3F;
     }
 
   if( length )
@@ -236,6 +270,11 @@ void sha256_update( context_sha256_t *ctx, const uint8_t *input, uint32_t length
     }
 }
 
+void sha256_update( context_sha256_t *ctx, const uint8_t *input, uint32_t length )
+{
+  sha256_update_with( ctx, input, length, sha256_blocks );
+}
+
 static uint8_t sha256_padding[64] =
   {
     0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
@@ -244,7 +283,7 @@ static uint8_t sha256_padding[64] =
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
   };
 
-void sha256_finish( context_sha256_t *ctx, uint8_t digest[32] )
+static void sha256_finish_with( context_sha256_t *ctx, uint8_t digest[32], sha256_blocks_t blocks )
 {
   uint32_t last, padn;
   uint32_t high, low;
@@ -260,8 +299,8 @@ void sha256_finish( context_sha256_t *ctx, uint8_t digest[32] )
   last = ctx->total[0] & 0x3F;
   padn = ( last < 56 ) ? ( 56 - last ) : ( 120 - last );
 
-  sha256_update( ctx, sha256_padding, padn );
-  sha256_update( ctx, msglen, 8 );
+  sha256_update_with( ctx, sha256_padding, padn, blocks );
+  sha256_update_with( ctx, msglen, 8, blocks );
 
   PUT_UINT32( ctx->state[0], digest,  0 );
   PUT_UINT32( ctx->state[1], digest,  4 );
@@ -273,6 +312,95 @@ void sha256_finish( context_sha256_t *ctx, uint8_t digest[32] )
   PUT_UINT32( ctx->state[7], digest, 28 );
 }
 
+void sha256_finish( context_sha256_t *ctx, uint8_t digest[32] )
+{
+  sha256_finish_with( ctx, digest, sha256_blocks );
+}
+
+#ifdef HAVE_SHA_NI
+/*
+ * The compression function using the SHA extensions (SHA-NI).
+ * The state is kept as ABEF and CDGH, which is how sha256rnds2 wants it.
+ * Each QUAD does four rounds and, while they run, works the message
+ * schedule a few words ahead; M0-M3 hold it sixteen words at a time.
+ * Only called when cpu_features() reports CPU_SHA and CPU_SSE41.
+ */
+static const uint32_t sha256_k[64] =
+  {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+  };
+
+#define QUAD(i,Mprev,Mi,Mnext)						\
+{									\
+  msg = _mm_add_epi32( Mi, _mm_loadu_si128( (const __m128i *) (sha256_k + 4*(i)) ) ); \
+  cdgh = _mm_sha256rnds2_epu32( cdgh, abef, msg );			\
+  if( (i) >= 3 && (i) <= 14 )						\
+    Mnext = _mm_sha256msg2_epu32( _mm_add_epi32( Mnext, _mm_alignr_epi8( Mi, Mprev, 4 ) ), Mi ); \
+  msg = _mm_shuffle_epi32( msg, 0x0E );					\
+  abef = _mm_sha256rnds2_epu32( abef, cdgh, msg );			\
+  if( (i) >= 1 && (i) <= 12 )						\
+    Mprev = _mm_sha256msg1_epu32( Mprev, Mi );				\
+}
+
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani( uint32_t state[8], const uint8_t *data, size_t blocks )
+{
+  const __m128i swap = _mm_set_epi64x( 0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL );
+  __m128i abef, cdgh, abef_save, cdgh_save, msg, tmp, M0, M1, M2, M3;
+
+  tmp  = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i *) &state[0] ), 0xB1 ); /* CDAB */
+  cdgh = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i *) &state[4] ), 0x1B ); /* EFGH */
+  abef = _mm_alignr_epi8( tmp, cdgh, 8 );
+  cdgh = _mm_blend_epi16( cdgh, tmp, 0xF0 );
+
+  while( blocks-- )
+    {
+      abef_save = abef;
+      cdgh_save = cdgh;
+
+      M0 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) (data +  0) ), swap );
+      M1 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) (data + 16) ), swap );
+      M2 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) (data + 32) ), swap );
+      M3 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) (data + 48) ), swap );
+
+      QUAD(  0, M3, M0, M1 );
+      QUAD(  1, M0, M1, M2 );
+      QUAD(  2, M1, M2, M3 );
+      QUAD(  3, M2, M3, M0 );
+      QUAD(  4, M3, M0, M1 );
+      QUAD(  5, M0, M1, M2 );
+      QUAD(  6, M1, M2, M3 );
+      QUAD(  7, M2, M3, M0 );
+      QUAD(  8, M3, M0, M1 );
+      QUAD(  9, M0, M1, M2 );
+      QUAD( 10, M1, M2, M3 );
+      QUAD( 11, M2, M3, M0 );
+      QUAD( 12, M3, M0, M1 );
+      QUAD( 13, M0, M1, M2 );
+      QUAD( 14, M1, M2, M3 );
+      QUAD( 15, M2, M3, M0 );
+
+      abef = _mm_add_epi32( abef, abef_save );
+      cdgh = _mm_add_epi32( cdgh, cdgh_save );
+      data += 64;
+    }
+
+  tmp  = _mm_shuffle_epi32( abef, 0x1B );	/* FEBA */
+  cdgh = _mm_shuffle_epi32( cdgh, 0xB1 );	/* DCHG */
+  _mm_storeu_si128( (__m128i *) &state[0], _mm_blend_epi16( tmp, cdgh, 0xF0 ) );
+  _mm_storeu_si128( (__m128i *) &state[4], _mm_alignr_epi8( cdgh, tmp, 8 ) );
+}
+
+#undef QUAD
+#endif
+
 #ifdef TEST
 
 #include <stdlib.h>
@@ -36,6 +36,12 @@ void hash_init_sha256(void * ctx);
 void hash_update_sha256(void * ctx, const unsigned char *buf, size_t len);
 void hash_final_sha256(void * ctx, unsigned char *digest);
 
+#ifdef HAVE_SHA_NI
+/* The same, using the x86 SHA extensions; hash_init_sha256 starts them */
+void hash_update_sha256_shani(void * ctx, const unsigned char *buf, size_t len);
+void hash_final_sha256_shani(void * ctx, unsigned char *digest);
+#endif
+
 __END_DECLS
 
 #endif /* sha256.h */
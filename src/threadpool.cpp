@@ -10,36 +10,25 @@
 #include "threadpool.h"
 
 /**
- * http://stackoverflow.com/questions/4264460/wait-for-one-of-several-threads-to-finish
- * Here is the algorithm to run the thread pool with a work queue:
+ * The pool is a work-stealing scheduler:
+ *
+ * main (and the directory walker threads):
+ *     push work item onto the injection queue
+ *     if the queue is full, wait on TOMAIN until a worker takes something
+ *     if any worker is asleep, signal TOWORKER
  *
- * main:
- *     set freethreads to numthreads
- *     init mutex M, condvars TOMAIN and TOWORKER
- *     start N worker threads
- *     while true:
- *         wait for work item
- *         claim M
- *         while freethreads == 0:
- *             cond-wait TOMAIN, M
- *         put work item in queue
- *         decrement freethreads
- *         cond-signal TOWORKER
- *         release M
- * 
  * worker:
- *     init
  *     while true:
- *         claim M
- *         while no work in queue:
- *             cond-wait TOWORKER, M
- *         get work to local storage
- *         release M
+ *         pop work from the bottom of my deque, or
+ *         take work from the injection queue, or
+ *         steal work from the top of another worker's deque
+ *         if there was none anywhere:
+ *             claim M, count myself as a sleeper, look again,
+ *             and cond-wait TOWORKER if there is still none
  *         do work
- *         claim M
- *         increment freethreads
- *         cond-signal TOMAIN
- *         release M
+ *
+ * The queues don't take locks. M is only taken to go to sleep
+ * and to wake somebody up.
  */
 
 /* Return the number of CPUs we have on various architectures.
@@ -131,21 +120,23 @@ void threadpool::win32_init()
  * BOOL pthread_win32_thread_detach_np (void);
  */
 
-threadpool::threadpool(int numworkers_)
+threadpool::threadpool(int numworkers_):
+    injection(256*numworkers_),M(),TOMAIN(),TOWORKER(),ALLDONE(),
+    sleepers(0),producer_waiting(0),done_waiting(0),quit(0),
+    submitted(0),completed(0),numworkers(numworkers_)
 {
-    numworkers		= numworkers_;
-    freethreads		= numworkers;
     if(pthread_cond_init(&TOMAIN,NULL))   ERR_QUIT(1,"pthread_cond_init #1 failed");
     if(pthread_cond_init(&TOWORKER,NULL)) ERR_QUIT(1,"pthread_cond_init #2 failed");
+    if(pthread_cond_init(&ALLDONE,NULL))  ERR_QUIT(1,"pthread_cond_init #3 failed");
 
-    // lock while I create the threads
-    M.lock();
+    // create all of the workers before any of them can look for something to steal
+    for(unsigned int i=0;i<numworkers;i++){
+	push_back(new worker(this,i));
+    }
     for(unsigned int i=0;i<numworkers;i++){
-	class worker *w = new worker(this,i);
-	push_back(w);
+	worker *w = (*this)[i];
 	pthread_create(&w->thread,NULL,worker::start_worker,(void *)w);
     }
-    M.unlock();
 }
 
 threadpool::~threadpool()
@@ -159,6 +150,7 @@ threadpool::~threadpool()
     /* Release our resources */
     pthread_cond_destroy(&TOMAIN);
     pthread_cond_destroy(&TOWORKER);
+    pthread_cond_destroy(&ALLDONE);
 
 #ifdef WIN32
 //    pthread_win32_process_detach_np();
@@ -168,104 +160,347 @@ threadpool::~threadpool()
 
 }
 
+/****************************************************************
+ *** The queues
+ ****************************************************************/
+
+static size_t round_up_pow2(size_t n)
+{
+    size_t r = 1;
+    while(r < n) r *= 2;
+    return r;
+}
+
+task_queue::task_queue(size_t capacity):cells(0),mask(0),enqueue_pos(0),dequeue_pos(0)
+{
+    capacity = round_up_pow2(capacity<2 ? 2 : capacity);
+    cells = new cell[capacity];
+    mask  = capacity-1;
+    for(size_t i=0;i<capacity;i++){
+	cells[i].seq  = i;
+	cells[i].task = 0;
+    }
+}
+
+task_queue::~task_queue()
+{
+    delete [] cells;
+}
+
+bool task_queue::push(threadpool_task *t)
+{
+    size_t pos = __atomic_load_n(&enqueue_pos,__ATOMIC_RELAXED);
+    while(true){
+	cell *c = &cells[pos & mask];
+	size_t seq = __atomic_load_n(&c->seq,__ATOMIC_ACQUIRE);
+	intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+	if(dif==0){
+	    if(__atomic_compare_exchange_n(&enqueue_pos,&pos,pos+1,true,
+					   __ATOMIC_RELAXED,__ATOMIC_RELAXED)){
+		c->task = t;
+		__atomic_store_n(&c->seq,pos+1,__ATOMIC_RELEASE);
+		return true;
+	    }
+	    // pos was reloaded by the failed exchange
+	} else if(dif<0){
+	    return false;		// full
+	} else {
+	    pos = __atomic_load_n(&enqueue_pos,__ATOMIC_RELAXED);
+	}
+    }
+}
+
+threadpool_task *task_queue::pop()
+{
+    size_t pos = __atomic_load_n(&dequeue_pos,__ATOMIC_RELAXED);
+    while(true){
+	cell *c = &cells[pos & mask];
+	size_t seq = __atomic_load_n(&c->seq,__ATOMIC_ACQUIRE);
+	intptr_t dif = (intptr_t)seq - (intptr_t)(pos+1);
+	if(dif==0){
+	    if(__atomic_compare_exchange_n(&dequeue_pos,&pos,pos+1,true,
+					   __ATOMIC_RELAXED,__ATOMIC_RELAXED)){
+		threadpool_task *t = c->task;
+		__atomic_store_n(&c->seq,pos+mask+1,__ATOMIC_RELEASE);
+		return t;
+	    }
+	} else if(dif<0){
+	    return 0;			// empty
+	} else {
+	    pos = __atomic_load_n(&dequeue_pos,__ATOMIC_RELAXED);
+	}
+    }
+}
+
+bool task_queue::empty() const
+{
+    return __atomic_load_n(&dequeue_pos,__ATOMIC_ACQUIRE) >= __atomic_load_n(&enqueue_pos,__ATOMIC_ACQUIRE);
+}
+
+task_deque::task_deque(size_t capacity):tasks(0),mask(0),top(0),bottom(0)
+{
+    capacity = round_up_pow2(capacity<2 ? 2 : capacity);
+    tasks = new threadpool_task *[capacity];
+    mask  = capacity-1;
+}
+
+task_deque::~task_deque()
+{
+    delete [] tasks;
+}
+
+bool task_deque::push(threadpool_task *t)
+{
+    int64_t b = __atomic_load_n(&bottom,__ATOMIC_RELAXED);
+    int64_t t0 = __atomic_load_n(&top,__ATOMIC_ACQUIRE);
+    if(b-t0 > mask) return false;	// full
+    __atomic_store_n(&tasks[b & mask],t,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&bottom,b+1,__ATOMIC_RELAXED);
+    return true;
+}
+
+threadpool_task *task_deque::pop()
+{
+    int64_t b = __atomic_load_n(&bottom,__ATOMIC_RELAXED)-1;
+    __atomic_store_n(&bottom,b,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t0 = __atomic_load_n(&top,__ATOMIC_RELAXED);
+    if(t0>b){
+	__atomic_store_n(&bottom,b+1,__ATOMIC_RELAXED); // it was empty
+	return 0;
+    }
+    threadpool_task *t = __atomic_load_n(&tasks[b & mask],__ATOMIC_RELAXED);
+    if(t0==b){
+	/* The last one; race the thieves for it */
+	if(!__atomic_compare_exchange_n(&top,&t0,t0+1,false,__ATOMIC_SEQ_CST,__ATOMIC_RELAXED)){
+	    t = 0;
+	}
+	__atomic_store_n(&bottom,b+1,__ATOMIC_RELAXED);
+    }
+    return t;
+}
+
+threadpool_task *task_deque::steal()
+{
+    int64_t t0 = __atomic_load_n(&top,__ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&bottom,__ATOMIC_ACQUIRE);
+    if(t0>=b) return 0;			// empty
+    threadpool_task *t = __atomic_load_n(&tasks[t0 & mask],__ATOMIC_RELAXED);
+    if(!__atomic_compare_exchange_n(&top,&t0,t0+1,false,__ATOMIC_SEQ_CST,__ATOMIC_RELAXED)){
+	return 0;			// somebody else got it
+    }
+    return t;
+}
+
+bool task_deque::empty() const
+{
+    return __atomic_load_n(&top,__ATOMIC_ACQUIRE) >= __atomic_load_n(&bottom,__ATOMIC_ACQUIRE);
+}
+
+/****************************************************************
+ *** Scheduling
+ ****************************************************************/
+
 /*
- * Send the message to kill the workers through
+ * Send the message to kill the workers through.
+ * They leave once there is no work left.
  */
 void threadpool::kill_all_workers()
 {
     M.lock();
-    int worker_count = numworkers;
+    quit = 1;
+    pthread_cond_broadcast(&TOWORKER);
     M.unlock();
-    while(worker_count>0){
-	this->schedule_work(0);
-	worker_count--;
+}
+
+/* Wake a sleeping worker, if there is one. The caller has just made work available. */
+void threadpool::wake_worker()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // the work must be visible before we look
+    if(__atomic_load_n(&sleepers,__ATOMIC_RELAXED)>0){
+	M.lock();
+	pthread_cond_signal(&TOWORKER);
+	M.unlock();
     }
 }
 
 /** 
- * work is delivered in sbufs.
- * This blocks the caller if there are no free workers.
+ * Work is delivered through the injection queue.
+ * This only blocks the caller if the queue is full.
  */
-void threadpool::schedule_work(file_data_hasher_t *fdht)
+void threadpool::schedule_work(threadpool_task *t)
 {
-    M.lock();
-    while(freethreads==0){
-	// wait until a thread is free (doesn't matter which)
+    __atomic_fetch_add(&submitted,1,__ATOMIC_SEQ_CST);
+    while(injection.push(t)==false){
+	M.lock();
+	__atomic_fetch_add(&producer_waiting,1,__ATOMIC_SEQ_CST);
+	if(injection.push(t)){		// a worker took something before it saw us
+	    __atomic_fetch_sub(&producer_waiting,1,__ATOMIC_SEQ_CST);
+	    M.unlock();
+	    break;
+	}
 	if(pthread_cond_wait(&TOMAIN,&M.mutex)){
 	    ERR_QUIT(1,"threadpool::schedule_work pthread_cond_wait failed");
 	}
+	__atomic_fetch_sub(&producer_waiting,1,__ATOMIC_SEQ_CST);
+	M.unlock();
     }
-    work_queue.push(fdht); 
-    freethreads--;
-    pthread_cond_signal(&TOWORKER);
-    M.unlock();
+    wake_worker();
 }
 
-unsigned int threadpool::get_free_count()
+/**
+ * Put work on a worker's own deque, where idle workers can steal it.
+ * Must be called by that worker, and never waits.
+ */
+bool threadpool::schedule_local(unsigned int workerid,threadpool_task *t)
 {
-    M.lock();
-    unsigned int ret = freethreads;
-    M.unlock();
-    return ret;
+    __atomic_fetch_add(&submitted,1,__ATOMIC_SEQ_CST);
+    if((*this)[workerid]->deque.push(t)==false){
+	__atomic_fetch_sub(&submitted,1,__ATOMIC_SEQ_CST);
+	return false;
+    }
+    wake_worker();
+    return true;
 }
 
-/* Run the worker.
- * Each worker runs run...
+/**
+ * Run whatever nobody stole from a worker's deque.
+ * Must be called by that worker.
  */
-void *worker::run()
+void threadpool::run_local(unsigned int workerid)
+{
+    worker *w = (*this)[workerid];
+    threadpool_task *t;
+    while((t = w->deque.pop()) != 0){
+	t->run(w);
+	task_done();
+    }
+}
+
+/* Count a finished task, and tell main if it was the last one */
+void threadpool::task_done()
+{
+    uint64_t c = __atomic_add_fetch(&completed,1,__ATOMIC_SEQ_CST);
+    if(c==__atomic_load_n(&submitted,__ATOMIC_SEQ_CST)
+       && __atomic_load_n(&done_waiting,__ATOMIC_SEQ_CST)){
+	M.lock();
+	pthread_cond_broadcast(&ALLDONE);
+	M.unlock();
+    }
+}
+
+bool threadpool::work_available()
+{
+    if(injection.empty()==false) return true;
+    for(size_t i=0;i<size();i++){
+	if((*this)[i]->deque.empty()==false) return true;
+    }
+    return false;
+}
+
+/*
+ * Find the next thing for a worker to do, sleeping if there is nothing.
+ * Returns 0 when we are quitting and there is no work left.
+ */
+threadpool_task *threadpool::get_task(worker *w)
 {
     while(true){
-	/* Get the lock, then wait for the queue to be empty.
-	 * If it is not empty, wait for the lock again.
-	 */
-	master->M.lock();
-	while(master->work_queue.empty()){
-	    /* I didn't get any work; go back to sleep */
-	    if(pthread_cond_wait(&master->TOWORKER,&master->M.mutex)){
+	threadpool_task *t = w->deque.pop();
+	if(t) return t;
+
+	t = injection.pop();
+	if(t){
+	    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+	    if(__atomic_load_n(&producer_waiting,__ATOMIC_RELAXED)){
+		M.lock();
+		pthread_cond_broadcast(&TOMAIN); // there's room now
+		M.unlock();
+	    }
+	    return t;
+	}
+
+	/* Try everybody else, starting with whoever we tried last */
+	unsigned int n = size();
+	for(unsigned int i=0;i<n;i++){
+	    unsigned int victim = (w->next_victim + i) % n;
+	    if(victim==(unsigned int)w->workerid) continue;
+	    t = (*this)[victim]->deque.steal();
+	    if(t){
+		w->next_victim = victim;
+		return t;
+	    }
+	}
+
+	/* Nothing anywhere; go to sleep unless something arrived while we looked */
+	M.lock();
+	__atomic_fetch_add(&sleepers,1,__ATOMIC_SEQ_CST);
+	bool again = work_available();
+	if(again==false && quit){
+	    __atomic_fetch_sub(&sleepers,1,__ATOMIC_SEQ_CST);
+	    M.unlock();
+	    return 0;			// told to exit
+	}
+	if(again==false){
+	    if(pthread_cond_wait(&TOWORKER,&M.mutex)){
 		fprintf(stderr,"pthread_cond_wait error=%d\n",errno);
 		exit(1);
 	    }
 	}
-	file_data_hasher_t *fdht = master->work_queue.front(); // get the sbuf
-	master->work_queue.pop();		   // pop from the list
-	master->M.unlock();
-	if(fdht==0) {
-	    break;			// told to exit
-	}
-	do_work(fdht);
-	master->M.lock();
-	master->freethreads++;
-	pthread_cond_signal(&master->TOMAIN); // tell the master that we are free!
-	master->M.unlock();
+	__atomic_fetch_sub(&sleepers,1,__ATOMIC_SEQ_CST);
+	M.unlock();
+    }
+}
+
+/* Run the worker.
+ * Each worker runs run...
+ */
+void *worker::run()
+{
+    while(true){
+	threadpool_task *t = master->get_task(this);
+	if(t==0) break;			// told to exit
+	t->run(this);
+	master->task_done();
     }
-    master->M.lock();
-    master->numworkers--;
-    master->M.unlock();
+    __atomic_fetch_sub(&master->numworkers,1,__ATOMIC_SEQ_CST);
     return 0;
 }
 
+uint64_t threadpool::jobs_in_flight() const
+{
+    /* Read completed first, so that we never see more completed than submitted */
+    uint64_t c = jobs_completed();
+    return jobs_submitted() - c;
+}
+
 bool threadpool::all_free() 
 {
-    return numworkers == get_free_count();
+    return jobs_in_flight()==0;
 }
 
 unsigned int threadpool::num_workers() 
 {
-    M.lock();
-    unsigned int ret = numworkers;
-    M.unlock();
-    return ret;
+    return __atomic_load_n(&numworkers,__ATOMIC_SEQ_CST);
 }
 
+/*
+ * Sleep until the last task finishes. The worker that finishes it
+ * sees done_waiting and wakes us; we look again after setting it
+ * so that we can't miss that.
+ */
 void threadpool::wait_till_all_free()
 {
+    M.lock();
+    __atomic_store_n(&done_waiting,1,__ATOMIC_SEQ_CST);
     while(all_free()==false){
-#ifdef HAVE_USLEEP
-	usleep(50);
-#else	    
-	sleep(1);
-#endif
+	if(pthread_cond_wait(&ALLDONE,&M.mutex)){
+	    ERR_QUIT(1,"threadpool::wait_till_all_free pthread_cond_wait failed");
+	}
     }
+    __atomic_store_n(&done_waiting,0,__ATOMIC_SEQ_CST);
+    M.unlock();
 }
 
 
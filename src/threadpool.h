@@ -8,7 +8,6 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <algorithm>
-#include <queue>
 #include <vector>
 
 class mutex_t {
@@ -45,19 +44,110 @@ public:
     }
 };
 
+/*
+ * Anything a worker can run: files to hash, and helpers for
+ * files that are being hashed piecewise.
+ */
+class threadpool_task {
+public:
+    virtual ~threadpool_task(){}
+    virtual void run(class worker *w)=0; // must delete the task if it was allocated for this run
+};
+
+/*
+ * task_queue is a bounded multi-producer, multi-consumer queue that
+ * doesn't lock (Dmitry Vyukov's algorithm). Each cell carries a sequence
+ * number that says whether it is ready to be written or to be read.
+ * It is how work gets into the pool from outside.
+ */
+class task_queue {
+private:
+    task_queue(const task_queue &);
+    task_queue &operator=(const task_queue &);
+    struct cell {
+	size_t		seq;
+	threadpool_task	*task;
+    };
+    cell		*cells;
+    size_t		mask;		// capacity-1; the capacity is a power of 2
+    char		pad0[64];	// keep the producers and consumers on their own cache lines
+    size_t		enqueue_pos;
+    char		pad1[64];
+    size_t		dequeue_pos;
+    char		pad2[64];
+public:
+    task_queue(size_t capacity);
+    ~task_queue();
+    bool push(threadpool_task *t);	// false if full
+    threadpool_task *pop();		// 0 if empty
+    bool empty() const;
+};
+
+/*
+ * task_deque is a fixed size Chase-Lev work-stealing deque.
+ * Only the worker that owns it pushes and pops, at the bottom;
+ * other workers steal from the top.
+ */
+class task_deque {
+private:
+    task_deque(const task_deque &);
+    task_deque &operator=(const task_deque &);
+    threadpool_task	**tasks;
+    int64_t		mask;
+    char		pad0[64];
+    int64_t		top;
+    char		pad1[64];
+    int64_t		bottom;
+    char		pad2[64];
+public:
+    task_deque(size_t capacity);
+    ~task_deque();
+    bool push(threadpool_task *t);	// owner only; false if full
+    threadpool_task *pop();		// owner only; 0 if empty
+    threadpool_task *steal();		// anyone; 0 if empty or we lost a race
+    bool empty() const;
+};
+
+/*
+ * The threadpool. Work from the main thread goes into the injection
+ * queue, which only makes the caller wait when it is full. Work that a
+ * worker creates goes onto its own deque. A worker runs its own work
+ * first, then takes from the injection queue, then steals from the
+ * other workers, and sleeps when there is nothing anywhere.
+ */
 class threadpool: public std::vector<class worker *> {
+    friend class worker;
+private:
+    task_queue		injection;
+    mutex_t		M;		// for sleeping; protects nothing else
+    pthread_cond_t	TOMAIN;		// room in the injection queue
+    pthread_cond_t	TOWORKER;	// there is work, or we are quitting
+    pthread_cond_t	ALLDONE;	// every task submitted has completed
+    volatile unsigned int sleepers;	// workers waiting on TOWORKER
+    volatile unsigned int producer_waiting; // threads waiting on TOMAIN to schedule work
+    volatile unsigned int done_waiting;	// main is waiting on ALLDONE
+    volatile unsigned int quit;
+    volatile uint64_t	submitted;	// tasks scheduled so far
+    volatile uint64_t	completed;	// tasks finished so far
+    void		wake_worker();
+    void		task_done();
+    bool		work_available();
+    threadpool_task	*get_task(class worker *w); // 0 when it is time to exit
 public:
     static void		win32_init(); // must be called under win32 to initialize posix threads
-    mutex_t		M;			// protects the following variables
     volatile unsigned int numworkers;
-    volatile unsigned int freethreads;
-    pthread_cond_t	TOMAIN;
-    pthread_cond_t	TOWORKER;
-    std::queue<class file_data_hasher_t *> work_queue;
-    unsigned int	get_free_count();
-    void		schedule_work(class file_data_hasher_t *);
+    void		schedule_work(threadpool_task *); // waits only while the injection queue is full
+    bool		schedule_local(unsigned int workerid,threadpool_task *); // called by that worker; false if full
+    void		run_local(unsigned int workerid); // run whatever is left on that worker's deque
+    unsigned int	idle_workers() const { return __atomic_load_n(&sleepers,__ATOMIC_SEQ_CST); }
     bool		all_free() ;
-    void		wait_till_all_free();
+    void		wait_till_all_free(); // sleeps until every task submitted has completed
+
+    /* Counters for this run */
+    uint64_t		jobs_submitted() const { return __atomic_load_n(&submitted,__ATOMIC_SEQ_CST); }
+    uint64_t		jobs_completed() const { return __atomic_load_n(&completed,__ATOMIC_SEQ_CST); }
+    uint64_t		jobs_in_flight() const;
+
     void		kill_all_workers();
     static int		numCPU();
     threadpool(int numworkers);
@@ -66,13 +156,18 @@ public:
 };
 
 class worker {
+private:
+    worker(const worker &);
+    worker &operator=(const worker &);
 public:
     static void * start_worker(void *arg){return ((worker *)arg)->run();};
-    worker(class threadpool *master_,int workerid_): master(master_),workerid(workerid_){}
+    worker(class threadpool *master_,int workerid_):
+	master(master_),thread(),workerid(workerid_),deque(256),next_victim(workerid_+1){}
     class threadpool *master;		// my master
     pthread_t thread;			// my thread; set when I am created
     int	workerid;			// my workerID, numbered 0 through numworkers-1
+    task_deque deque;			// work that I made; others may steal it
+    unsigned int next_victim;		// who I try to steal from first
     void *run();
-    void do_work(class file_data_hasher_t *); // must delete fdht when done
 };
 #endif
@@ -252,21 +252,33 @@ void XML::spaces()
     puts(sp);
 }
 
-void XML::writexml(const string &xml)
+/**
+ * Append xml to dest, with every line indented for depth.
+ */
+void XML::indent_xml(string &dest,const string &xml,size_t depth)
 {
-    bool first = true;
-    for(string::const_iterator it = xml.begin(); it!=xml.end(); it++){
-	if(first){
-	    spaces();
-	    first = false;
-	}
-	fputc(*it,out);
-	if((*it)=='\n'){
-	    first = true;
-	}
+    size_t start = 0;
+    while(start < xml.size()){
+	size_t nl = xml.find('\n',start);
+	size_t end = (nl==string::npos) ? xml.size() : nl+1;
+	dest.append(2*depth,' ');
+	dest.append(xml,start,end-start);
+	start = end;
     }
 }
 
+void XML::writexml(const string &xml)
+{
+    string buf;
+    indent_xml(buf,xml,tag_stack.size());
+    fputs(buf.c_str(),out);
+}
+
+void XML::write_fragment(const string &xml)
+{
+    fwrite(xml.data(),1,xml.size(),out);
+}
+
 void XML::tagout(const string &tag,const string &attribute)
 {
     verify_tag(tag);
@@ -332,3 +344,52 @@ void XML::comment(const string &comment_)
 }
 
 
+
+/****************************************************************
+ *** fragment
+ ****************************************************************/
+
+void XML::fragment::tagout(const string &tag,const string &attribute)
+{
+    buf += '<';
+    buf += tag;
+    if(attribute.size()>0){
+	buf += ' ';
+	buf += attribute;
+    }
+    buf += '>';
+}
+
+void XML::fragment::push(const string &tag,const string &attribute)
+{
+    spaces();
+    tag_stack.push(tag);
+    tagout(tag,attribute);
+    buf += '\n';
+}
+
+void XML::fragment::pop()
+{
+    assert(tag_stack.size()>0);
+    string tag = tag_stack.top();
+    tag_stack.pop();
+    spaces();
+    tagout("/"+tag,"");
+    buf += '\n';
+}
+
+void XML::fragment::xmlout(const string &tag,const string &value,const string &attribute,bool escape_value)
+{
+    spaces();
+    tagout(tag,attribute);
+    buf += escape_value ? xmlescape(value) : value;
+    tagout("/"+tag,"");
+    buf += '\n';
+}
+
+void XML::fragment::xmlout(const string &tag,const int64_t value)
+{
+    char num[32];
+    snprintf(num,sizeof(num),"%"PRId64,value);
+    xmlout(tag,num,"",false);
+}
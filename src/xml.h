@@ -71,6 +71,7 @@ class XML {
     struct timeval t0;
 
 public:
+    class fragment;
     void make_indent(){spaces();}
     static std::string make_command_line(int argc,char * const *argv){
 	std::string command_line;
@@ -95,6 +96,11 @@ public:
     void open();			// opens the output file
     void close();			// writes the output to the file
     void writexml(const std::string &xml); // writes formatted xml with indentation
+    static void indent_xml(std::string &dest,const std::string &xml,size_t depth); // appends xml, indented
+    size_t depth() const { return tag_stack.size(); } // how many tags are open
+    void declare_tag(const std::string &tag){ verify_tag(tag); } // for tags only written in fragments
+    void write_fragment(const std::string &xml); // writes xml that was rendered elsewhere, as is
+    void flush(){ fflush(out); }
     void tagout(const std::string &tag,const std::string &attribute);
     void xmlout(const std::string &tag,const std::string &value, const std::string &attribute,const bool escape_value);
     void xmlout(const std::string &tag,const std::string &value){ xmlout(tag,value,"",true); }
@@ -223,6 +229,30 @@ public:
 #endif
     }
 };
+
+/**
+ * A fragment is XML rendered into a string, indented as if an XML at
+ * the given depth had written it. Threads can render fragments at the
+ * same time and hand them to XML::write_fragment(). Tags are not checked
+ * or added to the DTD; use XML::declare_tag() for those.
+ */
+class XML::fragment {
+    std::string buf;
+    std::stack<std::string> tag_stack;
+    size_t base_depth;
+    void spaces(){ buf.append(2*(base_depth+tag_stack.size()),' '); }
+    void tagout(const std::string &tag,const std::string &attribute);
+public:
+    fragment(size_t depth):buf(),tag_stack(),base_depth(depth){}
+    const std::string &str() const { return buf; }
+    void push(const std::string &tag,const std::string &attribute);
+    void push(const std::string &tag) {push(tag,"");}
+    void pop();
+    void xmlout(const std::string &tag,const std::string &value, const std::string &attribute,const bool escape_value);
+    void xmlout(const std::string &tag,const std::string &value){ xmlout(tag,value,"",true); }
+    void xmlout(const std::string &tag,const int64_t value);
+    void writexml(const std::string &xml){ indent_xml(buf,xml,base_depth+tag_stack.size()); }
+};
 #endif
 
 #endif
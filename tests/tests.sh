@@ -336,6 +336,265 @@ do
   done
 done
 
+
+# The options that the reference version doesn't have are tested against
+# the version under test itself: each command must give the same output
+# as its reference command, which hashes the same files the plain way.
+# Output is sorted unless the order is what is being tested (-O), and the
+# ## lines of hashdeep's header, which show the command, are dropped.
+# Standard error is compared too, unless the command is expected to warn;
+# it is sorted when the threads may find the same problems in another order.
+# A command whose output is a report, such as timings, only has its exit
+# status and standard error compared.
+# A test that hasn't finished after five minutes has failed.
+
+TIMEOUT=""
+if which timeout >/dev/null 2>&1 ; then TIMEOUT="timeout 300" ; fi
+# Every algorithm; -c all would also turn on sha3, which has no implementation
+ALL=md5,sha1,sha256,tiger,whirlpool
+
+echo Creating the files for the tests of new options
+/bin/rm -rf ordered
+mkdir ordered
+echo hi > ordered/small
+for ((j=0;j<=4200;j++)); do
+  dd if=/dev/zero of=ordered/big$j bs=1 count=0 seek=70000 2>/dev/null
+done
+
+# A large file, and a tree of files of every size up to 1200 bytes, all
+# taken from it: enough files to keep every thread busy, and every way a
+# file's last block can end.
+/bin/rm -rf options
+mkdir options
+cat $TMP/dir_a/web2 $TMP/dir_a/dir_b/web2a > options/large
+for ((j=0;j<1200;j++)); do
+  d=options/many/d$((j%8))/e$((j%3))
+  mkdir -p $d
+  head -c $j options/large > $d/f$j
+done
+
+# Known hashes of those files, among more than enough others to be loaded
+# in chunks and to be worth putting a filter in front of
+$GOOD_BIN/hashdeep$EXE -r options > known-big.txt
+$GOOD_BIN/md5deep$EXE  -r options > known-big-md5.txt
+awk 'BEGIN { for (i=0;i<70000;i++) {
+  h = sprintf("%08x%08x%08x%08x",i,i*7,i*13,i*17)
+  printf "%d,%s,%s%s,/nowhere/f%d\n",i,h,h,h,i } }' >> known-big.txt
+awk 'BEGIN { for (i=0;i<70000;i++) {
+  printf "%08x%08x%08x%08x  /nowhere/f%d\n",i,i*7,i*13,i*17,i } }' >> known-big-md5.txt
+
+# Those files' hashes in the other formats md5deep reads, and in plain
+# lists of each algorithm to compare them with
+$GOOD_BIN/hashdeep$EXE -c md5,sha1,sha256 -r options | grep -v '^[%#]' | tr -d \\r > known-all.txt
+awk -F, '{ print $2 "  " $5 }' known-all.txt > known-md5.txt
+awk -F, '{ print $3 "  " $5 }' known-all.txt > known-sha1.txt
+awk -F, '{ print $4 "  " $5 }' known-all.txt > known-sha256.txt
+awk -F, 'BEGIN { print "\"SHA-1\",\"MD5\",\"CRC32\",\"FileName\",\"FileSize\",\"ProductCode\",\"OpSystemCode\",\"SpecialCode\"" }
+  { printf "\"%s\",\"%s\",\"00000000\",\"f%d\",%s,1,\"WIN\",\"\"\n",toupper($3),toupper($2),NR,$1 }' \
+  known-all.txt > known-nsrl20.txt
+awk -F, 'BEGIN { print "\"SHA-1\",\"FileName\",\"FileSize\",\"ProductCode\",\"OpSystemCode\",\"MD4\",\"MD5\",\"CRC32\",\"SpecialCode\"" }
+  { printf "\"%s\",\"f%d\",%s,1,\"WIN\",\"\",\"%s\",\"00000000\",\"\"\n",toupper($3),NR,$1,toupper($2) }' \
+  known-all.txt > known-nsrl15.txt
+awk -F, 'BEGIN { print "\"file_id\",\"hashset_id\",\"file_name\",\"directory\",\"hash\",\"file_size\",\"date_modified\",\"time_modified\",\"time_zone\",\"comments\",\"date_accessed\",\"time_accessed\"" }
+  { printf "%d,1,\"f%d\",\"D:\\\",%s,%s,01/01/2000,00:00:00,\"\",\"\",01/01/2000,00:00:00\n",NR,NR,$2,$1 }' \
+  known-all.txt > known-hashkeeper.txt
+awk -F, 'BEGIN { print "V4Hash,HashSHA1,FileName,FilePath,FileSize,HashSHA256,HashSHA384,HashSHA512,CreateTime,ModTime,LastAccessTime" }
+  { printf "%s,%s,f%d,D:\\,%s,%s,,,1.1.2000 00:00:00,1.1.2000 00:00:00,1.1.2000\n",toupper($2),toupper($3),NR,$1,toupper($4) }' \
+  known-all.txt > known-ilook4.txt
+
+# An EnCase hash set of the big list: a header, then each MD5 with two
+# more bytes. It has more hashes than are read from it at a time.
+n=`awk 'END { print NR }' known-big-md5.txt`
+awk -v n=$n 'BEGIN { hex = "0123456789abcdef"
+    printf "HASH\\r\\n\\377\\000\\001\\000\\000\\000\\000\\000\\000\\000"
+    for (k=0;k<4;k++) { printf "\\%03o", n%256; n = int(n/256) }
+    for (k=20;k<1152;k++) printf "\\000"
+    printf "\n" }
+  { h = tolower($1)
+    for (k=1;k<=32;k+=2) printf "\\%03o", (index(hex,substr(h,k,1))-1)*16 + index(hex,substr(h,k+1,1))-1
+    printf "\\000\\000"
+    if (NR%1000==0) printf "\n" }
+  END { printf "\n" }' known-big-md5.txt |
+  while read -r line ; do printf "$line" ; done > known-encase.hash
+
+# The same hashes compiled into indexes with -G, an index of an index
+# and a text file together, and an index of hashes the big lists don't have
+/bin/rm -f known-*.idx
+$TEST_BIN/hashdeep$EXE -k known-big.txt -G known-big.idx
+$TEST_BIN/md5deep$EXE  -m known-big-md5.txt -G known-big-md5.idx
+$TEST_BIN/hashdeep$EXE -k known-big.idx -k hashlist-hashdeep-full.txt -G known-mixed.idx
+$TEST_BIN/md5deep$EXE  -m hashlist-md5deep-full.txt -G known-full-md5.idx
+
+for ((i=1;;i++))
+do
+  cmd=""
+  ref=""
+  sorted=yes
+  output=yes
+  errors=yes
+  case $i in
+    # -O with a small file ahead of more large ones than -O keeps in flight
+    1) cmd="$TEST_BIN/md5deep$EXE -j4 -O ordered/small ordered/big*" ;
+       ref="$TEST_BIN/md5deep$EXE -j0    ordered/small ordered/big*" ; sorted=no ;;
+    # -O reads directories with one thread, so -J doesn't change the order
+    2) cmd="$TEST_BIN/md5deep$EXE -j4 -J4 -O -r $HTMP" ;
+       ref="$TEST_BIN/md5deep$EXE -j0        -r $HTMP" ; sorted=no ; errors=no ;;
+    # -R changes only how much is read at a time
+    3) cmd="$TEST_BIN/hashdeep$EXE -c $ALL -R 64k -r options" ;
+       ref="$TEST_BIN/hashdeep$EXE -c $ALL        -r options" ;;
+    4) cmd="$TEST_BIN/md5deep$EXE -R 16m options/large" ;
+       ref="$TEST_BIN/md5deep$EXE        options/large" ;;
+    # -P hashes each algorithm on its own thread
+    5) cmd="$TEST_BIN/hashdeep$EXE -c $ALL -P 1 -j4 -r options" ;
+       ref="$TEST_BIN/hashdeep$EXE -c $ALL      -j0 -r options" ;;
+    6) cmd="$TEST_BIN/hashdeep$EXE -c $ALL -P 1m -j0 options/large" ;
+       ref="$TEST_BIN/hashdeep$EXE -c $ALL       -j0 options/large" ;;
+    # -p hashes the pieces of a large file on several workers, but writes them in order
+    7) cmd="$TEST_BIN/md5deep$EXE -p 100k -j4 options/large" ;
+       ref="$TEST_BIN/md5deep$EXE -p 100k -j0 options/large" ; sorted=no ;;
+    8) cmd="$TEST_BIN/hashdeep$EXE -c $ALL -p 4k -j8 -r options" ;
+       ref="$TEST_BIN/hashdeep$EXE -c $ALL -p 4k -j0 -r options" ;;
+    # More workers than there are processors, with pieces to steal from each other
+    9) cmd="$TEST_BIN/md5deep$EXE -j16 -r options ordered" ;
+       ref="$TEST_BIN/md5deep$EXE -j0  -r options ordered" ;;
+   10) cmd="$TEST_BIN/sha1deep$EXE -j16 -p 8k -r options ordered" ;
+       ref="$TEST_BIN/sha1deep$EXE -j0  -p 8k -r options ordered" ;;
+    # -J reads directories with several threads
+   11) cmd="$TEST_BIN/md5deep$EXE -J4 -j4 -r options" ;
+       ref="$TEST_BIN/md5deep$EXE     -j0 -r options" ;;
+   12) cmd="$TEST_BIN/hashdeep$EXE -J8 -r $HTMP" ;
+       ref="$TEST_BIN/hashdeep$EXE     -r $HTMP" ; errors=sorted ;;
+    # -L writes each line as soon as it is computed instead of in batches
+   13) cmd="$TEST_BIN/md5deep$EXE -L -j4 -r options" ;
+       ref="$TEST_BIN/md5deep$EXE    -j0 -r options" ;;
+   14) cmd="$TEST_BIN/md5deep$EXE -L -j4 -M hashlist-md5deep-full.txt -r $HTMP options" ;
+       ref="$TEST_BIN/md5deep$EXE    -j0 -M hashlist-md5deep-full.txt -r $HTMP options" ; errors=sorted ;;
+    # -O writes the results in the order that one thread would
+   15) cmd="$TEST_BIN/hashdeep$EXE -O -j8 -r options ordered" ;
+       ref="$TEST_BIN/hashdeep$EXE    -j0 -r options ordered" ; sorted=no ;;
+   16) cmd="$TEST_BIN/md5deep$EXE -O -j4 -p 256k -r options" ;
+       ref="$TEST_BIN/md5deep$EXE    -j0 -p 256k -r options" ; sorted=no ;;
+   17) cmd="$TEST_BIN/sha256deep$EXE -O -L -j4 -r options ordered" ;
+       ref="$TEST_BIN/sha256deep$EXE       -j0 -r options ordered" ; sorted=no ;;
+    # Known hashes are loaded in chunks by every thread
+   18) cmd="$TEST_BIN/hashdeep$EXE -j8 -k known-big.txt -m -r options" ;
+       ref="$TEST_BIN/hashdeep$EXE -j0 -k known-big.txt -m -r options" ;;
+   19) cmd="$TEST_BIN/md5deep$EXE -j8 -x known-big-md5.txt -r options ordered" ;
+       ref="$TEST_BIN/md5deep$EXE -j0 -x known-big-md5.txt -r options ordered" ;;
+    # An index written by -G matches what the files it was compiled from did
+   20) cmd="$TEST_BIN/hashdeep$EXE -k known-big.idx -m -r options" ;
+       ref="$TEST_BIN/hashdeep$EXE -k known-big.txt -m -r options" ;;
+   21) cmd="$TEST_BIN/hashdeep$EXE -k known-big.idx -a -v -r options" ;
+       ref="$TEST_BIN/hashdeep$EXE -N -k known-big.txt -a -v -r options" ;;
+   22) cmd="$TEST_BIN/md5deep$EXE -x known-big-md5.idx -r options ordered" ;
+       ref="$TEST_BIN/md5deep$EXE -x known-big-md5.txt -r options ordered" ;;
+   23) cmd="$TEST_BIN/hashdeep$EXE -k known-mixed.idx -w -m -r $HTMP options" ;
+       ref="$TEST_BIN/hashdeep$EXE -k known-big.txt -k hashlist-hashdeep-full.txt -w -m -r $HTMP options" ;;
+    # The Bloom filter in front of the known hashes changes nothing that is found
+   24) cmd="$TEST_BIN/hashdeep$EXE    -k known-big.txt -x -r options ordered" ;
+       ref="$TEST_BIN/hashdeep$EXE -N -k known-big.txt -x -r options ordered" ;;
+   25) cmd="$TEST_BIN/hashdeep$EXE    -k known-big.txt -a -r options" ;
+       ref="$TEST_BIN/hashdeep$EXE -N -k known-big.txt -a -r options" ;;
+   26) cmd="$TEST_BIN/md5deep$EXE    -m known-big-md5.idx -m hashlist-md5deep-full.txt -r $HTMP options" ;
+       ref="$TEST_BIN/md5deep$EXE -N -m known-big-md5.idx -m hashlist-md5deep-full.txt -r $HTMP options" ; errors=sorted ;;
+    # NSRL, HashKeeper and iLook files find what the plain lists of their hashes do
+   27) cmd="$TEST_BIN/md5deep$EXE  -m known-nsrl20.txt -r options ordered" ;
+       ref="$TEST_BIN/md5deep$EXE  -m known-md5.txt    -r options ordered" ;;
+   28) cmd="$TEST_BIN/sha1deep$EXE -x known-nsrl20.txt -r options ordered" ;
+       ref="$TEST_BIN/sha1deep$EXE -x known-sha1.txt   -r options ordered" ;;
+   29) cmd="$TEST_BIN/md5deep$EXE  -x known-nsrl15.txt -r options ordered" ;
+       ref="$TEST_BIN/md5deep$EXE  -x known-md5.txt    -r options ordered" ;;
+   30) cmd="$TEST_BIN/sha1deep$EXE -m known-nsrl15.txt -r options ordered" ;
+       ref="$TEST_BIN/sha1deep$EXE -m known-sha1.txt   -r options ordered" ;;
+   31) cmd="$TEST_BIN/md5deep$EXE  -m known-hashkeeper.txt -r options ordered" ;
+       ref="$TEST_BIN/md5deep$EXE  -m known-md5.txt        -r options ordered" ;;
+   32) cmd="$TEST_BIN/md5deep$EXE    -x known-ilook4.txt -r options ordered" ;
+       ref="$TEST_BIN/md5deep$EXE    -x known-md5.txt    -r options ordered" ;;
+   33) cmd="$TEST_BIN/sha1deep$EXE   -m known-ilook4.txt -r options ordered" ;
+       ref="$TEST_BIN/sha1deep$EXE   -m known-sha1.txt   -r options ordered" ;;
+   34) cmd="$TEST_BIN/sha256deep$EXE -m known-ilook4.txt -r options ordered" ;
+       ref="$TEST_BIN/sha256deep$EXE -m known-sha256.txt -r options ordered" ;;
+    # An EnCase hash set is loaded in bulk
+   35) cmd="$TEST_BIN/md5deep$EXE -m known-encase.hash  -r options ordered" ;
+       ref="$TEST_BIN/md5deep$EXE -m known-big-md5.txt  -r options ordered" ;;
+   36) cmd="$TEST_BIN/md5deep$EXE -x known-encase.hash  -r options ordered" ;
+       ref="$TEST_BIN/md5deep$EXE -x known-big-md5.txt  -r options ordered" ;;
+    # The implementations chosen for this processor hash like the portable ones,
+    # and -T kernels finds that each one agrees with the others
+   37) cmd="$TEST_BIN/hashdeep$EXE             -c $ALL options/large" ;
+       ref="$TEST_BIN/hashdeep$EXE -H portable -c $ALL options/large" ;;
+   38) cmd="$TEST_BIN/hashdeep$EXE             -c md5,sha1,sha256 -p 1000 options/large" ;
+       ref="$TEST_BIN/hashdeep$EXE -H portable -c md5,sha1,sha256 -p 1000 options/large" ;;
+   39) cmd="$TEST_BIN/hashdeep$EXE -T kernels" ;
+       ref="true" ; output=no ;;
+    # Small files are hashed in batches, one in each lane, where the processor
+    # has lanes; the portable implementation hashes them one at a time
+   40) cmd="$TEST_BIN/md5deep$EXE                -j4 -r options/many" ;
+       ref="$TEST_BIN/md5deep$EXE    -H portable -j0 -r options/many" ;;
+   41) cmd="$TEST_BIN/sha256deep$EXE             -j0 -r options/many" ;
+       ref="$TEST_BIN/sha256deep$EXE -H portable -j0 -r options/many" ;;
+   42) cmd="$TEST_BIN/hashdeep$EXE               -c md5,sha1,sha256 -j4 -r options" ;
+       ref="$TEST_BIN/hashdeep$EXE   -H portable -c md5,sha1,sha256 -j0 -r options" ;;
+   43) cmd="$TEST_BIN/sha1deep$EXE               -O -j4 -r options" ;
+       ref="$TEST_BIN/sha1deep$EXE   -H portable    -j0 -r options" ; sorted=no ;;
+    # A hash the filter of a big list turns away is still found in an index
+   44) cmd="$TEST_BIN/md5deep$EXE    -m known-big-md5.txt -m known-full-md5.idx -r $HTMP options" ;
+       ref="$TEST_BIN/md5deep$EXE -N -m known-big-md5.txt -m known-full-md5.idx -r $HTMP options" ; errors=sorted ;;
+    # -T hex finds that the hex code in use agrees with the portable table
+   45) cmd="$TEST_BIN/md5deep$EXE -T hex" ;
+       ref="true" ; output=no ;;
+  esac
+  if [ x"$cmd" = "x" ]
+  then
+    break
+  fi
+  /bin/echo -n option test $i ...
+  if [ $verbose = "yes" ]; then
+    echo $cmd
+  fi
+  for run in ref tst
+  do
+    if [ $run = "ref" ]; then c=$ref; else c=$cmd; fi
+    if [ $sorted = "yes" ]; then
+      $TIMEOUT $c 2>$run/option$i.err | grep -v '^##' | tr -d \\r | sort > $run/option$i.out
+      echo ${PIPESTATUS[0]} > $run/option$i.status
+    else
+      $TIMEOUT $c 2>$run/option$i.err | grep -v '^##' | tr -d \\r         > $run/option$i.out
+      echo ${PIPESTATUS[0]} > $run/option$i.status
+    fi
+  done
+  if [ $output = "no" ]; then
+    cp ref/option$i.out tst/option$i.out
+  fi
+  if [ $errors = "no" ]; then
+    cp ref/option$i.err tst/option$i.err
+  fi
+  if [ $errors = "sorted" ]; then
+    for run in ref tst
+    do
+      sort $run/option$i.err > $run/option$i.errs
+      mv -f $run/option$i.errs $run/option$i.err
+    done
+  fi
+  # A command killed by a signal, or by the timeout, fails even when both did
+  if [ `cat ref/option$i.status` -lt 124 ] && \
+     diff ref/option$i.out tst/option$i.out >/dev/null && \
+     diff ref/option$i.err tst/option$i.err >/dev/null && \
+     diff ref/option$i.status tst/option$i.status >/dev/null ; then
+    echo passes.
+  else
+    echo ======================================
+    echo OPTION TEST $i FAILED
+    echo COMMAND:   $cmd
+    echo REFERENCE: $ref
+    echo STATUS:    `cat ref/option$i.status` `cat tst/option$i.status`
+    diff ref/option$i.out tst/option$i.out | head -20
+    diff ref/option$i.err tst/option$i.err | head -20
+    echo ======================================
+    ((fails++))
+  fi
+done
+
 echo Total Failures: $fails
 exit $fails
   